@@ -0,0 +1,995 @@
+/** @file resolv_bench_main.c
+ *  @brief Load generator and latency benchmark for the resolver built on Linux
+ *
+ *  usage: resolv_bench [-c concurrency | -r rate] [-n lookups | -d seconds]
+ *                      [-u names] [-t type] [-l ms] [-j ms] [-L loss%] [-T tc%]
+ *                      [-X nx%] [-o file] [-q] [-k] [-b] [-P ms]
+ *
+ *  Starts a stub DNS server on the loopback interface and drives the resolver
+ *  against it with res_query_async(). With -c (default 8) that many lookups are
+ *  kept outstanding; with -r lookups are started at the given rate per second no
+ *  matter how many are outstanding. -n sets the number of lookups (default 10000),
+ *  -d a duration instead. Every lookup asks for a name of its own, so each one is
+ *  a cache miss, unless -u reuses that many names round robin.
+ *
+ *  The stub server answers after -l ms plus up to -j ms of jitter, drops -L percent
+ *  of the queries, answers -T percent of them with the TC bit set (the full answer
+ *  then comes over TCP) and answers NXDOMAIN for -X percent of the names.
+ *
+ *  The report gives the rate achieved, the 50th, 99th and 99.9th percentile of the
+ *  lookup latency, and per lookup the pbufs allocated, the bytes the resolver
+ *  copied out of pbufs and the datagrams sent. -o appends the settings and results
+ *  as one JSON line to a file, to follow them from change to change. The lookups
+ *  are limited by CONFIG_STI_RESOLV_MAX_PENDING; those that find the request table
+ *  full are counted as rejected.
+ *
+ *  With -b the lookups are made by -c threads that call res_query() at the same
+ *  time, sharing the request table and its events; every eighth lookup is started
+ *  with res_query_async() and cancelled at once instead. Each answer is checked to
+ *  be for the name its thread asked, with the address the stub server gives that
+ *  name, and no cancelled lookup may get its callback. Any failure makes the exit
+ *  status 1. -P makes the threads wait as res_query() did before it was woken by
+ *  the responce, sleeping the given time (200 ms then) up to 10 times and looking
+ *  for the answer, so that the two can be compared.
+ *
+ *  -k runs checks instead, and exits with 1 if one fails: negative answers without
+ *  an SOA, which must not be cached, leave a full cache as it was; and lookups on
+ *  the wire when the server list is replaced, in another order, are still matched
+ *  to the server they were sent to; and a saved cache that could not be loaded at
+ *  init, the clock not being set, is loaded by the next resolv_init_servers().
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_rr.h"
+
+#define BENCH_MAX_DELAYED 4096 // responces the stub server holds back at a time
+#define BENCH_MSG_MAX 512
+#define BENCH_NAME_MAX 64
+
+/** @brief Settings of a run */
+typedef struct s_BENCH_CONFIG {
+    int concurrency; /**< -c, 0 with -r */
+    int rate; /**< -r, lookups per second, 0 with -c */
+    int lookups; /**< -n */
+    int seconds; /**< -d, 0 with -n */
+    int names; /**< -u, 0 for a new name every lookup */
+    int type; /**< -t */
+    int latency_ms; /**< -l */
+    int jitter_ms; /**< -j */
+    double loss; /**< -L, percent */
+    double tc; /**< -T, percent */
+    double nx; /**< -X, percent */
+    int blocking; /**< -b, concurrency threads calling res_query() */
+    int poll_ms; /**< -P, the -b threads poll for the answer this often instead */
+} BENCH_CONFIG;
+
+/** @brief -P: the answer a polling -b thread waits for */
+typedef struct s_BENCH_POLL {
+    int done; /**< set once the callback was made, atomic */
+    int len; /**< length of answer, 0 if there was none */
+    unsigned char answer[BENCH_MSG_MAX];
+} BENCH_POLL;
+
+/** @brief A responce the stub server sends later */
+typedef struct s_BENCH_DELAYED {
+    uint64_t due_us; /**< when to send it */
+    struct sockaddr_in to; /**< the resolver */
+    u16_t len;
+    unsigned char msg[BENCH_MSG_MAX];
+} BENCH_DELAYED;
+
+/** @brief One lookup */
+typedef struct s_BENCH_LOOKUP {
+    uint64_t start_us; /**< when it was started */
+    u32_t latency_us; /**< when it completed, relative to start_us */
+    int outcome; /**< 0 answered, 1 NXDOMAIN, 2 no responce, 3 wrong answer, -1 not counted */
+    u8_t cancelled; /**< -b: cancelled with res_query_cancel() */
+    u8_t called; /**< -b: the callback of the cancelled lookup was made, atomic */
+} BENCH_LOOKUP;
+
+static BENCH_CONFIG config = { 8, 0, 10000, 0, 0, RESOLV_TYPE_A, 0, 0, 0, 0, 0, 0, 0 };
+
+static int stub_udp = -1; /**< the stub server's UDP socket */
+static int stub_tcp = -1; /**< its TCP listening socket */
+static BENCH_DELAYED delayed[BENCH_MAX_DELAYED]; /**< held back responces */
+static int ndelayed;
+static u32_t stub_udp_queries, stub_tcp_queries, stub_dropped, stub_truncated; /**< atomic */
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER; /**< guards the counters below */
+static pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER; /**< signalled on every completion */
+static int outstanding; /**< lookups started and not completed */
+static BENCH_LOOKUP *lookups; /**< one per lookup started */
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** @brief xorshift32, the state is per thread */
+static u32_t
+bench_random(u32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/** @brief 1 with the given probability in percent */
+static int
+bench_chance(u32_t *state, double percent)
+{
+    return percent > 0 && (bench_random(state) % 10000) < percent * 100;
+}
+
+/** @brief build the stub server's responce to a query
+  * Names whose hash falls in the first nx percent get NXDOMAIN, every other name
+  * one A or AAAA record; other types get an empty answer. Negative answers carry
+  * an SOA, except for names whose first label starts with "nosoa" (NXDOMAIN) or
+  * "nodata" (no records), which the resolver must not cache.
+  * @param truncate  1 to set TC and leave the answer out
+  * @returns the length of the responce, 0 if the query is not valid */
+static int
+stub_answer(const unsigned char *q, int qlen, int truncate, unsigned char *r)
+{
+    static const unsigned char soa[] = {
+        0xc0, 0x0c, 0, 6, 0, 1, 0, 0, 0x0e, 0x10, 0, 22, 0, 0,
+        0, 0, 0, 1, 0, 0, 0x1c, 0x20, 0, 0, 0x03, 0x84, 0, 1, 0x51, 0x80, 0, 0, 0, 60
+    };
+    u32_t hash = 2166136261u;
+    int i = 12, qend, type, len, nx, rdlen, nosoa, nodata;
+
+    if (qlen < 12) {
+        return 0;
+    }
+    // FNV-1a of the QNAME, as name_hash() works it out from the text
+    while (i < qlen && q[i] != 0) {
+        for (int j = i; j <= i + q[i] && j < qlen; j++) {
+            hash = (hash ^ q[j]) * 16777619u;
+        }
+        i += q[i] + 1;
+    }
+    qend = i + 5;
+    if (qend > qlen || qend - 12 > BENCH_MSG_MAX - 12 - sizeof(soa)) {
+        return 0;
+    }
+    type = (q[qend - 4] << 8) | q[qend - 3];
+    nosoa = q[12] >= 5 && memcmp(q + 13, "nosoa", 5) == 0;
+    nodata = q[12] >= 6 && memcmp(q + 13, "nodata", 6) == 0;
+    nx = nosoa || (!nodata && (hash % 10000) < config.nx * 100);
+
+    memset(r, 0, 12);
+    r[0] = q[0];
+    r[1] = q[1];
+    r[2] = 0x81 | (truncate ? 0x02 : 0);
+    r[3] = 0x80 | (nx ? 3 : 0);
+    r[5] = 1;
+    memcpy(r + 12, q + 12, qend - 12);
+    len = qend;
+    if (truncate) {
+        return len;
+    }
+    if (nosoa || nodata) {
+        return len;
+    }
+    if (!nx && (type == RESOLV_TYPE_A || type == RESOLV_TYPE_AAAA)) {
+        rdlen = (type == RESOLV_TYPE_A) ? 4 : 16;
+        r[7] = 1;
+        memcpy(r + len, "\xc0\x0c\x00\x00\x00\x01\x00\x00\x01\x2c\x00", 11);
+        r[len + 3] = type;
+        r[len + 11] = rdlen;
+        len += 12;
+        // 10.x.y.z or 2000::x:yz, different for every name
+        memset(r + len, 0, rdlen);
+        r[len] = (type == RESOLV_TYPE_A) ? 10 : 0x20;
+        memcpy(r + len + rdlen - 3, &hash, 3);
+        len += rdlen;
+    } else {
+        r[9] = 1; // negative answer, with the SOA for its TTL
+        memcpy(r + len, soa, sizeof(soa));
+        len += sizeof(soa);
+    }
+    return len;
+}
+
+/** @brief the hash the stub server makes of a name, from which its address is made */
+static u32_t
+name_hash(const char *name)
+{
+    u32_t hash = 2166136261u;
+    const char *dot;
+    int len;
+
+    while (*name != 0) {
+        dot = strchr(name, '.');
+        len = (dot != NULL) ? (int)(dot - name) : (int) strlen(name);
+        hash = (hash ^ (u8_t) len) * 16777619u;
+        for (int j = 0; j < len; j++) {
+            hash = (hash ^ (u8_t) name[j]) * 16777619u;
+        }
+        name += len + (dot != NULL);
+    }
+    return hash;
+}
+
+/** @brief the stub server's UDP side: answers, drops, truncates and delays */
+static void *
+stub_udp_thread(void *arg)
+{
+    unsigned char q[BENCH_MSG_MAX], r[BENCH_MSG_MAX];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    struct pollfd pfd = { stub_udp, POLLIN, 0 };
+    u32_t seed = 0x2545f491;
+    uint64_t now, next;
+    int n, len, delay, timeout;
+
+    for (;;) {
+        now = now_us();
+        next = 0;
+        for (int i = 0; i < ndelayed;) {
+            if (delayed[i].due_us <= now) {
+                sendto(stub_udp, delayed[i].msg, delayed[i].len, 0, (struct sockaddr *) &delayed[i].to,
+                       sizeof(delayed[i].to));
+                delayed[i] = delayed[--ndelayed];
+                continue;
+            }
+            next = (next == 0 || delayed[i].due_us < next) ? delayed[i].due_us : next;
+            i++;
+        }
+        timeout = (next == 0) ? -1 : (int)((next - now + 999) / 1000);
+        if (poll(&pfd, 1, timeout) <= 0) {
+            continue;
+        }
+        fromlen = sizeof(from);
+        n = recvfrom(stub_udp, q, sizeof(q), 0, (struct sockaddr *) &from, &fromlen);
+        if (n <= 0) {
+            continue;
+        }
+        __atomic_fetch_add(&stub_udp_queries, 1, __ATOMIC_RELAXED);
+        if (bench_chance(&seed, config.loss)) {
+            __atomic_fetch_add(&stub_dropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (bench_chance(&seed, config.tc)) {
+            __atomic_fetch_add(&stub_truncated, 1, __ATOMIC_RELAXED);
+            len = stub_answer(q, n, 1, r);
+        } else {
+            len = stub_answer(q, n, 0, r);
+        }
+        if (len == 0) {
+            continue;
+        }
+        delay = config.latency_ms + (config.jitter_ms ? bench_random(&seed) % (config.jitter_ms + 1) : 0);
+        if (delay == 0 || ndelayed == BENCH_MAX_DELAYED) {
+            sendto(stub_udp, r, len, 0, (struct sockaddr *) &from, fromlen);
+            continue;
+        }
+        delayed[ndelayed].due_us = now_us() + delay * 1000;
+        delayed[ndelayed].to = from;
+        delayed[ndelayed].len = len;
+        memcpy(delayed[ndelayed].msg, r, len);
+        ndelayed++;
+    }
+    return NULL;
+}
+
+/** @brief read exactly len bytes from a stream
+  * @returns 1 if they were read */
+static int
+read_full(int fd, unsigned char *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n <= 0) {
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/** @brief one TCP connection to the stub server, answered in order after the latency */
+static void *
+stub_conn_thread(void *arg)
+{
+    int fd = (int)(intptr_t) arg;
+    unsigned char q[BENCH_MSG_MAX], r[BENCH_MSG_MAX + 2];
+    int qlen, len;
+
+    while (read_full(fd, q, 2)) {
+        qlen = (q[0] << 8) | q[1];
+        if (qlen > sizeof(q) || !read_full(fd, q, qlen)) {
+            break;
+        }
+        __atomic_fetch_add(&stub_tcp_queries, 1, __ATOMIC_RELAXED);
+        len = stub_answer(q, qlen, 0, r + 2);
+        if (len == 0) {
+            break;
+        }
+        if (config.latency_ms > 0) {
+            usleep(config.latency_ms * 1000);
+        }
+        r[0] = len >> 8;
+        r[1] = len;
+        if (write(fd, r, len + 2) != len + 2) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *
+stub_tcp_thread(void *arg)
+{
+    pthread_t thread;
+    int fd;
+
+    for (;;) {
+        fd = accept(stub_tcp, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, stub_conn_thread, (void *)(intptr_t) fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/** @brief open the stub server's sockets on 127.0.0.1 and start its threads
+  * @returns 0, -1 if a socket could not be opened */
+static int
+stub_start(void)
+{
+    struct sockaddr_in sa;
+    pthread_t thread;
+    int one = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(DNS_SERVER_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    stub_udp = socket(AF_INET, SOCK_DGRAM, 0);
+    stub_tcp = socket(AF_INET, SOCK_STREAM, 0);
+    if (stub_udp < 0 || stub_tcp < 0) {
+        return -1;
+    }
+    setsockopt(stub_tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(stub_udp, (struct sockaddr *) &sa, sizeof(sa)) < 0 ||
+        bind(stub_tcp, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(stub_tcp, 8) < 0) {
+        return -1;
+    }
+    pthread_create(&thread, NULL, stub_udp_thread, NULL);
+    pthread_detach(thread);
+    pthread_create(&thread, NULL, stub_tcp_thread, NULL);
+    pthread_detach(thread);
+    return 0;
+}
+
+/** @brief res_query_cb of a lookup, runs in the network context */
+static void
+lookup_done(void *arg, err_t err, struct pbuf *resp)
+{
+    BENCH_LOOKUP *lookup = (BENCH_LOOKUP *) arg;
+
+    lookup->latency_us = (u32_t)(now_us() - lookup->start_us);
+    lookup->outcome = 2;
+    if (resp != NULL) {
+        // RCODE, read in place so that it is not counted as a copy
+        lookup->outcome = (resp->len >= 4 && (((u8_t *) resp->payload)[3] & 0x0f) == 3) ? 1 : 0;
+        pbuf_free(resp);
+    }
+    pthread_mutex_lock(&bench_lock);
+    outstanding--;
+    pthread_cond_signal(&bench_cond);
+    pthread_mutex_unlock(&bench_lock);
+}
+
+/** @brief start lookup number n
+  * @returns 1 if it was started, 0 if the request table was full */
+static int
+lookup_start(int n)
+{
+    char name[BENCH_NAME_MAX];
+
+    snprintf(name, sizeof(name), "q%d.bench.test", config.names ? n % config.names : n);
+    pthread_mutex_lock(&bench_lock);
+    outstanding++;
+    pthread_mutex_unlock(&bench_lock);
+    lookups[n].start_us = now_us();
+    if (res_query_async(name, RESOLV_CLASS_IN, config.type, lookup_done, &lookups[n]) != 0) {
+        return 1;
+    }
+    pthread_mutex_lock(&bench_lock);
+    outstanding--;
+    pthread_mutex_unlock(&bench_lock);
+    return 0;
+}
+
+/** @brief check that a responce answers name with the address the stub server gives it
+  * @returns the outcome of the lookup: 0 answered, 1 NXDOMAIN, 3 someone else's answer */
+static int
+answer_check(const char *name, const unsigned char *answer, int len)
+{
+    char qname[BENCH_NAME_MAX];
+    RESOLV_MSG msg;
+    RESOLV_RR rr;
+    u32_t hash = name_hash(name);
+
+    if (resolv_msg_init(&msg, answer, len) != 0 || msg.qdcount != 1 ||
+        resolv_name_text(&msg, msg.question_off, qname, sizeof(qname)) < 0 ||
+        strcasecmp(qname, name) != 0) {
+        return 3;
+    }
+    if (RESOLV_RCODE(&msg) == 3) { // NXDOMAIN
+        return 1;
+    }
+    while (resolv_rr_next(&msg, &rr) > 0) {
+        if (rr.section == RESOLV_SECTION_ANSWER && rr.rdlength >= 4 &&
+            memcmp(rr.rdata + rr.rdlength - 3, &hash, 3) == 0) {
+            return 0;
+        }
+    }
+    return 3;
+}
+
+/** @brief res_query_cb of a lookup cancelled by a -b thread, which must not be made */
+static void
+cancelled_done(void *arg, err_t err, struct pbuf *resp)
+{
+    BENCH_LOOKUP *lookup = (BENCH_LOOKUP *) arg;
+
+    __atomic_store_n(&lookup->called, 1, __ATOMIC_RELAXED);
+    if (resp != NULL) {
+        pbuf_free(resp);
+    }
+}
+
+/** @brief res_query_cb of a -P lookup, keeps the answer for the polling thread */
+static void
+poll_done(void *arg, err_t err, struct pbuf *resp)
+{
+    BENCH_POLL *poll = (BENCH_POLL *) arg;
+
+    poll->len = 0;
+    if (resp != NULL) {
+        poll->len = pbuf_copy_partial(resp, poll->answer, sizeof(poll->answer), 0);
+        pbuf_free(resp);
+    }
+    __atomic_store_n(&poll->done, 1, __ATOMIC_RELEASE);
+}
+
+/** @brief -P: look a name up the way res_query() waited before it was woken by the
+  * responce: sleep poll_ms at a time, at most 10 times, and look for the answer
+  * @returns the length of the answer, 0 if there was none */
+static int
+poll_query(const char *name, unsigned char *answer)
+{
+    BENCH_POLL poll;
+    RESOLV_HANDLE handle;
+
+    poll.done = 0;
+    handle = res_query_async(name, RESOLV_CLASS_IN, config.type, poll_done, &poll);
+    if (handle == 0) {
+        return 0;
+    }
+    for (int i = 0; i < 10; i++) {
+        usleep(config.poll_ms * 1000);
+        if (__atomic_load_n(&poll.done, __ATOMIC_ACQUIRE)) {
+            memcpy(answer, poll.answer, poll.len);
+            return poll.len;
+        }
+    }
+    if (res_query_cancel(handle) != ERR_OK) {
+        while (!__atomic_load_n(&poll.done, __ATOMIC_ACQUIRE)) {
+            usleep(1000); // the callback is being made, poll must outlive it
+        }
+    }
+    return 0;
+}
+
+/** @brief -b: one of the threads that call res_query() at the same time
+  * Thread t makes lookups t, t + threads, ... Every eighth one is started with
+  * res_query_async() and cancelled at once instead. */
+static void *
+blocking_thread(void *arg)
+{
+    int t = (int)(intptr_t) arg;
+    unsigned char answer[BENCH_MSG_MAX];
+    char name[BENCH_NAME_MAX];
+    RESOLV_HANDLE handle;
+    int len;
+
+    for (int n = t; n < config.lookups; n += config.concurrency) {
+        snprintf(name, sizeof(name), "q%d.bench.test", config.names ? n % config.names : n);
+        lookups[n].start_us = now_us();
+        if (n % 8 == 7) {
+            lookups[n].outcome = -1;
+            handle = res_query_async(name, RESOLV_CLASS_IN, config.type, cancelled_done, &lookups[n]);
+            if (handle != 0 && res_query_cancel(handle) == ERR_OK) {
+                lookups[n].cancelled = 1;
+            }
+            continue;
+        }
+        if (config.poll_ms > 0) {
+            len = poll_query(name, answer);
+        } else {
+            len = res_query(name, RESOLV_CLASS_IN, config.type, answer, sizeof(answer));
+        }
+        lookups[n].latency_us = (u32_t)(now_us() - lookups[n].start_us);
+        lookups[n].outcome = (len > 0) ? answer_check(name, answer, len) : 2;
+    }
+    return NULL;
+}
+
+/** @brief -b: run the lookups from concurrency threads blocked in res_query()
+  * @returns the number of lookups whose answer was wrong or whose callback was
+  * made after res_query_cancel() said it would not be */
+static int
+blocking_run(int *cancelled)
+{
+    pthread_t *threads = calloc(config.concurrency, sizeof(pthread_t));
+    int errors = 0;
+
+    if (threads == NULL) {
+        return -1;
+    }
+    for (int t = 0; t < config.concurrency; t++) {
+        pthread_create(&threads[t], NULL, blocking_thread, (void *)(intptr_t) t);
+    }
+    for (int t = 0; t < config.concurrency; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    // a cancelled query's responce still arrives, give it time to be (wrongly) delivered
+    usleep((config.latency_ms + config.jitter_ms + 100) * 1000);
+    *cancelled = 0;
+    for (int n = 0; n < config.lookups; n++) {
+        *cancelled += lookups[n].cancelled;
+        errors += (lookups[n].outcome == 3) ||
+                  (lookups[n].cancelled && __atomic_load_n(&lookups[n].called, __ATOMIC_RELAXED));
+    }
+    return errors;
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+    u32_t x = *(const u32_t *) a, y = *(const u32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/** @brief -k: negative answers the cache must not keep leave it as it was
+  *
+  * Fills the cache, asks questions whose NXDOMAIN or empty answers carry no SOA
+  * (rfc 2308 5), then asks the cached names again; every one must still be a hit.
+  * @returns 0 if the check passed */
+static int
+cache_check(void)
+{
+    unsigned char answer[BENCH_MSG_MAX];
+    char name[BENCH_NAME_MAX];
+    RESOLV_CACHE_STATS before, after;
+    int names = 64, entries;
+
+    resolv_cache_flush();
+    for (int i = 0; i < names; i++) {
+        snprintf(name, sizeof(name), "k%d.bench.test", i);
+        res_query(name, RESOLV_CLASS_IN, RESOLV_TYPE_A, answer, sizeof(answer));
+    }
+    resolv_cache_get_stats(&before);
+    entries = before.entries;
+    for (int i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "%s%d.bench.test", (i & 1) ? "nodata" : "nosoa", i);
+        if (res_query(name, RESOLV_CLASS_IN, RESOLV_TYPE_A, answer, sizeof(answer)) <= 0) {
+            printf("cache check: no responce for %s\n", name);
+            return 1;
+        }
+    }
+    resolv_cache_get_stats(&after);
+    if (after.entries != entries) {
+        printf("cache check: %d entries before the negative answers, %u after\n", entries,
+               (unsigned) after.entries);
+        return 1;
+    }
+    for (int i = names - entries; i < names; i++) {
+        snprintf(name, sizeof(name), "k%d.bench.test", i);
+        res_query(name, RESOLV_CLASS_IN, RESOLV_TYPE_A, answer, sizeof(answer));
+    }
+    resolv_cache_get_stats(&after);
+    printf("cache check: %d of %d cached names still hit after 4 negative answers without SOA\n",
+           (int)(after.hits - before.hits), entries);
+    return (after.hits - before.hits == entries) ? 0 : 1;
+}
+
+/** @brief -k: a server list replaced while lookups are on the wire
+  *
+  * The lookups go to the stub server as server 0. The list is then replaced by
+  * one where a server that does not answer comes first, moving the stub server to
+  * index 1. Its answers must still be taken, before any retransmission, and no
+  * timeout may be charged to either server.
+  * @returns 0 if the check passed */
+static int
+server_check(void)
+{
+    ip_addr_t servers[2];
+    RESOLV_STATS stats;
+    int n = 8, answered = 0;
+
+    config.latency_ms = 30; // below the least RTO, so nothing is retransmitted
+    resolv_cache_flush();
+    resolv_reset_stats();
+    for (int i = 0; i < n; i++) {
+        lookups[i].outcome = 2;
+        if (!lookup_start(i)) {
+            printf("server check: could not start lookup %d\n", i);
+            return 1;
+        }
+    }
+    usleep(10000); // on the wire, the answers come after config.latency_ms
+    ipaddr_aton("127.0.0.2", &servers[0]);
+    ipaddr_aton("127.0.0.1", &servers[1]);
+    resolv_init_servers(servers, 2);
+    pthread_mutex_lock(&bench_lock);
+    while (outstanding > 0) {
+        pthread_cond_wait(&bench_cond, &bench_lock);
+    }
+    pthread_mutex_unlock(&bench_lock);
+    config.latency_ms = 0;
+
+    resolv_get_stats(&stats);
+    for (int i = 0; i < n; i++) {
+        answered += (lookups[i].outcome == 0);
+    }
+    printf("server check: %d of %d answered after the list changed, %u retries, "
+           "timeouts charged %u and %u\n", answered, n, (unsigned) stats.retries,
+           (unsigned) stats.servers[0].timeouts, (unsigned) stats.servers[1].timeouts);
+    return (answered == n && stats.retries == 0 && stats.servers[0].timeouts == 0 &&
+            stats.servers[1].timeouts == 0) ? 0 : 1;
+}
+
+/** @brief -k: a snapshot passed over at init, while the clock was not set, is
+  * loaded when the resolver is initialized again with the clock set
+  *
+  * The resolver was opened with sti_wall_time() pinned to 0. With the clock
+  * running, the cache is filled, saved to STI_RESOLV_STORE_DIR and flushed; the
+  * server list of the next lease must bring every entry back.
+  * @param server  the server the resolver is open with
+  * @returns 0 if the check passed */
+static int
+snapshot_check(const ip_addr_t *server)
+{
+    unsigned char answer[BENCH_MSG_MAX];
+    char name[BENCH_NAME_MAX];
+    RESOLV_CACHE_STATS saved, before, after;
+    int names = 64;
+    err_t ret;
+
+    sti_port_set_wall_time(0, 0); // e.g. SNTP has run since
+    resolv_cache_flush();
+    for (int i = 0; i < names; i++) {
+        snprintf(name, sizeof(name), "snap%d.bench.test", i);
+        res_query(name, RESOLV_CLASS_IN, RESOLV_TYPE_A, answer, sizeof(answer));
+    }
+    resolv_cache_get_stats(&saved);
+    ret = resolv_cache_save();
+    if (ret != ERR_OK) {
+        printf("snapshot check: could not save the cache, error %d\n", ret);
+        return 1;
+    }
+    resolv_cache_flush();
+    resolv_init_servers(server, 1);
+    resolv_cache_get_stats(&before);
+    for (int i = names - saved.entries; i < names; i++) {
+        snprintf(name, sizeof(name), "snap%d.bench.test", i);
+        res_query(name, RESOLV_CLASS_IN, RESOLV_TYPE_A, answer, sizeof(answer));
+    }
+    resolv_cache_get_stats(&after);
+    printf("snapshot check: %u of %u saved entries loaded at init again, %d hit\n",
+           (unsigned) before.entries, (unsigned) saved.entries, (int)(after.hits - before.hits));
+    return (saved.entries > 0 && before.entries == saved.entries &&
+            after.hits - before.hits == saved.entries) ? 0 : 1;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: resolv_bench [-c concurrency | -r rate] [-n lookups | -d seconds] "
+                    "[-u names] [-t type] [-l ms] [-j ms] [-L loss%%] [-T tc%%] [-X nx%%] "
+                    "[-o file] [-q] [-k] [-b] [-P ms]\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *out = NULL;
+    char store_dir[] = "/tmp/resolv_bench.XXXXXX", path[sizeof(store_dir) + 16];
+    int quiet = 0, check = 0;
+    ip_addr_t server;
+    STI_PORT_STATS port_before, port_after;
+    RESOLV_STATS stats;
+    RESOLV_POOL_STATS pool;
+    uint64_t t0, elapsed_us, due, stop_us;
+    u32_t *latency;
+    int started = 0, rejected = 0, done = 0, failed = 0, nxdomain = 0, errors = 0, cancelled = 0, max;
+    double secs, qps;
+    u32_t p50, p99, p999;
+    FILE *f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:n:d:u:t:l:j:L:T:X:o:qkbP:")) != -1) {
+        switch (opt) {
+        case 'c':
+            config.concurrency = atoi(optarg);
+            config.rate = 0;
+            break;
+        case 'r':
+            config.rate = atoi(optarg);
+            config.concurrency = 0;
+            break;
+        case 'n':
+            config.lookups = atoi(optarg);
+            config.seconds = 0;
+            break;
+        case 'd':
+            config.seconds = atoi(optarg);
+            break;
+        case 'u':
+            config.names = atoi(optarg);
+            break;
+        case 't':
+            config.type = (strcasecmp(optarg, "AAAA") == 0) ? RESOLV_TYPE_AAAA :
+                          (strcasecmp(optarg, "A") == 0) ? RESOLV_TYPE_A : atoi(optarg);
+            break;
+        case 'l':
+            config.latency_ms = atoi(optarg);
+            break;
+        case 'j':
+            config.jitter_ms = atoi(optarg);
+            break;
+        case 'L':
+            config.loss = atof(optarg);
+            break;
+        case 'T':
+            config.tc = atof(optarg);
+            break;
+        case 'X':
+            config.nx = atof(optarg);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'k':
+            check = 1;
+            break;
+        case 'b':
+            config.blocking = 1;
+            break;
+        case 'P':
+            config.poll_ms = atoi(optarg);
+            config.blocking = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || (config.concurrency <= 0 && config.rate <= 0) || config.type <= 0 ||
+        (config.seconds <= 0 && config.lookups <= 0) ||
+        (config.blocking && (config.concurrency <= 0 || config.seconds > 0))) {
+        usage();
+    }
+    // with -d, room for the most lookups the rate or a fast loop can start
+    max = config.seconds ? (config.rate ? config.rate * config.seconds : 200000 * config.seconds)
+                         : config.lookups;
+    lookups = calloc(max, sizeof(BENCH_LOOKUP));
+    latency = calloc(max, sizeof(u32_t));
+    if (lookups == NULL || latency == NULL) {
+        return 1;
+    }
+
+    sti_log_level = quiet ? STI_LOG_WARN : STI_LOG_INFO;
+    if (stub_start() < 0) {
+        fprintf(stderr, "resolv_bench: stub server on port %d: %s\n", DNS_SERVER_PORT, strerror(errno));
+        return 1;
+    }
+    if (check) {
+        // the snapshot check needs a store, and a clock that is not set at init
+        if (mkdtemp(store_dir) == NULL || setenv("STI_RESOLV_STORE_DIR", store_dir, 1) != 0) {
+            fprintf(stderr, "resolv_bench: %s: %s\n", store_dir, strerror(errno));
+            return 1;
+        }
+        sti_port_set_wall_time(1, 0);
+    }
+    ipaddr_aton("127.0.0.1", &server);
+    if (resolv_init_servers(&server, 1) != ERR_OK) {
+        fprintf(stderr, "resolv_bench: could not initialize the resolver\n");
+        return 1;
+    }
+    if (check) {
+        opt = cache_check() || server_check() || snapshot_check(&server);
+        resolv_close();
+        snprintf(path, sizeof(path), "%s/cache.bin", store_dir);
+        unlink(path);
+        rmdir(store_dir);
+        return opt;
+    }
+    resolv_cache_flush();
+    resolv_reset_stats();
+    sti_port_get_stats(&port_before);
+
+    t0 = now_us();
+    stop_us = t0 + (uint64_t) config.seconds * 1000000;
+    if (config.blocking) {
+        errors = blocking_run(&cancelled);
+        started = max;
+    }
+    while (!config.blocking && started < max && (config.seconds == 0 || now_us() < stop_us)) {
+        if (config.rate > 0) {
+            // open loop: start on schedule whatever is outstanding
+            due = t0 + (uint64_t) started * 1000000 / config.rate;
+            if (due > now_us()) {
+                usleep(due - now_us());
+            }
+        } else {
+            // closed loop: keep concurrency lookups outstanding
+            pthread_mutex_lock(&bench_lock);
+            while (outstanding >= config.concurrency) {
+                pthread_cond_wait(&bench_cond, &bench_lock);
+            }
+            pthread_mutex_unlock(&bench_lock);
+        }
+        if (lookup_start(started)) {
+            started++;
+        } else {
+            rejected++;
+            if (config.rate > 0) {
+                started++; // its slot in the schedule is lost
+                lookups[started - 1].outcome = -1;
+            } else {
+                usleep(100); // the table is full of refreshes, let them finish
+            }
+        }
+    }
+    pthread_mutex_lock(&bench_lock);
+    while (outstanding > 0) {
+        pthread_cond_wait(&bench_cond, &bench_lock);
+    }
+    pthread_mutex_unlock(&bench_lock);
+    elapsed_us = now_us() - t0;
+    sti_port_get_stats(&port_after);
+    resolv_get_stats(&stats);
+    resolv_pool_get_stats(&pool);
+
+    for (int i = 0; i < started; i++) {
+        if (lookups[i].outcome < 0) {
+            continue;
+        }
+        latency[done++] = lookups[i].latency_us;
+        failed += (lookups[i].outcome == 2);
+        nxdomain += (lookups[i].outcome == 1);
+    }
+    if (done == 0) {
+        fprintf(stderr, "resolv_bench: no lookup completed\n");
+        return 1;
+    }
+    qsort(latency, done, sizeof(u32_t), cmp_u32);
+    p50 = latency[(done - 1) * 50 / 100];
+    p99 = latency[(done - 1) * 99 / 100];
+    p999 = latency[(uint64_t)(done - 1) * 999 / 1000];
+    secs = elapsed_us / 1e6;
+    qps = done / secs;
+
+    if (config.rate > 0) {
+        printf("rate %d/s", config.rate);
+    } else if (config.blocking) {
+        if (config.poll_ms > 0) {
+            printf("%d threads polling every %d ms", config.concurrency, config.poll_ms);
+        } else {
+            printf("%d threads in res_query()", config.concurrency);
+        }
+    } else {
+        printf("concurrency %d", config.concurrency);
+    }
+    printf(", %s names, stub latency %d+%d ms, loss %.1f%%, tc %.1f%%, nx %.1f%%\n",
+           config.names ? "reused" : "unique", config.latency_ms, config.jitter_ms, config.loss,
+           config.tc, config.nx);
+    printf("%d lookups in %.3f s: %.0f QPS, %d failed, %d NXDOMAIN, %d rejected\n", done, secs, qps,
+           failed, nxdomain, rejected);
+    printf("latency us: p50 %u p99 %u p999 %u max %u\n", (unsigned) p50, (unsigned) p99,
+           (unsigned) p999, (unsigned) latency[done - 1]);
+    printf("per lookup: %.2f pbuf allocs (%.0f bytes), %.1f bytes copied from pbufs, %.2f datagrams sent\n",
+           (double)(port_after.pbuf_allocs - port_before.pbuf_allocs) / done,
+           (double)(port_after.pbuf_bytes - port_before.pbuf_bytes) / done,
+           (double)(port_after.bytes_copied - port_before.bytes_copied) / done,
+           (double)(port_after.udp_sent - port_before.udp_sent) / done);
+    printf("resolver: %u cache hits, %u retries, %u timeouts, %u truncated, %u joined\n",
+           (unsigned) stats.cache_hits, (unsigned) stats.retries, (unsigned) stats.timeouts,
+           (unsigned) stats.truncated, (unsigned) stats.joined);
+    printf("pool: high water %u of %u buffers, %u taken, %u heap, %u oversize\n",
+           (unsigned) pool.high_water, (unsigned) pool.buffers, (unsigned) pool.taken,
+           (unsigned) pool.heap, (unsigned) pool.oversize);
+    if (config.blocking) {
+        printf("checked: %d wrong answers or callbacks after res_query_cancel(), %d cancelled\n",
+               errors, cancelled);
+    }
+    printf("stub: %u UDP and %u TCP queries, %u dropped, %u truncated\n", (unsigned) stub_udp_queries,
+           (unsigned) stub_tcp_queries, (unsigned) stub_dropped, (unsigned) stub_truncated);
+
+    if (out != NULL) {
+        f = fopen(out, "a");
+        if (f == NULL) {
+            perror(out);
+            return 1;
+        }
+        fprintf(f, "{\"time\":%ld,\"concurrency\":%d,\"rate\":%d,\"blocking\":%d,\"names\":%d,\"type\":%d,"
+                   "\"latency_ms\":%d,\"jitter_ms\":%d,\"loss\":%.1f,\"tc\":%.1f,\"nx\":%.1f,"
+                   "\"lookups\":%d,\"failed\":%d,\"rejected\":%d,\"qps\":%.0f,"
+                   "\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u,"
+                   "\"allocs\":%.2f,\"copied\":%.1f,\"sent\":%.2f,"
+                   "\"pool_high_water\":%u,\"pool_heap\":%u}\n",
+                (long) time(NULL), config.concurrency, config.rate, config.blocking, config.names, config.type,
+                config.latency_ms, config.jitter_ms, config.loss, config.tc, config.nx, done, failed,
+                rejected, qps, (unsigned) p50, (unsigned) p99, (unsigned) p999,
+                (unsigned) latency[done - 1],
+                (double)(port_after.pbuf_allocs - port_before.pbuf_allocs) / done,
+                (double)(port_after.bytes_copied - port_before.bytes_copied) / done,
+                (double)(port_after.udp_sent - port_before.udp_sent) / done,
+                (unsigned) pool.high_water, (unsigned) pool.heap);
+        fclose(f);
+    }
+    resolv_close();
+    return (errors != 0) ? 1 : 0;
+}
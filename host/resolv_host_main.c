@@ -0,0 +1,448 @@
+/** @file resolv_host_main.c
+ *  @brief Command line driver for the resolver built on Linux
+ *
+ *  Runs the same resolver code as the ESP32 example against real or local DNS
+ *  servers so that it can be debugged, profiled and measured on a workstation.
+ *
+ *  usage: resolv_host [-v] [-q] [-a] [-e] [-d] [-T] [-g bytes] [-t type] [-n count]
+ *                     [-w ms] [-p name[:type],...] server[,server...] name...
+ *
+ *  Every name is asked count times. The answers are logged unless -q is given and
+ *  a latency, cache and buffer pool summary is printed at the end. With -a all queries are
+ *  started at once with res_query_async() instead of one after the other. With -e
+ *  the names are SRV names and are resolved to endpoints with res_query_srv().
+ *  With -d the IPv4 and IPv6 addresses of the names are looked up with
+ *  res_query_addr(). -w waits the given time before each repetition, to watch
+ *  answers age in the cache. -p starts the given lookups with resolv_prewarm()
+ *  right after the resolver is initialized, as the ESP32 example does on GOT_IP.
+ *  -g makes the lookups of -d or -e with res_getaddrinfo() into an arena of the
+ *  given size, printing canonical names and TTLs; a lookup that does not fit is
+ *  asked again with an arena of the size it reported. -T prints the query trace
+ *  at the end, for resolv_trace.
+ *
+ *  When STI_RESOLV_STORE_DIR names a directory the answer cache is saved there on
+ *  exit (in cache.bin) and loaded at start, as it is kept in NVS on the ESP32.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_rr.h"
+#include "sti_srv.h"
+#include "sti_addr.h"
+#include "sti_addrinfo.h"
+
+#define HOST_MAX_SERVERS 8
+#define HOST_MAX_ENDPOINTS 16
+#define HOST_SCRATCH_SIZE 65535 // a TCP responce can be this long
+
+static unsigned char scratch[HOST_SCRATCH_SIZE]; /**< for responces that arrive in a pbuf chain */
+
+/** @brief One query started with -a */
+typedef struct s_HOST_QUERY {
+    const char *name; /**< the name asked for */
+    u32_t start; /**< sti_now_ms() when the query was started */
+} HOST_QUERY;
+
+static int quiet = 0; /**< -q given */
+static int failed = 0; /**< queries without a responce */
+static u32_t answered = 0; /**< queries with a responce */
+static u32_t total_ms = 0, min_ms = 0xffffffff, max_ms = 0; /**< latency of answered queries */
+static int outstanding = 0; /**< async queries not yet completed */
+static sti_event_t all_done; /**< signalled when outstanding drops to 0 */
+
+static const struct {
+    const char *name;
+    int type;
+} rr_types[] = {
+    { "A", RESOLV_TYPE_A },
+    { "NS", RESOLV_TYPE_NS },
+    { "CNAME", RESOLV_TYPE_CNAME },
+    { "SOA", RESOLV_TYPE_SOA },
+    { "TXT", RESOLV_TYPE_TXT },
+    { "AAAA", RESOLV_TYPE_AAAA },
+    { "SRV", RESOLV_TYPE_SRV },
+};
+
+static int
+parse_type(const char *s)
+{
+    for (int i = 0; i < sizeof(rr_types) / sizeof(rr_types[0]); i++) {
+        if (strcasecmp(s, rr_types[i].name) == 0) {
+            return rr_types[i].type;
+        }
+    }
+    return atoi(s);
+}
+
+static void
+log_answers(RESOLV_MSG *msg)
+{
+    static const char *TAG = "resolv_host";
+    RESOLV_RR rr;
+    RESOLV_SRV srv;
+    const unsigned char *ip;
+    char name[RESOLV_NAME_MAX + 1];
+    char target[RESOLV_NAME_MAX + 1];
+    ip_addr_t addr;
+    int off;
+
+    while (resolv_rr_next(msg, &rr) > 0) {
+        if (rr.section != RESOLV_SECTION_ANSWER) {
+            continue;
+        }
+        resolv_name_text(msg, rr.name_off, name, sizeof(name));
+        if ((ip = resolv_rr_a(&rr)) != NULL) {
+            STI_LOGI(TAG, "...%s A %d.%d.%d.%d ttl %u", name, ip[0], ip[1], ip[2], ip[3],
+                     (unsigned) rr.ttl);
+        } else if ((ip = resolv_rr_aaaa(&rr)) != NULL) {
+            addr.type = IPADDR_TYPE_V6;
+            memcpy(addr.u_addr.ip6.addr, ip, 16);
+            STI_LOGI(TAG, "...%s AAAA %s ttl %u", name,
+                     ipaddr_ntoa_r(&addr, target, sizeof(target)), (unsigned) rr.ttl);
+        } else if (resolv_rr_srv(msg, &rr, &srv) == 0) {
+            resolv_name_text(msg, srv.target_off, target, sizeof(target));
+            STI_LOGI(TAG, "...%s SRV %d %d %d %s ttl %u", name, srv.priority, srv.weight,
+                     srv.port, target, (unsigned) rr.ttl);
+        } else if ((off = resolv_rr_cname(msg, &rr)) >= 0) {
+            resolv_name_text(msg, off, target, sizeof(target));
+            STI_LOGI(TAG, "...%s CNAME %s ttl %u", name, target, (unsigned) rr.ttl);
+        } else {
+            STI_LOGI(TAG, "...%s type %d, %d bytes ttl %u", name, rr.type, rr.rdlength,
+                     (unsigned) rr.ttl);
+        }
+    }
+}
+
+/** @brief count one answered query in the latency summary */
+static void
+count_answered(u32_t elapsed)
+{
+    answered++;
+    total_ms += elapsed;
+    min_ms = (elapsed < min_ms) ? elapsed : min_ms;
+    max_ms = (elapsed > max_ms) ? elapsed : max_ms;
+}
+
+/** @brief count one completed query and log its answers */
+static void
+query_done(const char *name, u32_t elapsed, struct pbuf *resp)
+{
+    static const char *TAG = "resolv_host";
+    RESOLV_MSG msg;
+
+    if (resp == NULL) {
+        failed++;
+        STI_LOGI(TAG, "...%s: no responce after %u ms", name, (unsigned) elapsed);
+        return;
+    }
+    count_answered(elapsed);
+    if (!quiet && resolv_msg_init_pbuf(&msg, resp, scratch, sizeof(scratch)) == 0) {
+        STI_LOGI(TAG, "...%s: %d bytes, rcode %d, %u ms", name, resp->tot_len,
+                 RESOLV_RCODE(&msg), (unsigned) elapsed);
+        log_answers(&msg);
+    }
+    pbuf_free(resp);
+}
+
+/** @brief one async query less to wait for, runs in the network context */
+static void
+async_drop(void *ctx)
+{
+    if (--outstanding == 0) {
+        sti_event_signal(all_done);
+    }
+}
+
+/** @brief res_query_cb for -a, runs in the network context */
+static void
+async_done(void *arg, err_t err, struct pbuf *resp)
+{
+    HOST_QUERY *q = (HOST_QUERY *) arg;
+
+    query_done(q->name, sti_now_ms() - q->start, resp);
+    async_drop(NULL);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: resolv_host [-v] [-q] [-a] [-e] [-d] [-T] [-g bytes] [-t type] [-n count] "
+                    "[-w ms] [-p name[:type],...] server[,server...] name...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *TAG = "resolv_host";
+    ip_addr_t servers[HOST_MAX_SERVERS];
+    RESOLV_CACHE_STATS stats;
+    RESOLV_STATS rstats;
+    RESOLV_POOL_STATS pstats;
+    char server_text[IPADDR_STRLEN_MAX];
+    int nservers = 0;
+    int type = RESOLV_TYPE_A;
+    int count = 1;
+    int pause_ms = 0;
+    int async = 0;
+    int srv = 0;
+    int addr = 0;
+    const char *prewarm = NULL;
+    int arena_len = 0;
+    int trace = 0;
+    char *list, *tok;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vqaedTg:t:n:w:p:")) != -1) {
+        switch (opt) {
+        case 'v':
+            sti_log_level = STI_LOG_DEBUG;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'a':
+            async = 1;
+            break;
+        case 'e':
+            srv = 1;
+            break;
+        case 'd':
+            addr = 1;
+            break;
+        case 't':
+            type = parse_type(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'w':
+            pause_ms = atoi(optarg);
+            break;
+        case 'p':
+            prewarm = optarg;
+            break;
+        case 'g':
+            arena_len = atoi(optarg);
+            break;
+        case 'T':
+            trace = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind < 2 || type <= 0 || count <= 0) {
+        usage();
+    }
+
+    list = argv[optind++];
+    for (tok = strtok(list, ","); tok != NULL && nservers < HOST_MAX_SERVERS;
+         tok = strtok(NULL, ",")) {
+        if (!ipaddr_aton(tok, &servers[nservers])) {
+            fprintf(stderr, "resolv_host: %s is not an IP address\n", tok);
+            return 2;
+        }
+        nservers++;
+    }
+    if (resolv_init_servers(servers, nservers) != ERR_OK) {
+        STI_LOGE(TAG, "...could not initialize the resolver");
+        return 1;
+    }
+    if (prewarm != NULL) {
+        STI_LOGI(TAG, "...%d prewarm lookups started", resolv_prewarm(prewarm));
+    }
+
+    if (arena_len > 0 && (srv || addr)) {
+        RESOLV_ADDRINFO *ai;
+        char text[IPADDR_STRLEN_MAX];
+
+        for (; optind < argc; optind++) {
+            for (int i = 0; i < count; i++) {
+                int len = arena_len;
+                void *arena = malloc(len);
+                u32_t start = sti_now_ms();
+                int needed = res_getaddrinfo(argv[optind], srv ? RESOLV_AI_SRV : 0, arena, len, &ai);
+                u32_t elapsed = sti_now_ms() - start;
+                int n = 0;
+
+                if (needed > len) {
+                    STI_LOGI(TAG, "...%s: needs %d bytes, asking again", argv[optind], needed);
+                    free(arena);
+                    len = needed;
+                    arena = malloc(len);
+                    needed = res_getaddrinfo(argv[optind], srv ? RESOLV_AI_SRV : 0, arena, len, &ai);
+                }
+                for (RESOLV_ADDRINFO *r = ai; r != NULL; r = r->next) {
+                    n++;
+                }
+                STI_LOGI(TAG, "...%s: %d results in %d of %d bytes, %u ms", argv[optind], n, needed,
+                         len, (unsigned) elapsed);
+                for (int j = 1; ai != NULL && !quiet; ai = ai->next, j++) {
+                    STI_LOGI(TAG, "...%d. %s %s port %d (priority %d weight %d) ttl %u", j, ai->name,
+                             ipaddr_ntoa_r(&ai->addr, text, sizeof(text)), ai->port, ai->priority,
+                             ai->weight, (unsigned) ai->ttl);
+                }
+                if (n > 0) {
+                    count_answered(elapsed);
+                } else {
+                    failed++;
+                }
+                free(arena);
+            }
+        }
+    } else if (srv) {
+        RESOLV_ENDPOINT endpoints[HOST_MAX_ENDPOINTS];
+        char text[IPADDR_STRLEN_MAX];
+
+        for (; optind < argc; optind++) {
+            for (int i = 0; i < count; i++) {
+                u32_t start = sti_now_ms();
+                int n = res_query_srv(argv[optind], endpoints, HOST_MAX_ENDPOINTS);
+                u32_t elapsed = sti_now_ms() - start;
+
+                STI_LOGI(TAG, "...%s: %d endpoints, %u ms", argv[optind], n, (unsigned) elapsed);
+                for (int j = 0; j < n && !quiet; j++) {
+                    STI_LOGI(TAG, "...%d. %s port %d (priority %d weight %d)", j + 1,
+                             ipaddr_ntoa_r(&endpoints[j].addr, text, sizeof(text)),
+                             endpoints[j].port, endpoints[j].priority, endpoints[j].weight);
+                }
+                if (n > 0) {
+                    count_answered(elapsed);
+                } else {
+                    failed++;
+                }
+            }
+        }
+    } else if (addr) {
+        ip_addr_t addrs[HOST_MAX_ENDPOINTS];
+        char text[IPADDR_STRLEN_MAX];
+
+        for (; optind < argc; optind++) {
+            for (int i = 0; i < count; i++) {
+                u32_t start = sti_now_ms();
+                int n = res_query_addr(argv[optind], addrs, HOST_MAX_ENDPOINTS);
+                u32_t elapsed = sti_now_ms() - start;
+
+                STI_LOGI(TAG, "...%s: %d addresses, %u ms", argv[optind], n, (unsigned) elapsed);
+                for (int j = 0; j < n && !quiet; j++) {
+                    STI_LOGI(TAG, "...%d. %s", j + 1, ipaddr_ntoa_r(&addrs[j], text, sizeof(text)));
+                }
+                if (n > 0) {
+                    count_answered(elapsed);
+                } else {
+                    failed++;
+                }
+            }
+        }
+    } else if (async) {
+        int nqueries = (argc - optind) * count;
+        HOST_QUERY *queries = calloc(nqueries, sizeof(HOST_QUERY));
+
+        all_done = sti_event_create();
+        if (queries == NULL || all_done == NULL) {
+            return 1;
+        }
+        // no callback can run before the first query starts
+        outstanding = nqueries;
+        for (int i = 0; i < nqueries; i++) {
+            queries[i].name = argv[optind + i / count];
+            queries[i].start = sti_now_ms();
+            if (res_query_async(queries[i].name, RESOLV_CLASS_IN, type, async_done,
+                                &queries[i]) == 0) {
+                STI_LOGI(TAG, "...%s: could not be started", queries[i].name);
+                failed++;
+                sti_net_call(async_drop, NULL);
+            }
+        }
+        while (!sti_event_wait(all_done, 1000)) {
+        }
+    } else {
+        for (; optind < argc; optind++) {
+            for (int i = 0; i < count; i++) {
+                struct pbuf *resp = NULL;
+                u32_t start;
+
+                if (i > 0 && pause_ms > 0) {
+                    usleep(pause_ms * 1000);
+                }
+                start = sti_now_ms();
+
+                res_query_pbuf(argv[optind], RESOLV_CLASS_IN, type, &resp);
+                query_done(argv[optind], sti_now_ms() - start, resp);
+            }
+        }
+    }
+
+    printf("%u queries, %d failed", (unsigned)(answered + failed), failed);
+    if (answered > 0) {
+        printf(", latency min %u avg %u max %u ms", (unsigned) min_ms,
+               (unsigned)(total_ms / answered), (unsigned) max_ms);
+    }
+    printf("\n");
+    resolv_cache_get_stats(&stats);
+    printf("cache: %u hits (%u negative), %u misses, %u prefetches, %u stale answers\n",
+           (unsigned) stats.hits, (unsigned) stats.negative_hits, (unsigned) stats.misses,
+           (unsigned) stats.prefetches, (unsigned) stats.stale_answers);
+    resolv_get_stats(&rstats);
+    printf("resolver: %u static hosts, %u sent, %u retries, %u timeouts, %u truncated, %u joined\n",
+           (unsigned) rstats.static_hits, (unsigned) rstats.sent, (unsigned) rstats.retries, (unsigned) rstats.timeouts,
+           (unsigned) rstats.truncated, (unsigned) rstats.joined);
+    for (int i = 0; i < rstats.nservers; i++) {
+        printf("server %s: %u sent, %u answered, %u timeouts, srtt %u rto %u ms\n",
+               ipaddr_ntoa_r(&rstats.servers[i].addr, server_text, sizeof(server_text)),
+               (unsigned) rstats.servers[i].sent, (unsigned) rstats.servers[i].answered,
+               (unsigned) rstats.servers[i].timeouts, (unsigned) rstats.servers[i].srtt,
+               (unsigned) rstats.servers[i].rto);
+    }
+    resolv_pool_get_stats(&pstats);
+    printf("pool: %u buffers of %u bytes, %u in use, high water %u, %u taken, %u heap, %u oversize\n",
+           (unsigned) pstats.buffers, (unsigned) pstats.buffer_size, (unsigned) pstats.in_use,
+           (unsigned) pstats.high_water, (unsigned) pstats.taken, (unsigned) pstats.heap,
+           (unsigned) pstats.oversize);
+    printf("latency:");
+    for (int i = 0; i < RESOLV_LATENCY_BUCKETS; i++) {
+        if (rstats.latency[i] == 0) {
+            continue;
+        }
+        if (i < RESOLV_LATENCY_BUCKETS - 1) {
+            printf(" <%u ms %u", 2u << i, (unsigned) rstats.latency[i]);
+        } else {
+            printf(" >=%u ms %u", 1u << (RESOLV_LATENCY_BUCKETS - 1), (unsigned) rstats.latency[i]);
+        }
+    }
+    printf("\n");
+    if (trace) {
+        resolv_trace_dump();
+    }
+    resolv_close();
+    return failed ? 1 : 0;
+}
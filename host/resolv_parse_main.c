@@ -0,0 +1,248 @@
+/** @file resolv_parse_main.c
+ *  @brief Parsing microbenchmark of sti_rr over captured responces
+ *
+ *  usage: resolv_parse [-n iterations] file...
+ *
+ *  Reads DNS responces from files holding one responce per line in hex, with
+ *  lines starting with # as comments (see captures/responces.txt), and walks each
+ *  one the way a consumer does: resolv_msg_init(), every record with
+ *  resolv_rr_next(), its owner name with resolv_name_text() and its data with the
+ *  accessor for its type. Each responce is walked -n times (default 100000) and
+ *  the time per walk is printed, with the records found.
+ *
+ *  Every prefix of every responce is then walked as well, as a damaged or hostile
+ *  packet, to time how quickly the bounds checks reject it. The exit status is 1
+ *  if a responce cannot be walked to its end.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_rr.h"
+
+#define PARSE_MAX_MSGS 256
+#define PARSE_MSG_MAX 4096
+#define PARSE_LINE_MAX (2 * PARSE_MSG_MAX + 2)
+
+/** @brief One captured responce */
+typedef struct s_PARSE_MSG {
+    char desc[80]; /**< the comment before it */
+    int len;
+    unsigned char buf[PARSE_MSG_MAX];
+} PARSE_MSG;
+
+static PARSE_MSG msgs[PARSE_MAX_MSGS];
+static int nmsgs;
+static volatile u32_t sink; /**< keeps the compiler from dropping the walks */
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** @brief read the hex responces of a file into msgs
+  * @returns 0, -1 if the file cannot be read or holds a bad line */
+static int
+read_captures(const char *path)
+{
+    static char line[PARSE_LINE_MAX];
+    char desc[sizeof(msgs[0].desc)] = "";
+    unsigned int byte;
+    FILE *f = fopen(path, "r");
+    int n;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '#') {
+            snprintf(desc, sizeof(desc), "%.*s", (int) sizeof(desc) - 1, line + 1 + (line[1] == ' '));
+            continue;
+        }
+        if (line[0] == 0) {
+            continue;
+        }
+        if (nmsgs == PARSE_MAX_MSGS) {
+            fprintf(stderr, "%s: more than %d responces\n", path, PARSE_MAX_MSGS);
+            break;
+        }
+        for (n = 0; line[2 * n] != 0 && n < PARSE_MSG_MAX; n++) {
+            if (sscanf(line + 2 * n, "%2x", &byte) != 1) {
+                fprintf(stderr, "%s: not hex: %.20s\n", path, line);
+                fclose(f);
+                return -1;
+            }
+            msgs[nmsgs].buf[n] = (unsigned char) byte;
+        }
+        msgs[nmsgs].len = n;
+        memcpy(msgs[nmsgs].desc, desc, sizeof(desc));
+        nmsgs++;
+        desc[0] = 0;
+    }
+    fclose(f);
+    return 0;
+}
+
+/** @brief walk a responce as a consumer does, decoding every record
+  * @returns the number of records, -1 if the responce is malformed */
+static int
+walk(const unsigned char *buf, int len)
+{
+    char name[256];
+    RESOLV_MSG msg;
+    RESOLV_RR rr;
+    RESOLV_SRV srv;
+    RESOLV_SOA soa;
+    const unsigned char *addr;
+    int records = 0;
+    int ret;
+
+    if (resolv_msg_init(&msg, buf, len) != 0) {
+        return -1;
+    }
+    while ((ret = resolv_rr_next(&msg, &rr)) > 0) {
+        records++;
+        if (resolv_name_text(&msg, rr.name_off, name, sizeof(name)) < 0) {
+            return -1;
+        }
+        sink += name[0];
+        switch (rr.type) {
+        case RESOLV_TYPE_A:
+            addr = resolv_rr_a(&rr);
+            sink += (addr != NULL) ? addr[3] : 0;
+            break;
+        case RESOLV_TYPE_AAAA:
+            addr = resolv_rr_aaaa(&rr);
+            sink += (addr != NULL) ? addr[15] : 0;
+            break;
+        case RESOLV_TYPE_SRV:
+            if (resolv_rr_srv(&msg, &rr, &srv) == 0) {
+                sink += srv.port;
+            }
+            break;
+        case RESOLV_TYPE_CNAME:
+            sink += resolv_rr_cname(&msg, &rr);
+            break;
+        case RESOLV_TYPE_SOA:
+            if (resolv_rr_soa(&msg, &rr, &soa) == 0) {
+                sink += soa.minimum;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return (ret < 0) ? -1 : records;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: resolv_parse [-n iterations] file...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    int iterations = 100000;
+    int records, rejected, prefixes, bad = 0;
+    uint64_t t0, ns, total_ns = 0, total_walks = 0, bytes = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind == argc || iterations <= 0) {
+        usage();
+    }
+    for (; optind < argc; optind++) {
+        if (read_captures(argv[optind]) < 0) {
+            return 1;
+        }
+    }
+
+    for (int m = 0; m < nmsgs; m++) {
+        records = walk(msgs[m].buf, msgs[m].len);
+        if (records < 0) {
+            printf("%-48.48s  malformed\n", msgs[m].desc);
+            bad++;
+            continue;
+        }
+        t0 = now_ns();
+        for (int i = 0; i < iterations; i++) {
+            walk(msgs[m].buf, msgs[m].len);
+        }
+        ns = now_ns() - t0;
+        total_ns += ns;
+        total_walks += iterations;
+        bytes += (uint64_t) msgs[m].len * iterations;
+        printf("%-48.48s  %4d bytes %3d records %7.1f ns\n", msgs[m].desc, msgs[m].len, records,
+               (double) ns / iterations);
+    }
+    if (total_walks > 0) {
+        printf("all: %.1f ns per responce, %.2f ns per byte\n", (double) total_ns / total_walks,
+               (double) total_ns / bytes);
+    }
+
+    // every shorter length of every responce, as a packet cut short or forged
+    prefixes = 0;
+    rejected = 0;
+    t0 = now_ns();
+    for (int i = 0; i < iterations / 100 + 1; i++) {
+        for (int m = 0; m < nmsgs; m++) {
+            for (int len = 0; len < msgs[m].len; len++) {
+                rejected += (walk(msgs[m].buf, len) < 0);
+                prefixes++;
+            }
+        }
+    }
+    ns = now_ns() - t0;
+    if (prefixes > 0) {
+        printf("cut short: %d walks, %d rejected, %.1f ns each\n", prefixes, rejected,
+               (double) ns / prefixes);
+    }
+    return (bad != 0) ? 1 : 0;
+}
@@ -0,0 +1,523 @@
+/** @file resolv_trace_main.c
+ *  @brief Turns a query trace dump into per-query timelines and replays it
+ *
+ *  usage: resolv_trace [-q] [-n name,...] [-r server[,server...]] [-s speed] file
+ *
+ *  Reads the "TRACE " lines printed by resolv_trace_dump() (on the ESP32 console,
+ *  or by resolv_host -T) from file, or from stdin if file is -, and prints the
+ *  records of every lookup as a timeline relative to its start, followed by a
+ *  summary. The trace keeps only a hash of each name; the names given with -n are
+ *  hashed with resolv_trace_qhash() and shown where they match. -q prints only the
+ *  summary.
+ *
+ *  With -r the lookups are made again, at the same moments relative to the first
+ *  one, against the given DNS servers (usually a local stub server that adds the
+ *  latency or loss under study), and the recorded and replayed latencies are
+ *  compared. Names that are not known from -n are asked as <qhash>.trace.invalid.
+ *  -s divides the gaps between lookups by speed to replay faster.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_rr.h"
+
+#define TRACE_MAX_NAMES 64
+#define TRACE_MAX_SERVERS 8
+#define TRACE_LINE_MAX 256
+
+/** @brief One lookup found in the trace */
+typedef struct s_TRACE_QUERY {
+    u32_t qhash; /**< hash of the name */
+    u16_t id; /**< transaction ID, 0 for a cache hit */
+    u16_t type; /**< RR type */
+    u32_t start; /**< ms of the hit or start record */
+    u32_t end; /**< ms of the done record */
+    u8_t hit; /**< answered from the cache */
+    u8_t joined; /**< joined a query already on the wire */
+    u8_t done; /**< the done record was seen */
+    s8_t err; /**< outcome of the done record */
+    int sends; /**< send records */
+    u32_t replay_start; /**< -r: sti_now_ms() when the lookup was made again */
+    s32_t replay_ms; /**< -r: latency of the replayed lookup, -1 if it failed */
+} TRACE_QUERY;
+
+static const char *event_names[] = {"?", "hit", "start", "send", "recv", "tcp", "done"};
+
+static RESOLV_TRACE *records; /**< the records read, in order */
+static int *record_query; /**< index in queries of the lookup a record belongs to, -1 if none */
+static int nrecords;
+static TRACE_QUERY *queries; /**< the lookups, in order of start */
+static int nqueries;
+static const char *names[TRACE_MAX_NAMES]; /**< -n */
+static u32_t name_hashes[TRACE_MAX_NAMES];
+static int nnames;
+static int outstanding; /**< replayed lookups not yet completed */
+static sti_event_t all_done; /**< signalled when outstanding drops to 0 */
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: resolv_trace [-q] [-n name,...] [-r server[,server...]] [-s speed] file\n");
+    exit(2);
+}
+
+static const char *
+type_name(u16_t type, char *buf, int len)
+{
+    switch (type) {
+    case RESOLV_TYPE_A:
+        return "A";
+    case RESOLV_TYPE_AAAA:
+        return "AAAA";
+    case RESOLV_TYPE_SRV:
+        return "SRV";
+    case RESOLV_TYPE_TXT:
+        return "TXT";
+    default:
+        snprintf(buf, len, "type %u", type);
+        return buf;
+    }
+}
+
+/** @brief the name -n gave for a hash, NULL if none */
+static const char *
+name_of(u32_t qhash)
+{
+    for (int i = 0; i < nnames; i++) {
+        if (name_hashes[i] == qhash) {
+            return names[i];
+        }
+    }
+    return NULL;
+}
+
+static const char *
+err_name(int err, char *buf, int len)
+{
+    if (err == ERR_OK) {
+        return "ok";
+    }
+    if (err == ERR_TIMEOUT) {
+        return "timeout";
+    }
+    snprintf(buf, len, "error %d", err);
+    return buf;
+}
+
+/** @brief parse one line of a dump
+  * @returns 1 if it held a record */
+static int
+parse_line(const char *line, RESOLV_TRACE *rec)
+{
+    const char *p = strstr(line, "TRACE ");
+    char event[16];
+    unsigned seq, ms, id, qhash, type, size, rcode;
+    int server, outcome;
+
+    if (p == NULL || sscanf(p, "TRACE %u %u %15s %x %x %u %d %u %u %d", &seq, &ms, event, &id,
+                            &qhash, &type, &server, &size, &rcode, &outcome) != 10) {
+        return 0;
+    }
+    memset(rec, 0, sizeof(*rec));
+    for (int i = 1; i < sizeof(event_names) / sizeof(event_names[0]); i++) {
+        if (strcmp(event, event_names[i]) == 0) {
+            rec->event = i;
+        }
+    }
+    rec->seq = seq;
+    rec->ms = ms;
+    rec->id = id;
+    rec->qhash = qhash;
+    rec->type = type;
+    rec->server = server;
+    rec->size = size;
+    rec->rcode = rcode;
+    rec->outcome = outcome;
+    return rec->event != 0;
+}
+
+static int
+read_trace(FILE *f)
+{
+    char line[TRACE_LINE_MAX];
+    RESOLV_TRACE rec;
+    int cap = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (!parse_line(line, &rec)) {
+            continue;
+        }
+        if (nrecords == cap) {
+            cap = cap ? cap * 2 : 256;
+            records = realloc(records, cap * sizeof(RESOLV_TRACE));
+            record_query = realloc(record_query, cap * sizeof(int));
+            if (records == NULL || record_query == NULL) {
+                return -1;
+            }
+        }
+        records[nrecords++] = rec;
+    }
+    return nrecords;
+}
+
+/** @brief the newest lookup a record of a query belongs to
+  * @param open  1 to look only at lookups without a done record */
+static int
+find_query(const RESOLV_TRACE *rec, int open)
+{
+    for (int i = nqueries - 1; i >= 0; i--) {
+        if (queries[i].id == rec->id && !queries[i].hit &&
+            (rec->qhash == 0 || queries[i].qhash == rec->qhash) && (!open || !queries[i].done)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/** @brief group the records into lookups */
+static void
+build_queries(void)
+{
+    RESOLV_TRACE *rec;
+    TRACE_QUERY *q;
+    int n;
+
+    queries = calloc(nrecords ? nrecords : 1, sizeof(TRACE_QUERY));
+    for (int i = 0; i < nrecords; i++) {
+        rec = &records[i];
+        if (rec->event == RESOLV_TRACE_HIT || rec->event == RESOLV_TRACE_START) {
+            q = &queries[nqueries];
+            q->qhash = rec->qhash;
+            q->id = rec->id;
+            q->type = rec->type;
+            q->start = rec->ms;
+            q->hit = (rec->event == RESOLV_TRACE_HIT);
+            q->joined = (rec->event == RESOLV_TRACE_START && rec->outcome);
+            q->done = q->hit;
+            q->end = rec->ms;
+            record_query[i] = nqueries++;
+            continue;
+        }
+        // a late responce belongs to a lookup that is already done
+        n = find_query(rec, rec->event != RESOLV_TRACE_RECV || rec->outcome != 0);
+        record_query[i] = n;
+        if (n < 0) {
+            continue;
+        }
+        q = &queries[n];
+        if (rec->event == RESOLV_TRACE_SEND) {
+            q->sends++;
+        } else if (rec->event == RESOLV_TRACE_DONE) {
+            q->done = 1;
+            q->err = rec->outcome;
+            q->end = rec->ms;
+        }
+    }
+}
+
+static void
+print_record(const TRACE_QUERY *q, const RESOLV_TRACE *rec)
+{
+    char buf[16];
+
+    printf("  %+7d ms  %-5s", (int)(rec->ms - q->start), event_names[rec->event]);
+    switch (rec->event) {
+    case RESOLV_TRACE_SEND:
+        printf(" server %d, %u bytes, attempt %d", rec->server, rec->size, rec->outcome);
+        break;
+    case RESOLV_TRACE_RECV:
+        if (rec->server < 0) {
+            printf(" TCP");
+        } else {
+            printf(" server %d", rec->server);
+        }
+        printf(", %u bytes, rcode %u%s", rec->size, rec->rcode, rec->outcome ? "" : ", late");
+        break;
+    case RESOLV_TRACE_TCP:
+        printf(" truncated, asking over TCP");
+        break;
+    case RESOLV_TRACE_DONE:
+        printf(" %s, %u bytes", err_name(rec->outcome, buf, sizeof(buf)), rec->size);
+        break;
+    case RESOLV_TRACE_START:
+        if (rec->outcome) {
+            printf(" joined the same question");
+        }
+        break;
+    }
+    printf("\n");
+}
+
+static void
+print_timelines(void)
+{
+    char hash[16], tbuf[16], ebuf[16];
+    const char *name;
+    TRACE_QUERY *q;
+
+    for (int i = 0; i < nqueries; i++) {
+        q = &queries[i];
+        name = name_of(q->qhash);
+        if (name == NULL) {
+            snprintf(hash, sizeof(hash), "%08x", (unsigned) q->qhash);
+            name = hash;
+        }
+        if (q->hit) {
+            printf("%s %s: cache hit\n", name, type_name(q->type, tbuf, sizeof(tbuf)));
+            continue;
+        }
+        printf("%s %s id %04x: ", name, type_name(q->type, tbuf, sizeof(tbuf)), q->id);
+        if (q->done) {
+            printf("%s after %u ms, %d sent\n", err_name(q->err, ebuf, sizeof(ebuf)),
+                   (unsigned)(q->end - q->start), q->sends);
+        } else {
+            printf("not completed in the trace\n");
+        }
+        for (int j = 0; j < nrecords; j++) {
+            if (record_query[j] == i) {
+                print_record(q, &records[j]);
+            }
+        }
+    }
+}
+
+static void
+print_summary(void)
+{
+    u32_t total = 0, max = 0, ms;
+    int hits = 0, misses = 0, timeouts = 0, late = 0, retries = 0, lost = 0;
+
+    for (int i = 0; i < nqueries; i++) {
+        if (queries[i].hit) {
+            hits++;
+            continue;
+        }
+        if (!queries[i].done) {
+            continue;
+        }
+        misses++;
+        ms = queries[i].end - queries[i].start;
+        total += ms;
+        max = (ms > max) ? ms : max;
+        timeouts += (queries[i].err == ERR_TIMEOUT);
+    }
+    for (int i = 0; i < nrecords; i++) {
+        late += (records[i].event == RESOLV_TRACE_RECV && records[i].outcome == 0);
+        retries += (records[i].event == RESOLV_TRACE_SEND && records[i].outcome > 0);
+        lost += (records[i].event != RESOLV_TRACE_HIT && records[i].event != RESOLV_TRACE_START &&
+                 record_query[i] < 0);
+    }
+    printf("%d records, %d lookups: %d cache hits, %d completed misses, %d timeouts\n",
+           nrecords, nqueries, hits, misses, timeouts);
+    printf("%d retransmissions, %d late responces, %d records without their start\n",
+           retries, late, lost);
+    if (misses > 0) {
+        printf("recorded latency avg %u max %u ms\n", (unsigned)(total / misses), (unsigned) max);
+    }
+}
+
+/** @brief one replayed lookup less to wait for, runs in the network context */
+static void
+replay_drop(void *ctx)
+{
+    if (--outstanding == 0) {
+        sti_event_signal(all_done);
+    }
+}
+
+/** @brief res_query_cb of a replayed lookup, runs in the network context */
+static void
+replay_done(void *arg, err_t err, struct pbuf *resp)
+{
+    TRACE_QUERY *q = (TRACE_QUERY *) arg;
+
+    q->replay_ms = (resp != NULL) ? (s32_t)(sti_now_ms() - q->replay_start) : -1;
+    if (resp != NULL) {
+        pbuf_free(resp);
+    }
+    replay_drop(NULL);
+}
+
+static int
+replay(const ip_addr_t *servers, int nservers, int speed, int quiet)
+{
+    char synth[32], tbuf[16];
+    const char *name;
+    u32_t t0, due, recorded_total = 0, replay_total = 0, recorded_max = 0, replay_max = 0;
+    int n = 0, failed = 0, slower = 0;
+    TRACE_QUERY *q;
+    RESOLV_STATS stats;
+
+    if (nqueries == 0) {
+        return 0;
+    }
+    if (resolv_init_servers(servers, nservers) != ERR_OK || (all_done = sti_event_create()) == NULL) {
+        fprintf(stderr, "resolv_trace: could not initialize the resolver\n");
+        return 1;
+    }
+    // no callback can run before the first lookup starts
+    outstanding = nqueries;
+    t0 = sti_now_ms();
+    for (int i = 0; i < nqueries; i++) {
+        q = &queries[i];
+        due = (q->start - queries[0].start) / speed;
+        if ((s32_t)(t0 + due - sti_now_ms()) > 0) {
+            usleep((t0 + due - sti_now_ms()) * 1000);
+        }
+        name = name_of(q->qhash);
+        if (name == NULL) {
+            snprintf(synth, sizeof(synth), "%08x.trace.invalid", (unsigned) q->qhash);
+            name = synth;
+        }
+        q->replay_start = sti_now_ms();
+        if (res_query_async(name, RESOLV_CLASS_IN, q->type, replay_done, q) == 0) {
+            q->replay_ms = -1;
+            sti_net_call(replay_drop, NULL);
+        }
+    }
+    while (!sti_event_wait(all_done, 1000)) {
+    }
+
+    for (int i = 0; i < nqueries; i++) {
+        q = &queries[i];
+        name = name_of(q->qhash);
+        if (!quiet) {
+            if (name == NULL) {
+                snprintf(synth, sizeof(synth), "%08x", (unsigned) q->qhash);
+                name = synth;
+            }
+            printf("replay %s %s: ", name, type_name(q->type, tbuf, sizeof(tbuf)));
+            if (q->hit) {
+                printf("recorded cache hit");
+            } else if (q->done) {
+                printf("recorded %u ms", (unsigned)(q->end - q->start));
+            } else {
+                printf("recorded not completed");
+            }
+            if (q->replay_ms >= 0) {
+                printf(", replayed %d ms\n", (int) q->replay_ms);
+            } else {
+                printf(", replay failed\n");
+            }
+        }
+        if (q->replay_ms < 0) {
+            failed++;
+            continue;
+        }
+        if (q->hit || !q->done) {
+            continue;
+        }
+        n++;
+        recorded_total += q->end - q->start;
+        recorded_max = (q->end - q->start > recorded_max) ? q->end - q->start : recorded_max;
+        replay_total += q->replay_ms;
+        replay_max = ((u32_t) q->replay_ms > replay_max) ? (u32_t) q->replay_ms : replay_max;
+        slower += ((u32_t) q->replay_ms > q->end - q->start);
+    }
+    printf("replayed %d lookups, %d failed\n", nqueries, failed);
+    if (n > 0) {
+        printf("misses: recorded avg %u max %u ms, replayed avg %u max %u ms, %d slower\n",
+               (unsigned)(recorded_total / n), (unsigned) recorded_max,
+               (unsigned)(replay_total / n), (unsigned) replay_max, slower);
+    }
+    resolv_get_stats(&stats);
+    printf("resolver: %u sent, %u retries, %u timeouts, %u truncated, %u joined\n",
+           (unsigned) stats.sent, (unsigned) stats.retries, (unsigned) stats.timeouts,
+           (unsigned) stats.truncated, (unsigned) stats.joined);
+    resolv_close();
+    return failed ? 1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    ip_addr_t servers[TRACE_MAX_SERVERS];
+    int nservers = 0;
+    int quiet = 0;
+    int speed = 1;
+    char *list = NULL, *names_list = NULL, *tok;
+    FILE *f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qn:r:s:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quiet = 1;
+            break;
+        case 'n':
+            names_list = optarg;
+            break;
+        case 'r':
+            list = optarg;
+            break;
+        case 's':
+            speed = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1 || speed <= 0) {
+        usage();
+    }
+
+    for (tok = (names_list != NULL) ? strtok(names_list, ", ") : NULL;
+         tok != NULL && nnames < TRACE_MAX_NAMES; tok = strtok(NULL, ", ")) {
+        names[nnames] = tok;
+        name_hashes[nnames++] = resolv_trace_qhash(tok);
+    }
+    for (tok = (list != NULL) ? strtok(list, ",") : NULL;
+         tok != NULL && nservers < TRACE_MAX_SERVERS; tok = strtok(NULL, ",")) {
+        if (!ipaddr_aton(tok, &servers[nservers])) {
+            fprintf(stderr, "resolv_trace: %s is not an IP address\n", tok);
+            return 2;
+        }
+        nservers++;
+    }
+
+    f = (strcmp(argv[optind], "-") == 0) ? stdin : fopen(argv[optind], "r");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (read_trace(f) < 0) {
+        fprintf(stderr, "resolv_trace: out of memory\n");
+        return 1;
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    build_queries();
+    if (!quiet) {
+        print_timelines();
+    }
+    print_summary();
+    return (nservers > 0) ? replay(servers, nservers, speed, quiet) : 0;
+}
@@ -0,0 +1,987 @@
+/** @file sti_port_posix.c
+ *  @brief Linux backend of the platform layer, on sockets, pthreads and clock_gettime
+ *
+ *  See sti_port.h. A network thread plays the part of the lwIP thread: it waits
+ *  in poll() on the UDP socket and the TCP socket and makes every network
+ *  callback with net_lock held. sti_net_call() takes the same lock, so code that
+ *  must run in the network context never runs alongside a callback. Sockets are
+ *  IPv6 with IPv4 mapped addresses where the host allows it, IPv4 otherwise.
+ *  Timeouts are kept in a small table and fired by the same thread.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include "sti_port.h"
+
+#define NET_TICK_MS 500 // longest poll() so the TCP poll callback stays on time
+#define TCP_POLL_MS 1000 // interval of the TCP poll callback
+#define TCP_TX_SIZE 4096 // bytes sti_tcp_write() may queue before ERR_MEM
+#define NET_RX_SIZE 65535 // largest datagram or TCP read
+#define UDP_RX_BURST 16 // datagrams read per wakeup before TCP gets a turn
+#define NET_TIMEOUTS 4 // pending sti_net_timeout() calls
+#define STORE_DIR_ENV "STI_RESOLV_STORE_DIR" // directory of sti_store_write() files
+
+/** @brief State of the TCP connection */
+typedef enum e_POSIX_TCP_STATE {
+  TCP_NONE = 0, /**< no socket */
+  TCP_CONNECTING, /**< connect() in progress */
+  TCP_OPEN, /**< connected */
+  TCP_PEER_CLOSED /**< the peer sent FIN, waiting for close or abort */
+} POSIX_TCP_STATE;
+
+/** @brief A binary event */
+typedef struct s_POSIX_EVENT {
+  pthread_mutex_t mutex; /**< guards signalled */
+  pthread_cond_t cond; /**< broadcast when signalled is set */
+  int signalled; /**< set by sti_event_signal(), cleared by sti_event_wait() */
+} POSIX_EVENT;
+
+/** @brief A pending sti_net_timeout() */
+typedef struct s_POSIX_TIMEOUT {
+  void (*fn)(void *ctx); /**< NULL if the entry is free */
+  void *ctx; /**< argument of fn */
+  u32_t due; /**< sti_now_ms() when fn runs */
+} POSIX_TIMEOUT;
+
+int sti_log_level = STI_LOG_INFO;
+static STI_PORT_STATS port_stats; /**< updated with atomic adds from any thread */
+static int wall_pinned; /**< sti_wall_time() returns wall_time instead of time() */
+static u32_t wall_time; /**< the time set by sti_port_set_wall_time() */
+
+static pthread_once_t net_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t net_lock; /**< held by the network context, recursive */
+static int net_gen; /**< bumped whenever a socket is opened or closed */
+static int wake_fds[2] = {-1, -1}; /**< pipe that interrupts poll() */
+
+static POSIX_TIMEOUT net_timeouts[NET_TIMEOUTS]; /**< net_lock */
+
+static int udp_fd = -1; /**< the UDP endpoint */
+static int udp_family; /**< AF_INET6 or AF_INET */
+static sti_udp_recv_fn udp_recv_cb = NULL; /**< where received datagrams go */
+
+static int tcp_fd = -1; /**< the TCP connection */
+static int tcp_family; /**< AF_INET6 or AF_INET */
+static POSIX_TCP_STATE tcp_state = TCP_NONE;
+static const STI_TCP_CALLBACKS *tcp_cb = NULL; /**< callbacks of tcp_fd */
+static unsigned char tcp_tx[TCP_TX_SIZE]; /**< bytes written but not yet sent */
+static u16_t tcp_tx_len; /**< bytes in tcp_tx */
+static u32_t tcp_last_poll; /**< sti_now_ms() of the last poll callback */
+
+void
+sti_log(int level, const char *tag, const char *fmt, ...){
+  static const char letters[] = "EWID";
+  va_list ap;
+
+  if (level > sti_log_level){
+    return;
+  }
+  flockfile(stderr);
+  fprintf(stderr, "%c (%u) %s: ", letters[level - 1], (unsigned) sti_now_ms(), tag);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  funlockfile(stderr);
+}
+
+/** @brief hex dump a buffer like esp_log_buffer_hexdump(), 16 bytes a line */
+void
+sti_log_hex(int level, const char *tag, const void *buf, int len){
+  const unsigned char *p = buf;
+  char line[16 * 3 + 1 + 16 + 3];
+  int n, pos;
+
+  if (level > sti_log_level){
+    return;
+  }
+  for (int off = 0; off < len; off += 16){
+    n = (len - off < 16) ? len - off : 16;
+    pos = 0;
+    for (int i = 0; i < 16; i++){
+      pos += (i < n) ? sprintf(line + pos, "%02x ", p[off + i]) : sprintf(line + pos, "   ");
+    }
+    line[pos++] = '|';
+    for (int i = 0; i < n; i++){
+      line[pos++] = isprint(p[off + i]) ? p[off + i] : '.';
+    }
+    line[pos++] = '|';
+    line[pos] = 0;
+    sti_log(level, tag, "0x%04x   %s", off, line);
+  }
+}
+
+/** @brief interrupt poll() so the network thread sees a new socket set */
+static void
+net_wake(void){
+  char c = 0;
+
+  if (write(wake_fds[1], &c, 1) < 0 && errno != EAGAIN){
+    STI_LOGE("sti port", "...wake pipe write failed: %s", strerror(errno));
+  }
+}
+
+/** @brief convert an address to a sockaddr of the given family
+  * @returns the length of the sockaddr, 0 if the family cannot reach the address */
+static socklen_t
+to_sockaddr(const ip_addr_t *addr, u16_t port, int family, struct sockaddr_storage *ss){
+  memset(ss, 0, sizeof(*ss));
+  if (family == AF_INET6){
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    if (IP_IS_V6(addr)){
+      memcpy(&sin6->sin6_addr, addr->u_addr.ip6.addr, 16);
+    }
+    else{
+      // IPv4 mapped, ::ffff:a.b.c.d
+      sin6->sin6_addr.s6_addr[10] = 0xff;
+      sin6->sin6_addr.s6_addr[11] = 0xff;
+      memcpy(&sin6->sin6_addr.s6_addr[12], &addr->u_addr.ip4.addr, 4);
+    }
+    return sizeof(*sin6);
+  }
+  if (IP_IS_V6(addr)){
+    return 0;
+  }
+  struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(port);
+  sin->sin_addr.s_addr = addr->u_addr.ip4.addr;
+  return sizeof(*sin);
+}
+
+/** @brief convert a sockaddr back, IPv4 mapped addresses become IPv4 */
+static void
+from_sockaddr(const struct sockaddr_storage *ss, ip_addr_t *addr, u16_t *port){
+  memset(addr, 0, sizeof(*addr));
+  if (ss->ss_family == AF_INET6){
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+    *port = ntohs(sin6->sin6_port);
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)){
+      addr->type = IPADDR_TYPE_V4;
+      memcpy(&addr->u_addr.ip4.addr, &sin6->sin6_addr.s6_addr[12], 4);
+    }
+    else{
+      addr->type = IPADDR_TYPE_V6;
+      memcpy(addr->u_addr.ip6.addr, &sin6->sin6_addr, 16);
+    }
+    return;
+  }
+  const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+  *port = ntohs(sin->sin_port);
+  addr->type = IPADDR_TYPE_V4;
+  addr->u_addr.ip4.addr = sin->sin_addr.s_addr;
+}
+
+/** @brief open a non blocking socket, dual stack if the host has IPv6 */
+static int
+socket_open(int type, int *family){
+  int fd = socket(AF_INET6, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int off = 0;
+
+  if (fd >= 0){
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    *family = AF_INET6;
+    return fd;
+  }
+  *family = AF_INET;
+  return socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+/** @brief map errno after a failed socket call to an lwIP error code */
+static err_t
+errno_to_err(int e){
+  switch (e){
+    case EAGAIN:
+    case ENOBUFS:
+    case ENOMEM:
+      return ERR_MEM;
+    case ENETUNREACH:
+    case EHOSTUNREACH:
+    case EAFNOSUPPORT:
+      return ERR_RTE;
+    case ECONNREFUSED:
+    case ECONNRESET:
+      return ERR_RST;
+    default:
+      return ERR_VAL;
+  }
+}
+
+/** @brief read queued datagrams and pass them to the receive callback */
+static void
+udp_input(unsigned char *rx){
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  struct pbuf *p;
+  ip_addr_t addr;
+  u16_t port;
+  ssize_t n;
+
+  for (int i = 0; i < UDP_RX_BURST && udp_fd >= 0; i++){
+    sslen = sizeof(ss);
+    n = recvfrom(udp_fd, rx, NET_RX_SIZE, 0, (struct sockaddr *)&ss, &sslen);
+    if (n < 0){
+      return; // EAGAIN, or an ICMP error reported on the socket
+    }
+    p = pbuf_alloc(PBUF_TRANSPORT, (u16_t) n, PBUF_RAM);
+    if (p == NULL){
+      continue;
+    }
+    memcpy(p->payload, rx, n);
+    from_sockaddr(&ss, &addr, &port);
+    if (udp_recv_cb != NULL){
+      udp_recv_cb(p, &addr, port);
+    }
+    else{
+      pbuf_free(p);
+    }
+  }
+}
+
+/** @brief forget the TCP socket. Called with net_lock held */
+static void
+tcp_release(int reset){
+  struct linger lg = {1, 0};
+
+  if (reset){
+    setsockopt(tcp_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  }
+  close(tcp_fd);
+  tcp_fd = -1;
+  tcp_state = TCP_NONE;
+  tcp_tx_len = 0;
+  net_gen++;
+  net_wake();
+}
+
+/** @brief send as much of tcp_tx as the socket takes now
+  * @returns 0, or -1 if the connection failed */
+static int
+tcp_flush(void){
+  ssize_t n;
+
+  while (tcp_tx_len > 0){
+    n = send(tcp_fd, tcp_tx, tcp_tx_len, MSG_NOSIGNAL);
+    if (n < 0){
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    memmove(tcp_tx, tcp_tx + n, tcp_tx_len - n);
+    tcp_tx_len -= n;
+  }
+  return 0;
+}
+
+/** @brief the connection failed: release it and tell the owner */
+static void
+tcp_failed(void){
+  const STI_TCP_CALLBACKS *cb = tcp_cb;
+
+  tcp_release(1);
+  cb->err();
+}
+
+/** @brief handle poll() events on the TCP socket */
+static void
+tcp_input(short revents, unsigned char *rx){
+  int fd = tcp_fd;
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+  struct pbuf *p;
+  ssize_t n;
+
+  if (tcp_state == TCP_CONNECTING){
+    getsockopt(tcp_fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+    if (err != 0){
+      tcp_failed();
+      return;
+    }
+    tcp_state = TCP_OPEN;
+    tcp_last_poll = sti_now_ms();
+    tcp_cb->connected();
+    return;
+  }
+  if ((revents & POLLOUT) && tcp_tx_len > 0){
+    if (tcp_flush() < 0){
+      tcp_failed();
+      return;
+    }
+    if (tcp_tx_len == 0){
+      tcp_cb->sent();
+      if (tcp_fd != fd){
+        return; // closed or replaced by the callback
+      }
+    }
+  }
+  if (tcp_state != TCP_OPEN || (revents & (POLLIN | POLLHUP | POLLERR)) == 0){
+    return;
+  }
+  n = recv(tcp_fd, rx, NET_RX_SIZE, 0);
+  if (n > 0){
+    p = pbuf_alloc(PBUF_RAW, (u16_t) n, PBUF_RAM);
+    if (p != NULL){
+      memcpy(p->payload, rx, n);
+      tcp_cb->recv(p);
+    }
+  }
+  else if (n == 0){
+    tcp_state = TCP_PEER_CLOSED;
+    tcp_cb->recv(NULL);
+  }
+  else if (errno != EAGAIN && errno != EWOULDBLOCK){
+    tcp_failed();
+  }
+}
+
+/** @brief milliseconds until the next timeout is due, at most NET_TICK_MS */
+static int
+timeouts_next(void){
+  s32_t wait = NET_TICK_MS;
+  s32_t left;
+
+  for (int i = 0; i < NET_TIMEOUTS; i++){
+    if (net_timeouts[i].fn != NULL){
+      left = (s32_t)(net_timeouts[i].due - sti_now_ms());
+      if (left < wait){
+        wait = (left > 0) ? left : 0;
+      }
+    }
+  }
+  return wait;
+}
+
+/** @brief run the timeouts that are due. Called with net_lock held */
+static void
+timeouts_fire(void){
+  POSIX_TIMEOUT t;
+
+  for (int i = 0; i < NET_TIMEOUTS; i++){
+    if (net_timeouts[i].fn != NULL && (s32_t)(sti_now_ms() - net_timeouts[i].due) >= 0){
+      t = net_timeouts[i];
+      net_timeouts[i].fn = NULL; // free before the call, fn may re-arm itself
+      t.fn(t.ctx);
+    }
+  }
+}
+
+/** @brief the network thread, see the file comment */
+static void *
+net_main(void *arg){
+  unsigned char *rx = malloc(NET_RX_SIZE);
+  struct pollfd fds[3];
+  int nfds, udp_i, tcp_i, gen, wait;
+  char drain[64];
+
+  for (;;){
+    pthread_mutex_lock(&net_lock);
+    nfds = 0;
+    udp_i = tcp_i = -1;
+    fds[nfds].fd = wake_fds[0];
+    fds[nfds++].events = POLLIN;
+    if (udp_fd >= 0){
+      udp_i = nfds;
+      fds[nfds].fd = udp_fd;
+      fds[nfds++].events = POLLIN;
+    }
+    if (tcp_state != TCP_NONE){
+      tcp_i = nfds;
+      fds[nfds].fd = tcp_fd;
+      fds[nfds].events = (tcp_state == TCP_CONNECTING) ? POLLOUT :
+                         ((tcp_state == TCP_OPEN) ? POLLIN : 0) | (tcp_tx_len ? POLLOUT : 0);
+      nfds++;
+    }
+    gen = net_gen;
+    wait = timeouts_next();
+    pthread_mutex_unlock(&net_lock);
+
+    for (int i = 0; i < nfds; i++){
+      fds[i].revents = 0;
+    }
+    poll(fds, nfds, wait);
+
+    pthread_mutex_lock(&net_lock);
+    if (fds[0].revents & POLLIN){
+      while (read(wake_fds[0], drain, sizeof(drain)) > 0){
+      }
+    }
+    // a socket opened or closed since poll() started may reuse a polled fd number
+    if (udp_i >= 0 && gen == net_gen && fds[udp_i].revents){
+      udp_input(rx);
+    }
+    if (tcp_i >= 0 && gen == net_gen && fds[tcp_i].revents){
+      tcp_input(fds[tcp_i].revents, rx);
+    }
+    if (tcp_state != TCP_NONE && (u32_t)(sti_now_ms() - tcp_last_poll) >= TCP_POLL_MS){
+      tcp_last_poll = sti_now_ms();
+      tcp_cb->poll();
+    }
+    timeouts_fire();
+    pthread_mutex_unlock(&net_lock);
+  }
+  return arg;
+}
+
+/** @brief create net_lock, the wake pipe and the network thread, once */
+static void
+net_start(void){
+  pthread_mutexattr_t attr;
+  pthread_t thread;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&net_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (pipe2(wake_fds, O_NONBLOCK | O_CLOEXEC) != 0 ||
+      pthread_create(&thread, NULL, net_main, NULL) != 0){
+    STI_LOGE("sti port", "...could not start the network thread");
+    abort();
+  }
+  pthread_detach(thread);
+}
+
+sti_mutex_t
+sti_mutex_create(void){
+  pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+
+  if (mutex != NULL){
+    pthread_mutex_init(mutex, NULL);
+  }
+  return mutex;
+}
+
+void
+sti_mutex_lock(sti_mutex_t mutex){
+  pthread_mutex_lock((pthread_mutex_t *) mutex);
+}
+
+void
+sti_mutex_unlock(sti_mutex_t mutex){
+  pthread_mutex_unlock((pthread_mutex_t *) mutex);
+}
+
+sti_event_t
+sti_event_create(void){
+  POSIX_EVENT *event = malloc(sizeof(POSIX_EVENT));
+  pthread_condattr_t attr;
+
+  if (event == NULL){
+    return NULL;
+  }
+  pthread_mutex_init(&event->mutex, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&event->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  event->signalled = 0;
+  return event;
+}
+
+int
+sti_event_wait(sti_event_t e, u32_t timeout_ms){
+  POSIX_EVENT *event = (POSIX_EVENT *) e;
+  struct timespec deadline;
+  int signalled;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L){
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&event->mutex);
+  while (!event->signalled && timeout_ms > 0){
+    if (pthread_cond_timedwait(&event->cond, &event->mutex, &deadline) == ETIMEDOUT){
+      break;
+    }
+  }
+  signalled = event->signalled;
+  event->signalled = 0;
+  pthread_mutex_unlock(&event->mutex);
+  return signalled;
+}
+
+void
+sti_event_signal(sti_event_t e){
+  POSIX_EVENT *event = (POSIX_EVENT *) e;
+
+  pthread_mutex_lock(&event->mutex);
+  event->signalled = 1;
+  pthread_cond_broadcast(&event->cond);
+  pthread_mutex_unlock(&event->mutex);
+}
+
+u32_t
+sti_now_ms(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u32_t)(ts.tv_sec * 1000u + ts.tv_nsec / 1000000);
+}
+
+u32_t
+sti_random(void){
+  u32_t r;
+
+  if (getrandom(&r, sizeof(r), GRND_NONBLOCK) != sizeof(r)){
+    r = (u32_t) random() ^ ((u32_t) random() << 16);
+  }
+  return r;
+}
+
+u32_t
+sti_wall_time(void){
+  if (__atomic_load_n(&wall_pinned, __ATOMIC_ACQUIRE)){
+    return __atomic_load_n(&wall_time, __ATOMIC_RELAXED);
+  }
+  return (u32_t) time(NULL);
+}
+
+void
+sti_port_set_wall_time(int pinned, u32_t wall){
+  __atomic_store_n(&wall_time, wall, __ATOMIC_RELAXED);
+  __atomic_store_n(&wall_pinned, pinned, __ATOMIC_RELEASE);
+}
+
+/** @brief the file that holds a stored blob, in $STI_RESOLV_STORE_DIR
+  * @returns 0, -1 if the variable is not set or the path is too long */
+static int
+store_path(const char *key, const char *suffix, char *path, int pathlen){
+  const char *dir = getenv(STORE_DIR_ENV);
+  int n;
+
+  if (dir == NULL || *dir == 0){
+    return -1;
+  }
+  n = snprintf(path, pathlen, "%s/%s.bin%s", dir, key, suffix);
+  return (n > 0 && n < pathlen) ? 0 : -1;
+}
+
+err_t
+sti_store_write(const char *key, const void *buf, u32_t len){
+  char path[PATH_MAX], tmp[PATH_MAX];
+  FILE *f;
+  int ok;
+
+  if (store_path(key, "", path, sizeof(path)) != 0 ||
+      store_path(key, ".tmp", tmp, sizeof(tmp)) != 0){
+    return ERR_IF;
+  }
+  // write a new file and rename it, so a crash leaves the old blob or the new one
+  f = fopen(tmp, "wb");
+  if (f == NULL){
+    return ERR_IF;
+  }
+  ok = fwrite(buf, 1, len, f) == len;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp, path) != 0){
+    unlink(tmp);
+    return ERR_MEM;
+  }
+  return ERR_OK;
+}
+
+int
+sti_store_read(const char *key, void *buf, u32_t len){
+  char path[PATH_MAX];
+  FILE *f;
+  size_t n;
+  int more;
+
+  if (store_path(key, "", path, sizeof(path)) != 0 || (f = fopen(path, "rb")) == NULL){
+    return -1;
+  }
+  n = fread(buf, 1, len, f);
+  more = fgetc(f) != EOF;
+  fclose(f);
+  return more ? -1 : (int) n;
+}
+
+void
+sti_net_call(void (*fn)(void *ctx), void *ctx){
+  pthread_once(&net_once, net_start);
+  pthread_mutex_lock(&net_lock);
+  fn(ctx);
+  pthread_mutex_unlock(&net_lock);
+}
+
+void
+sti_net_timeout(u32_t ms, void (*fn)(void *ctx), void *ctx){
+  for (int i = 0; i < NET_TIMEOUTS; i++){
+    if (net_timeouts[i].fn == NULL){
+      net_timeouts[i].fn = fn;
+      net_timeouts[i].ctx = ctx;
+      net_timeouts[i].due = sti_now_ms() + ms;
+      net_wake(); // poll() may be sleeping past the new due time
+      return;
+    }
+  }
+  STI_LOGE("sti port", "...timeout table full");
+}
+
+void
+sti_net_untimeout(void (*fn)(void *ctx), void *ctx){
+  for (int i = 0; i < NET_TIMEOUTS; i++){
+    if (net_timeouts[i].fn == fn && net_timeouts[i].ctx == ctx){
+      net_timeouts[i].fn = NULL;
+      return;
+    }
+  }
+}
+
+err_t
+sti_udp_open(sti_udp_recv_fn recv){
+  struct sockaddr_storage ss;
+  ip_addr_t any;
+  socklen_t sslen;
+  err_t ret = ERR_OK;
+
+  pthread_once(&net_once, net_start);
+  pthread_mutex_lock(&net_lock);
+  if (udp_fd >= 0){
+    close(udp_fd);
+  }
+  udp_fd = socket_open(SOCK_DGRAM, &udp_family);
+  memset(&any, 0, sizeof(any));
+  any.type = (udp_family == AF_INET6) ? IPADDR_TYPE_V6 : IPADDR_TYPE_V4;
+  sslen = to_sockaddr(&any, 0, udp_family, &ss);
+  if (udp_fd < 0 || bind(udp_fd, (struct sockaddr *)&ss, sslen) != 0){
+    ret = (udp_fd < 0) ? ERR_MEM : ERR_USE;
+    if (udp_fd >= 0){
+      close(udp_fd);
+    }
+    udp_fd = -1;
+  }
+  else{
+    udp_recv_cb = recv;
+  }
+  net_gen++;
+  net_wake();
+  pthread_mutex_unlock(&net_lock);
+  return ret;
+}
+
+err_t
+sti_udp_sendto(const void *buf, u16_t len, const ip_addr_t *addr, u16_t port){
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  int fd = udp_fd;
+
+  if (fd < 0){
+    return ERR_CONN;
+  }
+  sslen = to_sockaddr(addr, port, udp_family, &ss);
+  if (sslen == 0){
+    return ERR_RTE;
+  }
+  if (sendto(fd, buf, len, 0, (struct sockaddr *)&ss, sslen) < 0){
+    return errno_to_err(errno);
+  }
+  __atomic_fetch_add(&port_stats.udp_sent, 1, __ATOMIC_RELAXED);
+  return ERR_OK;
+}
+
+void
+sti_udp_close(void){
+  pthread_once(&net_once, net_start);
+  pthread_mutex_lock(&net_lock);
+  if (udp_fd >= 0){
+    close(udp_fd);
+    udp_fd = -1;
+    net_gen++;
+    net_wake();
+  }
+  udp_recv_cb = NULL;
+  pthread_mutex_unlock(&net_lock);
+}
+
+err_t
+sti_tcp_connect(const ip_addr_t *addr, u16_t port, const STI_TCP_CALLBACKS *callbacks){
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+
+  pthread_once(&net_once, net_start);
+  if (tcp_state != TCP_NONE){
+    return ERR_ISCONN;
+  }
+  tcp_fd = socket_open(SOCK_STREAM, &tcp_family);
+  if (tcp_fd < 0){
+    return ERR_MEM;
+  }
+  sslen = to_sockaddr(addr, port, tcp_family, &ss);
+  if (sslen == 0 ||
+      (connect(tcp_fd, (struct sockaddr *)&ss, sslen) != 0 && errno != EINPROGRESS)){
+    close(tcp_fd);
+    tcp_fd = -1;
+    return (sslen == 0) ? ERR_RTE : errno_to_err(errno);
+  }
+  tcp_cb = callbacks;
+  tcp_state = TCP_CONNECTING;
+  tcp_tx_len = 0;
+  net_gen++;
+  net_wake();
+  return ERR_OK;
+}
+
+err_t
+sti_tcp_write(const void *buf, u16_t len){
+  if (tcp_state != TCP_OPEN){
+    return ERR_CONN;
+  }
+  if (tcp_tx_len + len > TCP_TX_SIZE){
+    return ERR_MEM;
+  }
+  memcpy(tcp_tx + tcp_tx_len, buf, len);
+  tcp_tx_len += len;
+  return ERR_OK;
+}
+
+void
+sti_tcp_output(void){
+  if (tcp_state != TCP_OPEN){
+    return;
+  }
+  tcp_flush(); // a failure shows up as an error on the next read
+  if (tcp_tx_len > 0){
+    net_wake(); // have poll() watch for POLLOUT
+  }
+}
+
+void
+sti_tcp_close(void){
+  if (tcp_state == TCP_NONE){
+    return;
+  }
+  tcp_flush();
+  tcp_release(0); // the kernel sends what it holds, then FIN
+}
+
+void
+sti_tcp_abort(void){
+  if (tcp_state == TCP_NONE){
+    return;
+  }
+  tcp_release(1);
+}
+
+int
+ipaddr_aton(const char *cp, ip_addr_t *addr){
+  memset(addr, 0, sizeof(*addr));
+  if (inet_pton(AF_INET, cp, &addr->u_addr.ip4.addr) == 1){
+    addr->type = IPADDR_TYPE_V4;
+    return 1;
+  }
+  if (inet_pton(AF_INET6, cp, addr->u_addr.ip6.addr) == 1){
+    addr->type = IPADDR_TYPE_V6;
+    return 1;
+  }
+  return 0;
+}
+
+char *
+ipaddr_ntoa_r(const ip_addr_t *addr, char *buf, int buflen){
+  if (IP_IS_V6(addr)){
+    return (char *) inet_ntop(AF_INET6, addr->u_addr.ip6.addr, buf, buflen);
+  }
+  return (char *) inet_ntop(AF_INET, &addr->u_addr.ip4.addr, buf, buflen);
+}
+
+struct pbuf *
+pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type){
+  struct pbuf *p = malloc(sizeof(struct pbuf) + length);
+
+  if (p == NULL){
+    return NULL;
+  }
+  __atomic_fetch_add(&port_stats.pbuf_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&port_stats.pbuf_bytes, length, __ATOMIC_RELAXED);
+  p->next = NULL;
+  p->payload = p + 1;
+  p->tot_len = length;
+  p->len = length;
+  p->flags = 0;
+  return p;
+}
+
+struct pbuf *
+pbuf_alloced_custom(pbuf_layer layer, u16_t length, pbuf_type type, struct pbuf_custom *p,
+                    void *payload_mem, u16_t payload_mem_len){
+  if (length > payload_mem_len){
+    return NULL;
+  }
+  p->pbuf.next = NULL;
+  p->pbuf.payload = payload_mem;
+  p->pbuf.tot_len = length;
+  p->pbuf.len = length;
+  p->pbuf.flags = PBUF_FLAG_IS_CUSTOM;
+  return &p->pbuf;
+}
+
+/** @brief release one pbuf of a chain, to its owner if it is custom */
+static void
+pbuf_release(struct pbuf *p){
+  if (p->flags & PBUF_FLAG_IS_CUSTOM){
+    ((struct pbuf_custom *) p)->custom_free_function(p);
+  }
+  else{
+    free(p);
+  }
+}
+
+u8_t
+pbuf_free(struct pbuf *p){
+  struct pbuf *next;
+  u8_t count = 0;
+
+  while (p != NULL){
+    next = p->next;
+    pbuf_release(p);
+    p = next;
+    count++;
+  }
+  return count;
+}
+
+void
+pbuf_realloc(struct pbuf *p, u16_t size){
+  u16_t shrink;
+  u16_t rem = size;
+  struct pbuf *q = p;
+
+  if (size >= p->tot_len){
+    return; // like lwIP, only shrinks
+  }
+  shrink = p->tot_len - size;
+  while (rem > q->len){
+    rem -= q->len;
+    q->tot_len -= shrink;
+    q = q->next;
+  }
+  q->len = rem;
+  q->tot_len = rem;
+  if (q->next != NULL){
+    pbuf_free(q->next);
+    q->next = NULL;
+  }
+}
+
+void
+pbuf_cat(struct pbuf *head, struct pbuf *tail){
+  struct pbuf *q;
+
+  for (q = head; q->next != NULL; q = q->next){
+    q->tot_len += tail->tot_len;
+  }
+  q->tot_len += tail->tot_len;
+  q->next = tail;
+}
+
+struct pbuf *
+pbuf_free_header(struct pbuf *q, u16_t size){
+  struct pbuf *next;
+
+  while (q != NULL && size > 0){
+    if (size >= q->len){
+      size -= q->len;
+      next = q->next;
+      pbuf_release(q);
+      q = next;
+    }
+    else{
+      q->payload = (u8_t *) q->payload + size;
+      q->len -= size;
+      q->tot_len -= size;
+      size = 0;
+    }
+  }
+  return q;
+}
+
+u16_t
+pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset){
+  u16_t copied = 0;
+  u16_t n;
+
+  for (; p != NULL && len > 0; p = p->next){
+    if (offset >= p->len){
+      offset -= p->len;
+      continue;
+    }
+    n = p->len - offset;
+    if (n > len){
+      n = len;
+    }
+    memcpy((u8_t *) dataptr + copied, (const u8_t *) p->payload + offset, n);
+    copied += n;
+    len -= n;
+    offset = 0;
+  }
+  __atomic_fetch_add(&port_stats.bytes_copied, copied, __ATOMIC_RELAXED);
+  return copied;
+}
+
+void
+sti_port_get_stats(STI_PORT_STATS *stats){
+  stats->pbuf_allocs = __atomic_load_n(&port_stats.pbuf_allocs, __ATOMIC_RELAXED);
+  stats->pbuf_bytes = __atomic_load_n(&port_stats.pbuf_bytes, __ATOMIC_RELAXED);
+  stats->bytes_copied = __atomic_load_n(&port_stats.bytes_copied, __ATOMIC_RELAXED);
+  stats->udp_sent = __atomic_load_n(&port_stats.udp_sent, __ATOMIC_RELAXED);
+}
+
+void *
+pbuf_get_contiguous(const struct pbuf *p, void *buffer, size_t bufsize, u16_t len, u16_t offset){
+  const struct pbuf *q = p;
+  u16_t off = offset;
+
+  if (p == NULL || (u32_t) offset + len > p->tot_len){
+    return NULL;
+  }
+  while (q != NULL && off >= q->len){
+    off -= q->len;
+    q = q->next;
+  }
+  if (q != NULL && (u32_t) off + len <= q->len){
+    return (u8_t *) q->payload + off;
+  }
+  if (bufsize < len || pbuf_copy_partial(p, buffer, len, offset) != len){
+    return NULL;
+  }
+  return buffer;
+}
@@ -0,0 +1,224 @@
+/** @file sti_port_posix.h
+ *  @brief Linux backend of the platform layer: lwIP compatible types for the host build
+ *
+ *  The resolver is written against lwIP. On the host there is no lwIP, so this
+ *  header supplies the small part of it the resolver uses: the integer and error
+ *  types, ip_addr_t, struct pbuf and the pbuf calls. Layouts and names follow
+ *  lwIP so the same source compiles on both. Do not include it directly, include
+ *  sti_port.h.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_PORT_POSIX_H
+#define STI_PORT_POSIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+typedef uint8_t u8_t;
+typedef int8_t s8_t;
+typedef uint16_t u16_t;
+typedef int16_t s16_t;
+typedef uint32_t u32_t;
+typedef int32_t s32_t;
+
+/* lwIP error codes, see lwip/err.h */
+typedef s8_t err_t;
+#define ERR_OK          0
+#define ERR_MEM        -1
+#define ERR_BUF        -2
+#define ERR_TIMEOUT    -3
+#define ERR_RTE        -4
+#define ERR_INPROGRESS -5
+#define ERR_VAL        -6
+#define ERR_WOULDBLOCK -7
+#define ERR_USE        -8
+#define ERR_ALREADY    -9
+#define ERR_ISCONN    -10
+#define ERR_CONN      -11
+#define ERR_IF        -12
+#define ERR_ABRT      -13
+#define ERR_RST       -14
+#define ERR_CLSD      -15
+#define ERR_ARG       -16
+
+/* IP addresses, laid out as lwIP's dual stack ip_addr_t. Addresses are in
+   network byte order */
+#define IPADDR_TYPE_V4 0U
+#define IPADDR_TYPE_V6 6U
+#define IPADDR_TYPE_ANY 46U
+
+typedef struct ip4_addr {
+  u32_t addr;
+} ip4_addr_t;
+
+typedef struct ip6_addr {
+  u32_t addr[4];
+  u8_t zone;
+} ip6_addr_t;
+
+typedef struct ip_addr {
+  union {
+    ip6_addr_t ip6;
+    ip4_addr_t ip4;
+  } u_addr;
+  u8_t type; /**< IPADDR_TYPE_V4 or IPADDR_TYPE_V6 */
+} ip_addr_t;
+
+#define IPADDR_STRLEN_MAX 46 // longest text form of an address, with the 0
+
+#define IP_IS_V6(ipaddr) ((ipaddr)->type == IPADDR_TYPE_V6)
+#define ip_addr_copy(dest, src) ((dest) = (src))
+
+static inline int
+ip_addr_cmp(const ip_addr_t *a, const ip_addr_t *b){
+  if (a->type != b->type){
+    return 0;
+  }
+  if (a->type == IPADDR_TYPE_V6){
+    for (int i = 0; i < 4; i++){
+      if (a->u_addr.ip6.addr[i] != b->u_addr.ip6.addr[i]){
+        return 0;
+      }
+    }
+    return 1;
+  }
+  return a->u_addr.ip4.addr == b->u_addr.ip4.addr;
+}
+
+#define ip4_addr_get_byte(ipaddr, idx) (((const u8_t *)(&(ipaddr)->addr))[idx])
+#define IPSTR "%d.%d.%d.%d"
+#define IP2STR(ipaddr) ip4_addr_get_byte(ipaddr, 0), ip4_addr_get_byte(ipaddr, 1), \
+                       ip4_addr_get_byte(ipaddr, 2), ip4_addr_get_byte(ipaddr, 3)
+
+/** @brief parse a dotted IPv4 or an IPv6 address
+  * @returns 1 on success, 0 if cp is not an address */
+int
+ipaddr_aton(const char *cp, ip_addr_t *addr);
+
+/** @brief print an address into buf
+  * @returns buf, or NULL if buf is too small */
+char *
+ipaddr_ntoa_r(const ip_addr_t *addr, char *buf, int buflen);
+
+/* Packet buffers. A pbuf from pbuf_alloc() is a single block in RAM, chains are
+   only made by pbuf_cat(). There is no reference counting. Custom pbufs over
+   memory the caller owns are made by pbuf_alloced_custom() */
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+typedef enum {
+  PBUF_TRANSPORT,
+  PBUF_IP,
+  PBUF_LINK,
+  PBUF_RAW
+} pbuf_layer;
+
+typedef enum {
+  PBUF_RAM,
+  PBUF_POOL,
+  PBUF_REF
+} pbuf_type;
+
+#define PBUF_FLAG_IS_CUSTOM 0x02U /**< the pbuf is a struct pbuf_custom */
+
+struct pbuf {
+  struct pbuf *next; /**< next pbuf in the chain */
+  void *payload; /**< the data of this pbuf */
+  u16_t tot_len; /**< bytes in this pbuf and all that follow it */
+  u16_t len; /**< bytes in this pbuf */
+  u8_t flags; /**< PBUF_FLAG_IS_CUSTOM or 0 */
+};
+
+/** @brief a pbuf whose owner frees it; pbuf_free() calls custom_free_function */
+struct pbuf_custom {
+  struct pbuf pbuf; /**< the pbuf itself, must be first */
+  void (*custom_free_function)(struct pbuf *p); /**< gives the pbuf back to its owner */
+};
+
+struct pbuf *
+pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+
+/** @brief make a pbuf of length bytes over payload_mem, as lwIP does
+  * @returns &p->pbuf, NULL if payload_mem_len is less than length */
+struct pbuf *
+pbuf_alloced_custom(pbuf_layer layer, u16_t length, pbuf_type type, struct pbuf_custom *p,
+                    void *payload_mem, u16_t payload_mem_len);
+
+u8_t
+pbuf_free(struct pbuf *p);
+
+void
+pbuf_realloc(struct pbuf *p, u16_t size);
+
+void
+pbuf_cat(struct pbuf *head, struct pbuf *tail);
+
+struct pbuf *
+pbuf_free_header(struct pbuf *q, u16_t size);
+
+u16_t
+pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+
+void *
+pbuf_get_contiguous(const struct pbuf *p, void *buffer, size_t bufsize, u16_t len, u16_t offset);
+
+/* Logging in the format of esp_log, written to stderr */
+#define STI_LOG_ERROR 1
+#define STI_LOG_WARN 2
+#define STI_LOG_INFO 3
+#define STI_LOG_DEBUG 4
+
+extern int sti_log_level; /**< messages above this level are dropped, default STI_LOG_INFO */
+
+void
+sti_log(int level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define STI_LOGE(tag, fmt, ...) sti_log(STI_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define STI_LOGW(tag, fmt, ...) sti_log(STI_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define STI_LOGI(tag, fmt, ...) sti_log(STI_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+void
+sti_log_hex(int level, const char *tag, const void *buf, int len);
+
+#define STI_LOGD(tag, fmt, ...) sti_log(STI_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+#define STI_LOG_HEX(tag, buf, len) sti_log_hex(STI_LOG_DEBUG, tag, buf, len)
+
+/** @brief Counters of the pbuf work done through this port, for resolv_bench */
+typedef struct s_STI_PORT_STATS {
+  u32_t pbuf_allocs; /**< pbufs allocated, received datagrams and segments included */
+  u32_t pbuf_bytes; /**< payload bytes of those pbufs */
+  u32_t bytes_copied; /**< bytes copied out of pbufs by pbuf_copy_partial() and pbuf_get_contiguous() */
+  u32_t udp_sent; /**< datagrams sent */
+} STI_PORT_STATS;
+
+/** @brief get the counters of the port layer, they only ever grow */
+void
+sti_port_get_stats(STI_PORT_STATS *stats);
+
+/** @brief make sti_wall_time() return wall, 0 for a clock that is not set yet,
+  * for resolv_bench
+  * @param pinned  0 to return to the system clock, wall is then ignored */
+void
+sti_port_set_wall_time(int pinned, u32_t wall);
+
+#endif /* STI_PORT_POSIX_H */
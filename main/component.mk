@@ -6,3 +6,21 @@
 # in the build directory. This behaviour is entirely configurable,
 # please read the ESP-IDF documents if you need to do this.
 #
+
+# The static hosts table, generated from the hosts file and list in menuconfig as
+# main/CMakeLists.txt does for the CMake build
+ifdef CONFIG_STI_RESOLV_STATIC_HOSTS
+STI_HOSTS_FILE := $(subst ",,$(CONFIG_STI_RESOLV_STATIC_HOSTS_FILE))
+ifneq ($(STI_HOSTS_FILE),)
+STI_HOSTS_FILE := $(abspath $(if $(filter /%,$(STI_HOSTS_FILE)),,$(COMPONENT_PATH)/)$(STI_HOSTS_FILE))
+endif
+
+CFLAGS += -DSTI_HOSTS_TABLE -I$(COMPONENT_BUILD_DIR)
+COMPONENT_EXTRA_CLEAN := sti_hosts_table.h
+
+sti_hosts.o: sti_hosts_table.h
+
+sti_hosts_table.h: $(COMPONENT_PATH)/gen_hosts_table.py $(STI_HOSTS_FILE) $(SDKCONFIG_MAKEFILE)
+	$(PYTHON) $(COMPONENT_PATH)/gen_hosts_table.py --ttl $(CONFIG_STI_RESOLV_STATIC_HOSTS_TTL) \
+		--list $(CONFIG_STI_RESOLV_STATIC_HOSTS_LIST) -o $@ $(STI_HOSTS_FILE)
+endif
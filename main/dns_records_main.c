@@ -36,8 +36,13 @@
 #include "lwip/dns.h"
 #include "lwip/sockets.h"
 #include "lwip/netdb.h"
+#include "lwip/pbuf.h"
 
 #include "sti_resolv.h"
+#include "sti_rr.h"
+#include "sti_srv.h"
+#include "sti_addr.h"
+#include "sti_addrinfo.h"
 
 /* The examples use WiFi configuration that you can set via project configuration menu
    If you'd rather not, just change the below entries to strings with
@@ -62,6 +67,12 @@
 #define EXAMPLE_FULL_XMPP_SRV_HOST "_xmpp-client._tcp.dismail.de"
 #endif
 
+#ifdef CONFIG_PREWARM_NAMES
+#define EXAMPLE_PREWARM_NAMES  CONFIG_PREWARM_NAMES
+#else
+#define EXAMPLE_PREWARM_NAMES "xmpp.dismail.de,_xmpp-client._tcp.dismail.de:SRV"
+#endif
+
 #ifdef CONFIG_PRIMARY_DNS_SERVER
 #define EXAMPLE_PRIMARY_DNS_SERVER  CONFIG_PRIMARY_DNS_SERVER
 #else
@@ -71,7 +82,7 @@
 #define MESSAGE_T_A 1 /* Message Type request is for type A DNS record*/
 #define MESSAGE_T_SRV 33 /* Message Type Request is for SRV records*/
 #define MESSAGE_C_IN 1 /* Message class is Internet */
-#define UDP_BUFFER_SIZE 100
+#define UDP_BUFFER_SIZE 512
 
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
@@ -81,11 +92,113 @@ static EventGroupHandle_t s_wifi_event_group;
  * - we failed to connect after the maximum amount of retries */
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
+/* For the resolver task: a lease was obtained, and the resolver has its servers */
+#define GOT_IP_BIT         BIT2
+#define RESOLVER_READY_BIT BIT3
+/* Asks the resolver task to exit, and its answer */
+#define RESOLVER_STOP_BIT    BIT4
+#define RESOLVER_STOPPED_BIT BIT5
+
+/* The resolver is started in a task of its own rather than in the event handler:
+ * the system event task has a small stack (CONFIG_ESP_SYSTEM_EVENT_TASK_STACK_SIZE)
+ * and must not wait on the cache load or the prewarm lookups */
+#define RESOLVER_TASK_STACK 4096
+#define RESOLVER_TASK_PRIORITY 5
+#define RESOLVER_SAVE_MS 60000 /* how often the task asks for a cache save */
 
 static const char *TAG = "wifi station";
 
 static int s_retry_num = 0;
 
+/* esp_netif reports DNS servers as esp_ip_addr_t, the resolver takes ip_addr_t */
+static void dns_info_to_ip_addr(const esp_netif_dns_info_t *dns_info, ip_addr_t *addr)
+{
+    memset(addr, 0, sizeof(ip_addr_t));
+    if (dns_info->ip.type == ESP_IPADDR_TYPE_V6) {
+        addr->type = IPADDR_TYPE_V6;
+        memcpy(addr->u_addr.ip6.addr, dns_info->ip.u_addr.ip6.addr, 16);
+    } else {
+        addr->type = IPADDR_TYPE_V4;
+        addr->u_addr.ip4.addr = dns_info->ip.u_addr.ip4.addr;
+    }
+}
+
+/* Give the resolver the configured server and the servers DHCP handed out. The
+ * first time the resolver is opened and the lookups the application will need are
+ * started; after that a new lease only replaces the server list. */
+static void resolver_start(esp_netif_t *netif)
+{
+    static const char *TAG = "resolver   ";
+    static bool started = false;
+    esp_netif_dns_info_t dns_info;
+    char addr_text[IPADDR_STRLEN_MAX];
+    ip_addr_t netif_dns;
+
+    /* The resolver measures how fast each server answers and sends queries to the
+     * fastest, so there is no need to guess which one to use. IPv4 and IPv6
+     * servers can be mixed. */
+    ip_addr_t dns_servers[3];
+    int dns_server_count = 0;
+
+    if (ipaddr_aton(EXAMPLE_PRIMARY_DNS_SERVER, &dns_servers[dns_server_count])) {
+        dns_server_count++;
+    }
+    if (esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns_info) == ESP_OK) {
+        dns_info_to_ip_addr(&dns_info, &netif_dns);
+        if (!ip_addr_isany(&netif_dns)) {
+            ESP_LOGI(TAG, "...Name Server Primary (netif): %s",
+                     ipaddr_ntoa_r(&netif_dns, addr_text, sizeof(addr_text)));
+            ip_addr_copy(dns_servers[dns_server_count], netif_dns);
+            dns_server_count++;
+        }
+    }
+    if (esp_netif_get_dns_info(netif, ESP_NETIF_DNS_BACKUP, &dns_info) == ESP_OK) {
+        dns_info_to_ip_addr(&dns_info, &netif_dns);
+        if (!ip_addr_isany(&netif_dns)) {
+            ESP_LOGI(TAG, "...Name Server Backup (netif) : %s",
+                     ipaddr_ntoa_r(&netif_dns, addr_text, sizeof(addr_text)));
+            ip_addr_copy(dns_servers[dns_server_count], netif_dns);
+            dns_server_count++;
+        }
+    }
+
+    ESP_LOGI(TAG, ".Initialize the Resolver");
+    if (resolv_init_servers(dns_servers, dns_server_count) != ERR_OK) {
+        ESP_LOGI(TAG, "... Error initializing resolver");
+        return;
+    }
+    if (!started) {
+        // all at once and without waiting: they run while the application starts up
+        ESP_LOGI(TAG, "...%d prewarm lookups started", resolv_prewarm(EXAMPLE_PREWARM_NAMES));
+        started = true;
+    }
+}
+
+/* Starts the resolver on every lease the event handler reports, and saves a changed
+ * answer cache now and then, away from the tasks that look names up. Exits when
+ * RESOLVER_STOP_BIT is set, before the resolver is closed. */
+static void resolver_task(void *arg)
+{
+    esp_netif_t *netif = (esp_netif_t *) arg;
+    EventBits_t bits;
+
+    for (;;) {
+        bits = xEventGroupWaitBits(s_wifi_event_group, GOT_IP_BIT | RESOLVER_STOP_BIT, pdFALSE,
+                                   pdFALSE, pdMS_TO_TICKS(RESOLVER_SAVE_MS));
+        if (bits & RESOLVER_STOP_BIT) {
+            xEventGroupSetBits(s_wifi_event_group, RESOLVER_STOPPED_BIT);
+            vTaskDelete(NULL);
+        }
+        if (bits & GOT_IP_BIT) {
+            xEventGroupClearBits(s_wifi_event_group, GOT_IP_BIT);
+            resolver_start(netif);
+            xEventGroupSetBits(s_wifi_event_group, RESOLVER_READY_BIT);
+        } else {
+            resolv_cache_save_due();
+        }
+    }
+}
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
@@ -104,7 +217,7 @@ static void event_handler(void* arg, esp_event_base_t event_base,
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
         s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        xEventGroupSetBits(s_wifi_event_group, GOT_IP_BIT | WIFI_CONNECTED_BIT);
     }
 }
 
@@ -113,6 +226,115 @@ void sti_cb (char *name, struct ip4_addr *addr){
     ESP_LOGI(TAG, "...DNS information for %s IP is: "IPSTR"", name, IP2STR(addr));
 }
 
+/* Walk the records of a res_query() answer and log the ones we asked for */
+static void log_answers(RESOLV_MSG *msg)
+{
+    static const char *TAG = "log_answers";
+    RESOLV_RR rr;
+    RESOLV_SRV srv;
+    const unsigned char *ip;
+    char name[RESOLV_NAME_MAX + 1];
+    char target[RESOLV_NAME_MAX + 1];
+
+    while (resolv_rr_next(msg, &rr) > 0) {
+        if (rr.section != RESOLV_SECTION_ANSWER) {
+            continue;
+        }
+        resolv_name_text(msg, rr.name_off, name, sizeof(name));
+        if ((ip = resolv_rr_a(&rr)) != NULL) {
+            ESP_LOGI(TAG, "...%s A %d.%d.%d.%d ttl %u", name, ip[0], ip[1], ip[2], ip[3],
+                     (unsigned) rr.ttl);
+        } else if (resolv_rr_srv(msg, &rr, &srv) == 0) {
+            resolv_name_text(msg, srv.target_off, target, sizeof(target));
+            ESP_LOGI(TAG, "...%s SRV %d %d %d %s ttl %u", name, srv.priority, srv.weight,
+                     srv.port, target, (unsigned) rr.ttl);
+        }
+    }
+}
+
+/* The lookups the example makes once the resolver is open */
+static void resolver_lookups(void)
+{
+    char addr_text[IPADDR_STRLEN_MAX];
+    char full_hostname_1[] = EXAMPLE_FULL_HOSTNAME;
+    char full_hostname_2[] = EXAMPLE_FULL_XMPP_SRV_HOST;
+
+    static unsigned char an[UDP_BUFFER_SIZE]; // static, too large for the task stack
+    memset(an,0,UDP_BUFFER_SIZE);
+    int anslen = UDP_BUFFER_SIZE;
+    int res;
+    RESOLV_MSG msg;
+    struct pbuf *resp;
+    RESOLV_ENDPOINT endpoints[RESOLV_SRV_MAX_RECORDS];
+    ip_addr_t addrs[4];
+
+    // Now do DNS request for a type "A" record
+    ESP_LOGI(TAG, "");
+    ESP_LOGI(TAG, "...Start of res_query for A records");
+
+    res = res_query(full_hostname_1, MESSAGE_C_IN, MESSAGE_T_A, an, anslen);
+    ESP_LOGI(TAG, "...length of returned buffer is %d", res);
+    if (res > 0 && resolv_msg_init(&msg, an, res) == 0) {
+        log_answers(&msg);
+    }
+    ESP_LOGI(TAG, "...End res_query for type A records");
+
+    // The IPv4 and IPv6 addresses together: the A and AAAA queries go out at the
+    // same time, so this takes one round trip rather than two
+    ESP_LOGI(TAG, "");
+    ESP_LOGI(TAG, "...Start of res_query_addr for %s", full_hostname_1);
+    res = res_query_addr(full_hostname_1, addrs, sizeof(addrs) / sizeof(addrs[0]));
+    for (int i = 0; i < res; i++) {
+        ESP_LOGI(TAG, "...%d. %s", i + 1, ipaddr_ntoa_r(&addrs[i], addr_text, sizeof(addr_text)));
+    }
+    ESP_LOGI(TAG, "...End res_query_addr, %d addresses", res);
+
+    // Now do an SRV record
+    ESP_LOGI(TAG, "");
+    ESP_LOGI(TAG, "...Start of res_query_pbuf for SRV records");
+
+    // this time the resolver hands over the received pbuf instead of copying it
+    res = res_query_pbuf(full_hostname_2, MESSAGE_C_IN, MESSAGE_T_SRV, &resp);
+    ESP_LOGI(TAG, "...length of res_query_pbuf returned buffer %d", res);
+    if (res > 0 && resolv_msg_init_pbuf(&msg, resp, an, anslen) == 0) {
+        log_answers(&msg);
+    }
+    if (resp != NULL) {
+        pbuf_free(resp);
+    }
+    ESP_LOGI(TAG, "...End res_query for SRV records");
+
+    // The SRV records and the addresses of their targets in one call, in the
+    // order a client should try them
+    ESP_LOGI(TAG, "");
+    ESP_LOGI(TAG, "...Start of res_query_srv for %s", full_hostname_2);
+    res = res_query_srv(full_hostname_2, endpoints, RESOLV_SRV_MAX_RECORDS);
+    for (int i = 0; i < res; i++) {
+        ESP_LOGI(TAG, "...%d. %s port %d", i + 1,
+                 ipaddr_ntoa_r(&endpoints[i].addr, addr_text, sizeof(addr_text)), endpoints[i].port);
+    }
+    ESP_LOGI(TAG, "...End res_query_srv, %d endpoints", res);
+
+    // The same lookup with the canonical names and TTLs, written into memory this
+    // task owns instead of a shared static hostent as gethostbyname() uses
+    static unsigned char arena[512];
+    RESOLV_ADDRINFO *ai;
+    ESP_LOGI(TAG, "");
+    ESP_LOGI(TAG, "...Start of res_getaddrinfo for %s", full_hostname_2);
+    res = res_getaddrinfo(full_hostname_2, RESOLV_AI_SRV, arena, sizeof(arena), &ai);
+    if (res > (int) sizeof(arena)) {
+        ESP_LOGI(TAG, "...the results need %d bytes", res);
+    }
+    for (int i = 1; ai != NULL; ai = ai->next, i++) {
+        ESP_LOGI(TAG, "...%d. %s %s port %d ttl %u", i, ai->name,
+                 ipaddr_ntoa_r(&ai->addr, addr_text, sizeof(addr_text)), ai->port, (unsigned) ai->ttl);
+    }
+    ESP_LOGI(TAG, "...End res_getaddrinfo");
+
+    // with CONFIG_STI_RESOLV_TRACE_ENTRIES, the lookups above for the host tool resolv_trace
+    resolv_trace_dump();
+}
+
 void wifi_init_sta(void)
 {
     s_wifi_event_group = xEventGroupCreate();
@@ -128,6 +350,9 @@ void wifi_init_sta(void)
 
     esp_netif_handle = esp_netif_create_default_wifi_sta();
 
+    xTaskCreate(resolver_task, "resolver", RESOLVER_TASK_STACK, esp_netif_handle,
+                RESOLVER_TASK_PRIORITY, NULL);
+
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
@@ -208,84 +433,30 @@ void wifi_init_sta(void)
     ESP_ERROR_CHECK(esp_netif_get_hostname(esp_netif_handle, &hostname));
     ESP_LOGI(TAG, "...Current Hostname from netif: %s", hostname);
 
-    //get information on the DNS connections established when WiFI was configured
-    esp_netif_dns_type_t ask_for_primary = ESP_NETIF_DNS_MAIN;
-    esp_netif_dns_info_t dns_info;
-
-    esp_netif_get_dns_info(esp_netif_handle, ask_for_primary, &dns_info);
-    ESP_LOGI(TAG, "...Name Server Primary (netif): " IPSTR, IP2STR(&dns_info.ip.u_addr.ip4));
-
-    /* Use this code if you want the discovered DNS server to be used. Usually, other
-      * DNS servers are faster.
-    ip_addr_t dnsserver_ip_addr;
-    dnsserver_ip_addr.type = IPADDR_TYPE_V4;
-    dnsserver_ip_addr.u_addr.ip4.addr = dns_info.ip.u_addr.ip4.addr;
-    */
-
-    ip_addr_t primary_dns_server;
-    primary_dns_server.type = IPADDR_TYPE_V4;
-    primary_dns_server.u_addr.ip4.addr = inet_addr((const char *) EXAMPLE_PRIMARY_DNS_SERVER);
-
-    ESP_LOGI(TAG, "\n");
-    ESP_LOGI(TAG, ".Initialize the Resolver");
-
-    err_t ret;
-    //ret = resolv_init(&dnsserver_ip_addr);
-    ret = resolv_init(&primary_dns_server);
-    if (ret < 0 ){
-      ESP_LOGI(TAG, "... Error initializing resolver " );
-    }
-
-    struct hostent *hp;
-    struct ip4_addr *ip4_addr;
-
-    char full_hostname_1[] = EXAMPLE_FULL_HOSTNAME;
-    char full_hostname_2[] = EXAMPLE_FULL_XMPP_SRV_HOST;
-
-    unsigned char an[UDP_BUFFER_SIZE];
-    memset(an,0,UDP_BUFFER_SIZE);
-    int anslen = UDP_BUFFER_SIZE;
-    int res;
-
-    // Now do DNS request for a type "A" record
-    ESP_LOGI(TAG, "");
-    ESP_LOGI(TAG, "...Start of res_query for A records");
-
-    res = res_query(full_hostname_1, MESSAGE_C_IN, MESSAGE_T_A, an, anslen);
-    ESP_LOGI(TAG, "...length of returned buffer is %d", res);
-    print_buf(an,res);
-    ESP_LOGI(TAG, "...End res_query for type A records");
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
-
-    // Now do an SRV record
-    ESP_LOGI(TAG, "");
-    ESP_LOGI(TAG, "...Start of res_query for SRV records");
-    memset(an,0,100); // reset an to zero
-
-    res = res_query(full_hostname_2, MESSAGE_C_IN, MESSAGE_T_SRV, an, anslen);
-    ESP_LOGI(TAG, "...length of res_query returned buffer %d", res);
-    print_buf(an,res);
-    ESP_LOGI(TAG, "...End res_query for SRV records");
-
-    ret = resolv_close(); //close the UDP port and free memory
-    if (ret < 0 ){
-      ESP_LOGI(TAG, "... Error closing resolver UDP connection" );
+    /* The resolver task opens the resolver once the lease is there (resolver_start()),
+     * and the names in EXAMPLE_PREWARM_NAMES have been in flight since then, so the
+     * lookups are mostly answered from the cache. Without a lease there is nothing
+     * to wait for. */
+    if (bits & WIFI_CONNECTED_BIT) {
+        xEventGroupWaitBits(s_wifi_event_group, RESOLVER_READY_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+        resolver_lookups();
     }
 
-    ESP_LOGI(TAG, "\n");
-    ESP_LOGI(TAG, ".Begin gethostbyname");
-    hp = gethostbyname(full_hostname_1);
-
-    ip4_addr = (struct ip4_addr *)hp->h_addr_list[0];
-
-    ESP_LOGI(TAG, "...Gathering DNS records for %s ", full_hostname_1);
-    ESP_LOGI(TAG, "...Address No. 0 from DNS: " IPSTR, IP2STR(ip4_addr));
-
     ESP_LOGI(TAG, "Done with connection... Now shutdown handlers");
 
-
     ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
     ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
+
+    // no lease can reach the resolver task now; it exits between two saves, and
+    // only then is the resolver closed
+    xEventGroupSetBits(s_wifi_event_group, RESOLVER_STOP_BIT);
+    xEventGroupWaitBits(s_wifi_event_group, RESOLVER_STOPPED_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+    if (xEventGroupGetBits(s_wifi_event_group) & RESOLVER_READY_BIT) {
+        err_t ret = resolv_close(); //close the UDP port and free memory
+        if (ret < 0 ){
+          ESP_LOGI(TAG, "... Error closing resolver UDP connection" );
+        }
+    }
     vEventGroupDelete(s_wifi_event_group);
 }
 
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""Build the static hosts table of the resolver, see sti_hosts.c
+
+Reads hosts-style lines ("address name [alias...]", # starts a comment) from
+the given files and from --list (entries separated by ';') and writes a C header
+with a DNS responce for the A and the AAAA question of every name, and a minimal
+perfect hash over the questions made by hash and displace: the first hash picks
+a bucket, the seed stored for the bucket gives the second hash, which picks the
+slot. A name with addresses of one family only gets an empty (NODATA) responce
+for the other, so neither question goes to the network.
+
+usage: gen_hosts_table.py [--list entries] [--ttl seconds] -o out.h [file...]
+"""
+
+import argparse
+import ipaddress
+import struct
+import sys
+
+TYPE_A = 1
+TYPE_AAAA = 28
+CLASS_IN = 1
+MAX_NAME_LENGTH = 253
+LABEL_MAX = 63
+SEED_MAX = 0xFFFF
+
+
+def fnv1a(seed, key):
+    """FNV-1a with the offset basis xored with seed, as hosts_hash() in sti_hosts.c"""
+    h = 2166136261 ^ seed
+    for b in key:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def encode_name(name, where):
+    """the QNAME of name in wire format"""
+    labels = name.split('.')
+    if len(name) > MAX_NAME_LENGTH or any(not l or len(l) > LABEL_MAX for l in labels):
+        sys.exit('%s: cannot encode name "%s"' % (where, name))
+    return b''.join(bytes([len(l)]) + l.encode('ascii') for l in labels) + b'\0'
+
+
+def read_entries(lines, where, hosts):
+    """add the addresses of every "address name [alias...]" line to hosts"""
+    for n, line in enumerate(lines, 1):
+        fields = line.split('#', 1)[0].split()
+        if not fields:
+            continue
+        if len(fields) < 2:
+            sys.exit('%s:%d: no name after the address' % (where, n))
+        try:
+            addr = ipaddress.ip_address(fields[0].split('%', 1)[0])
+        except ValueError:
+            sys.exit('%s:%d: "%s" is not an IP address' % (where, n, fields[0]))
+        for name in fields[1:]:
+            name = name.lower().rstrip('.')
+            entry = hosts.setdefault(name, ([], []))
+            family = entry[0] if addr.version == 4 else entry[1]
+            if addr.packed not in family:
+                family.append(addr.packed)
+
+
+def responce(question, qtype, addrs, ttl):
+    """an authoritative responce to question with one answer per address"""
+    msg = struct.pack('>HBBHHHH', 0, 0x85, 0x80, 1, len(addrs), 0, 0) + question
+    for a in addrs:
+        msg += struct.pack('>HHHIH', 0xC00C, qtype, CLASS_IN, ttl, len(a)) + a
+    return msg
+
+
+def perfect_hash(keys):
+    """find bucket seeds that send every key to its own slot
+    returns (seeds, slots), slots[i] the index of the key in slot i"""
+    nslots = len(keys)
+    while True:
+        nbuckets = nslots // 2 + 1
+        buckets = [[] for _ in range(nbuckets)]
+        for i, k in enumerate(keys):
+            buckets[fnv1a(0, k) % nbuckets].append(i)
+        seeds = [0] * nbuckets
+        slots = [None] * nslots
+        for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+            if not buckets[b]:
+                continue
+            for seed in range(1, SEED_MAX + 1):
+                taken = [fnv1a(seed, keys[i]) % nslots for i in buckets[b]]
+                if len(set(taken)) == len(taken) and all(slots[s] is None for s in taken):
+                    break
+            else:
+                break
+            seeds[b] = seed
+            for i, s in zip(buckets[b], taken):
+                slots[s] = i
+        else:
+            return seeds, slots
+        nslots += 1 # no seed fits, try again with a spare slot
+
+
+def c_array(data, indent='  ', width=12):
+    rows = [', '.join('0x%02x' % b for b in data[i:i + width]) for i in range(0, len(data), width)]
+    return ',\n'.join(indent + r for r in rows)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build the static hosts table of the resolver')
+    parser.add_argument('files', nargs='*', help='hosts-style files')
+    parser.add_argument('--list', default='', help='more entries, separated by ";"')
+    parser.add_argument('--ttl', type=int, default=3600, help='TTL of the answers in seconds')
+    parser.add_argument('-o', dest='out', required=True, help='the header to write')
+    args = parser.parse_args()
+
+    hosts = {}
+    for path in args.files:
+        if path:
+            with open(path) as f:
+                read_entries(f.read().splitlines(), path, hosts)
+    read_entries(args.list.split(';'), 'CONFIG_STI_RESOLV_STATIC_HOSTS_LIST', hosts)
+
+    keys, msgs = [], []
+    for name in sorted(hosts):
+        qname = encode_name(name, 'static hosts')
+        for qtype, addrs in ((TYPE_A, hosts[name][0]), (TYPE_AAAA, hosts[name][1])):
+            question = qname + struct.pack('>HH', qtype, CLASS_IN)
+            keys.append(question[:-2]) # QNAME and QTYPE, as hosts_hash() hashes them
+            msgs.append((len(question), responce(question, qtype, addrs, args.ttl)))
+
+    seeds, slots = perfect_hash(keys) if keys else ([0], [])
+    blob = b''
+    entries = []
+    for i in slots:
+        if i is None:
+            entries.append('{0, 0, 0}')
+            continue
+        question_len, msg = msgs[i]
+        entries.append('{%d, %d, %d}' % (len(blob), len(msg), question_len))
+        blob += msg
+    if len(blob) > 0xFFFF:
+        sys.exit('static hosts: the table is larger than 64 KiB')
+
+    with open(args.out, 'w') as f:
+        f.write('/* Generated by gen_hosts_table.py, do not edit. Names: %d */\n\n' % len(hosts))
+        f.write('#define HOSTS_BUCKETS %d\n' % len(seeds))
+        f.write('#define HOSTS_SLOTS %d\n\n' % len(slots))
+        if slots:
+            f.write('static const u16_t hosts_seeds[HOSTS_BUCKETS] = {%s};\n\n'
+                    % ', '.join(str(s) for s in seeds))
+            f.write('static const HOSTS_ENTRY hosts_slots[HOSTS_SLOTS] = {\n  %s\n};\n\n'
+                    % ',\n  '.join(entries))
+            f.write('static const u8_t hosts_msgs[] = {\n%s\n};\n' % c_array(blob))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,312 @@
+/** @file sti_addr.c
+ *  @brief Look up the IPv4 and IPv6 addresses of a name in one round trip
+ *
+ *  See sti_addr.h. Key references are
+ *  (1) rfc 8305 Happy Eyeballs Version 2: Better Connectivity Using Concurrency
+ *  (2) rfc 3596 DNS Extensions to Support IP Version 6
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_resolv_priv.h"
+#include "sti_rr.h"
+#include "sti_addr.h"
+#include "sti_pool.h"
+
+/* How long the first family to answer waits for the other one, rfc 8305 3
+   calls this the Resolution Delay */
+#ifdef CONFIG_STI_RESOLV_FAMILY_DELAY_MS
+#define RESOLV_FAMILY_DELAY_MS CONFIG_STI_RESOLV_FAMILY_DELAY_MS
+#else
+#define RESOLV_FAMILY_DELAY_MS 50
+#endif
+
+#ifdef CONFIG_STI_RESOLV_PREFER_IPV6
+#define ADDR_PREFERRED_TYPE RESOLV_TYPE_AAAA
+#define ADDR_OTHER_TYPE RESOLV_TYPE_A
+#else
+#define ADDR_PREFERRED_TYPE RESOLV_TYPE_A
+#define ADDR_OTHER_TYPE RESOLV_TYPE_AAAA
+#endif
+
+struct pbuf *
+resolv_pbuf_contiguous(struct pbuf *p){
+  struct pbuf *q;
+
+  if (p == NULL || p->next == NULL){
+    return p;
+  }
+  q = pool_pbuf_alloc(p->tot_len);
+  if (q != NULL){
+    pbuf_copy_partial(p, q->payload, p->tot_len, 0);
+  }
+  pbuf_free(p);
+  return q;
+}
+
+/** @brief get the next address of the wanted type from the answer section
+  * Sets the address, TTL and owner name of found.
+  * @returns 1 if found was set, 0 at the end of the answer section */
+static int
+addr_next(RESOLV_MSG *walk, u16_t type, RESOLV_FOUND *found){
+  RESOLV_RR rr;
+  const unsigned char *ip;
+  ip_addr_t *addr = &found->addr;
+
+  while (resolv_rr_next(walk, &rr) > 0 && rr.section == RESOLV_SECTION_ANSWER){
+    memset(addr, 0, sizeof(ip_addr_t));
+    found->ttl = rr.ttl;
+    found->name_off = rr.name_off;
+    if (type == RESOLV_TYPE_A && (ip = resolv_rr_a(&rr)) != NULL){
+      addr->type = IPADDR_TYPE_V4;
+      memcpy(&addr->u_addr.ip4.addr, ip, 4);
+      return 1;
+    }
+    if (type == RESOLV_TYPE_AAAA && (ip = resolv_rr_aaaa(&rr)) != NULL){
+      addr->type = IPADDR_TYPE_V6;
+      memcpy(addr->u_addr.ip6.addr, ip, 16);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** @brief the smallest TTL of the CNAME records in the answer section, which
+  * bounds how long the addresses they lead to may be used */
+static u32_t
+addr_chain_ttl(const RESOLV_MSG *msg){
+  RESOLV_MSG walk = *msg;
+  RESOLV_RR rr;
+  u32_t ttl = 0xFFFFFFFF;
+
+  while (resolv_rr_next(&walk, &rr) > 0 && rr.section == RESOLV_SECTION_ANSWER){
+    if (rr.type == RESOLV_TYPE_CNAME && rr.ttl < ttl){
+      ttl = rr.ttl;
+    }
+  }
+  return ttl;
+}
+
+/** @brief note the responce of one family, in the network context */
+static void
+addr_family_done(ADDR_LOOKUP *lookup, int i, struct pbuf *resp){
+  ADDR_FAMILY *f = &lookup->family[i];
+  RESOLV_MSG walk;
+  RESOLV_FOUND addr;
+  int found = 0;
+
+  f->resp = resolv_pbuf_contiguous(resp);
+  if (f->resp != NULL && resolv_msg_init_pbuf(&walk, f->resp, NULL, 0) == 0 &&
+      RESOLV_RCODE(&walk) == 0){
+    while (found < 255 && addr_next(&walk, f->type, &addr)){
+      found++;
+    }
+  }
+  f->found = found;
+  f->done_ms = sti_now_ms();
+  f->done = 1;
+  sti_event_signal(lookup->event);
+}
+
+/** @brief res_query_cb of the preferred family */
+static void
+addr_preferred_cb(void *arg, err_t err, struct pbuf *resp){
+  addr_family_done((ADDR_LOOKUP *) arg, 0, resp);
+}
+
+/** @brief res_query_cb of the other family */
+static void
+addr_other_cb(void *arg, err_t err, struct pbuf *resp){
+  addr_family_done((ADDR_LOOKUP *) arg, 1, resp);
+}
+
+void
+addr_lookup_start(ADDR_LOOKUP *lookup, const char *name, sti_event_t event){
+  static const res_query_cb cbs[2] = {addr_preferred_cb, addr_other_cb};
+  ADDR_FAMILY *f;
+
+  memset(lookup, 0, sizeof(ADDR_LOOKUP));
+  lookup->event = event;
+  lookup->family[0].type = ADDR_PREFERRED_TYPE;
+  lookup->family[1].type = ADDR_OTHER_TYPE;
+  for (int i = 0; i < 2; i++){
+    f = &lookup->family[i];
+    if (name != NULL && event != NULL){
+      f->handle = res_query_async(name, RESOLV_CLASS_IN, f->type, cbs[i], lookup);
+    }
+    if (f->handle == 0){
+      f->done = 1;
+    }
+  }
+}
+
+/** @brief time left before the lookup stops waiting for its slower family
+  * @returns milliseconds left, 0 if the wait is over, -1 if no family has
+  * answered with addresses yet so there is nothing to time */
+static s32_t
+addr_lookup_left(const ADDR_LOOKUP *lookup, u32_t now){
+  s32_t left = -1;
+  s32_t l;
+
+  for (int i = 0; i < 2; i++){
+    const ADDR_FAMILY *f = &lookup->family[i];
+    if (f->done && f->found){
+      l = (s32_t)(f->done_ms + RESOLV_FAMILY_DELAY_MS - now);
+      l = (l < 0) ? 0 : l;
+      left = (left < 0 || l < left) ? l : left;
+    }
+  }
+  return left;
+}
+
+/** @brief cancel the queries of a lookup that have not completed
+  * @returns number of queries whose completion is still on its way */
+static int
+addr_lookup_cancel(ADDR_LOOKUP *lookup){
+  int waiting = 0;
+
+  for (int i = 0; i < 2; i++){
+    ADDR_FAMILY *f = &lookup->family[i];
+    if (!f->done && res_query_cancel(f->handle) == ERR_OK){
+      f->done = 1;
+    }
+    waiting += !f->done;
+  }
+  return waiting;
+}
+
+void
+addr_lookup_wait(ADDR_LOOKUP *lookups, int n, sti_event_t event){
+  u32_t now, wait;
+  s32_t left;
+  int waiting;
+
+  for (;;){
+    now = sti_now_ms();
+    wait = RESOLV_TIMEOUT_MS + RESOLV_WAIT_SLACK_MS;
+    waiting = 0;
+    for (int i = 0; i < n; i++){
+      if (lookups[i].family[0].done && lookups[i].family[1].done){
+        continue;
+      }
+      left = addr_lookup_left(&lookups[i], now);
+      if (left == 0){
+        // rfc 8305 3: go ahead with the family that answered
+        waiting += addr_lookup_cancel(&lookups[i]);
+        continue;
+      }
+      waiting++;
+      if (left > 0 && (u32_t) left < wait){
+        wait = left;
+      }
+    }
+    if (waiting == 0){
+      return;
+    }
+    if (!sti_event_wait(event, wait) && wait == RESOLV_TIMEOUT_MS + RESOLV_WAIT_SLACK_MS){
+      // a completion that never arrived, as in res_query()
+      for (int i = 0; i < n; i++){
+        addr_lookup_cancel(&lookups[i]);
+      }
+    }
+  }
+}
+
+int
+addr_lookup_each(ADDR_LOOKUP *lookup, resolv_found_fn fn, void *ctx){
+  RESOLV_MSG walk[2];
+  RESOLV_FOUND found;
+  u32_t chain_ttl[2];
+  int more[2];
+  int go = 1;
+
+  for (int i = 0; i < 2; i++){
+    more[i] = fn != NULL && lookup->family[i].found &&
+              resolv_msg_init_pbuf(&walk[i], lookup->family[i].resp, NULL, 0) == 0;
+    chain_ttl[i] = more[i] ? addr_chain_ttl(&walk[i]) : 0;
+  }
+  found.srv = NULL;
+  while (go && (more[0] || more[1])){
+    for (int i = 0; i < 2 && go; i++){
+      if (more[i] && (more[i] = addr_next(&walk[i], lookup->family[i].type, &found))){
+        found.msg = &walk[i];
+        found.ttl = (chain_ttl[i] < found.ttl) ? chain_ttl[i] : found.ttl;
+        go = fn(ctx, &found);
+      }
+    }
+  }
+  for (int i = 0; i < 2; i++){
+    if (lookup->family[i].resp != NULL){
+      pbuf_free(lookup->family[i].resp);
+      lookup->family[i].resp = NULL;
+    }
+  }
+  return go;
+}
+
+/** @brief where addr_collect() puts the addresses of res_query_addr() */
+typedef struct s_ADDR_ARRAY {
+  ip_addr_t *addrs; /**< the caller's array */
+  int max; /**< number of entries in addrs */
+  int n; /**< number of entries written */
+} ADDR_ARRAY;
+
+/** @brief resolv_found_fn of res_query_addr() */
+static int
+addr_collect(void *ctx, const RESOLV_FOUND *found){
+  ADDR_ARRAY *array = (ADDR_ARRAY *) ctx;
+
+  ip_addr_copy(array->addrs[array->n], found->addr);
+  return ++array->n < array->max;
+}
+
+void
+addr_resolve(const char *name, resolv_found_fn fn, void *ctx){
+  static const char *TAG = "res_query_addr";
+  ADDR_LOOKUP lookup;
+  sti_event_t event;
+
+  event = resolv_event_get();
+  if (event == NULL){
+    STI_LOGI(TAG, "...no free event");
+    return;
+  }
+  addr_lookup_start(&lookup, name, event);
+  addr_lookup_wait(&lookup, 1, event);
+  resolv_event_put(event);
+  addr_lookup_each(&lookup, fn, ctx);
+}
+
+int
+res_query_addr(const char *name, ip_addr_t *addrs, int max_addrs){
+  ADDR_ARRAY array = {addrs, max_addrs, 0};
+
+  if (max_addrs > 0){
+    addr_resolve(name, addr_collect, &array);
+  }
+  return array.n;
+}
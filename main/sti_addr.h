@@ -0,0 +1,52 @@
+/** @file sti_addr.h
+ *  @brief Look up the IPv4 and IPv6 addresses of a name in one round trip
+ *
+ *  res_query_addr() asks the A and the AAAA question at the same time instead of
+ *  one after the other, and returns once the preferred family has answered and the
+ *  other has had a short time to follow (Happy Eyeballs, rfc 8305).
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_ADDR_H
+#define STI_ADDR_H
+
+/** @brief get the IPv4 and IPv6 addresses of a name
+  *
+  * The A and AAAA queries are started together. When one family answers with
+  * addresses the call waits at most CONFIG_STI_RESOLV_FAMILY_DELAY_MS more for the
+  * other, so a slow or lost responce for one family does not hold up the other.
+  * An answer without addresses does not start that wait. The addresses are
+  * returned with the families alternating, starting with the preferred one
+  * (IPv6 unless CONFIG_STI_RESOLV_PREFER_IPV6 is disabled), which is the order a
+  * client should try to connect in. The calling task blocks.
+  * @param name  the name to look up, e.g. "xmpp.dismail.de"
+  * @param addrs  filled with the addresses
+  * @param max_addrs  number of entries in addrs
+  * @returns the number of addresses written, 0 if the name has none or no
+  * answer arrived within CONFIG_STI_RESOLV_TIMEOUT_MS
+  */
+int
+res_query_addr(const char *name, ip_addr_t *addrs, int max_addrs);
+
+#endif /* STI_ADDR_H */
@@ -0,0 +1,127 @@
+/** @file sti_addrinfo.c
+ *  @brief Reentrant name lookup with typed results in a caller supplied arena
+ *
+ *  See sti_addrinfo.h. The lookups are those of res_query_addr() and
+ *  res_query_srv(); this file only lays their results out in the arena. Results
+ *  fill the arena from the front and their names from the back, as
+ *  gethostbyname_r() does with its buffer, so neither needs to be sized ahead.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_resolv_priv.h"
+#include "sti_rr.h"
+#include "sti_addrinfo.h"
+
+#define AI_ALIGN sizeof(void *) // alignment of the results in the arena
+
+/** @brief The arena being filled by res_getaddrinfo() */
+typedef struct s_AI_ARENA {
+  unsigned char *start; /**< the arena, aligned for RESOLV_ADDRINFO */
+  int len; /**< bytes usable from start, may be negative for a tiny arena */
+  int results; /**< bytes the results need, at the front */
+  int names; /**< bytes the names need, at the back */
+  u8_t fits; /**< set to 0 once a result did not fit */
+  RESOLV_ADDRINFO *last; /**< the last result written, NULL before the first */
+  const char *name; /**< the last name written, shared by the results of its host */
+  char text[RESOLV_NAME_MAX + 1]; /**< name of the result being added */
+  char prev[RESOLV_NAME_MAX + 1]; /**< name of the result added before it */
+} AI_ARENA;
+
+/** @brief resolv_found_fn that appends a result to the arena
+  * When the arena is full the sizes are still counted, so the caller learns how
+  * large an arena the whole answer needs. */
+static int
+ai_add(void *ctx, const RESOLV_FOUND *found){
+  AI_ARENA *a = (AI_ARENA *) ctx;
+  RESOLV_ADDRINFO *ai;
+  int name_len = 0;
+  int new_name;
+
+  if (resolv_name_text(found->msg, found->name_off, a->text, sizeof(a->text)) < 0){
+    a->text[0] = 0;
+  }
+  // results of one host come one after another, so comparing with the last one
+  // is enough to share its name
+  new_name = a->results == 0 || strcmp(a->text, a->prev) != 0;
+  if (new_name){
+    name_len = strlen(a->text) + 1;
+    memcpy(a->prev, a->text, name_len);
+  }
+  if (a->fits && a->results + (int) sizeof(RESOLV_ADDRINFO) + a->names + name_len <= a->len){
+    ai = (RESOLV_ADDRINFO *)(a->start + a->results);
+    memset(ai, 0, sizeof(RESOLV_ADDRINFO));
+    ip_addr_copy(ai->addr, found->addr);
+    ai->ttl = found->ttl;
+    if (found->srv != NULL){
+      ai->port = found->srv->port;
+      ai->priority = found->srv->priority;
+      ai->weight = found->srv->weight;
+    }
+    if (new_name){
+      a->name = (const char *) memcpy(a->start + a->len - a->names - name_len, a->text, name_len);
+    }
+    ai->name = a->name;
+    if (a->last != NULL){
+      a->last->next = ai;
+    }
+    a->last = ai;
+  }
+  else{
+    a->fits = 0;
+  }
+  a->results += sizeof(RESOLV_ADDRINFO);
+  a->names += name_len;
+  return 1;
+}
+
+int
+res_getaddrinfo(const char *name, int flags, void *arena, int arena_len,
+                RESOLV_ADDRINFO **result){
+  AI_ARENA a;
+  int pad = (int)((AI_ALIGN - (uintptr_t) arena % AI_ALIGN) % AI_ALIGN);
+
+  *result = NULL;
+  memset(&a, 0, sizeof(a));
+  a.start = (unsigned char *) arena + pad;
+  a.len = arena_len - pad;
+  a.fits = arena != NULL;
+  if (flags & RESOLV_AI_SRV){
+    srv_resolve(name, ai_add, &a);
+  }
+  else{
+    addr_resolve(name, ai_add, &a);
+  }
+  if (a.results == 0){
+    return 0;
+  }
+  if (a.fits){
+    *result = (RESOLV_ADDRINFO *) a.start;
+  }
+  return pad + a.results + a.names;
+}
@@ -0,0 +1,71 @@
+/** @file sti_addrinfo.h
+ *  @brief Reentrant name lookup with typed results in a caller supplied arena
+ *
+ *  res_getaddrinfo() is the resolver's answer to gethostbyname(): it has no shared
+ *  static result, handles IPv6 and SRV names, and reports the canonical name and
+ *  TTL of every address. The results are written to memory the caller owns, so
+ *  tasks can resolve at the same time without locking and the memory a lookup
+ *  costs is known in advance.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_ADDRINFO_H
+#define STI_ADDRINFO_H
+
+#define RESOLV_AI_SRV 0x01 /**< res_getaddrinfo(): the name is an SRV name, return its endpoints */
+
+/** @brief One result of res_getaddrinfo() */
+typedef struct s_RESOLV_ADDRINFO {
+  struct s_RESOLV_ADDRINFO *next; /**< the next result, NULL after the last */
+  ip_addr_t addr; /**< the address */
+  u32_t ttl; /**< seconds the address may be used for */
+  u16_t port; /**< port of the service, 0 unless RESOLV_AI_SRV */
+  u16_t priority; /**< priority of the SRV record, 0 unless RESOLV_AI_SRV */
+  u16_t weight; /**< weight of the SRV record, 0 unless RESOLV_AI_SRV */
+  const char *name; /**< canonical name of the host (the end of any CNAME chain),
+                         0 terminated; results of the same host share the string */
+} RESOLV_ADDRINFO;
+
+/** @brief look up a name and write the results to arena
+  *
+  * Without flags the IPv4 and IPv6 addresses of the name are looked up as
+  * res_query_addr() does. With RESOLV_AI_SRV the name is resolved to endpoints as
+  * res_query_srv() does. The results are a list in the order they should be tried,
+  * placed at the start of arena with the names they point to at its end. Nothing
+  * is allocated and nothing outside arena is written, so the call is reentrant.
+  * The calling task blocks.
+  * @param name  the name to look up, e.g. "xmpp.dismail.de" or "_xmpp-client._tcp.dismail.de"
+  * @param flags  0 or RESOLV_AI_SRV
+  * @param arena  memory for the results
+  * @param arena_len  size of arena in bytes
+  * @param result  set to the first result; NULL if there are none or arena is too small
+  * @returns the number of bytes of arena the results take, 0 if there are none.
+  * A value larger than arena_len means arena is too small: call again with one of
+  * at least that size, which is then usually answered from the cache.
+  */
+int
+res_getaddrinfo(const char *name, int flags, void *arena, int arena_len,
+                RESOLV_ADDRINFO **result);
+
+#endif /* STI_ADDRINFO_H */
@@ -0,0 +1,600 @@
+/** @file sti_cache.c
+ *  @brief Answer cache used by res_query()
+ *
+ *  Keeps the most recently used responces in a table whose size is fixed at
+ *  build time (CONFIG_STI_RESOLV_CACHE_ENTRIES entries of
+ *  CONFIG_STI_RESOLV_CACHE_ENTRY_SIZE bytes). No memory is allocated at run time,
+ *  except for the buffer of a snapshot while it is saved or loaded.
+ *
+ *  With CONFIG_STI_RESOLV_CACHE_PERSIST the table is saved with sti_store_write()
+ *  so that a restart does not begin with an empty cache. A snapshot is:
+ *    "STC1", saved at (4 bytes), entry count (2 bytes)
+ *  followed for every entry by:
+ *    expires (4 bytes), question length (2), responce length (2), question, responce
+ *  Times are seconds of sti_wall_time() and numbers are in network byte order.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_resolv_priv.h"
+#include "sti_cache.h"
+#include "sti_rr.h"
+
+/* The number of responces the cache can hold */
+#ifdef CONFIG_STI_RESOLV_CACHE_ENTRIES
+#define RESOLV_CACHE_ENTRIES CONFIG_STI_RESOLV_CACHE_ENTRIES
+#else
+#define RESOLV_CACHE_ENTRIES 8
+#endif
+
+/* Longest time a name that does not exist, or has no records of the asked type,
+   is remembered, in seconds. 0 turns negative caching off */
+#ifdef CONFIG_STI_RESOLV_NEG_TTL_MAX
+#define RESOLV_NEG_TTL_MAX CONFIG_STI_RESOLV_NEG_TTL_MAX
+#else
+#define RESOLV_NEG_TTL_MAX 300
+#endif
+
+/* Hits during its TTL that make an entry popular enough to be refreshed before it
+   expires. 0 turns prefetching off */
+#ifdef CONFIG_STI_RESOLV_PREFETCH_HITS
+#define RESOLV_PREFETCH_HITS CONFIG_STI_RESOLV_PREFETCH_HITS
+#else
+#define RESOLV_PREFETCH_HITS 2
+#endif
+
+/* How long an expired responce is kept for cache_lookup_stale(), in seconds */
+#ifdef CONFIG_STI_RESOLV_STALE_MAX_S
+#define RESOLV_STALE_MAX_S CONFIG_STI_RESOLV_STALE_MAX_S
+#else
+#define RESOLV_STALE_MAX_S 600
+#endif
+
+/* Keep the cache across restarts */
+#ifdef CONFIG_STI_RESOLV_CACHE_PERSIST
+#define RESOLV_CACHE_PERSIST 1
+#else
+#define RESOLV_CACHE_PERSIST 0
+#endif
+
+/* Least time between two saves of a changed cache by resolv_cache_save_due(), in
+   seconds. 0 saves only when resolv_cache_save() or resolv_close() is called */
+#ifdef CONFIG_STI_RESOLV_CACHE_SAVE_S
+#define RESOLV_CACHE_SAVE_S CONFIG_STI_RESOLV_CACHE_SAVE_S
+#else
+#define RESOLV_CACHE_SAVE_S 600
+#endif
+
+#define RESOLV_STALE_TTL 30 // TTL given to records of a stale answer, rfc 8767 4
+#define SNAP_KEY "cache" // sti_store_write() key of the snapshot
+#define SNAP_MAGIC "STC1" // first bytes of a snapshot, changes with the layout
+#define SNAP_HDR_LEN 10 // magic, saved at and entry count
+#define SNAP_ENTRY_HDR_LEN 8 // expires, question and responce lengths
+#define SNAP_MAX_LEN (SNAP_HDR_LEN + RESOLV_CACHE_ENTRIES * \
+                      (SNAP_ENTRY_HDR_LEN + RESOLV_QUESTION_MAX + RESOLV_CACHE_ENTRY_SIZE))
+
+/** @brief One cached responce */
+typedef struct s_CACHE_ENTRY {
+  u8_t in_use; /**< set to 1 if the entry holds a responce */
+  u8_t negative; /**< set to 1 if the responce is NXDOMAIN or has no answers */
+  u8_t refreshing; /**< set to 1 once a refresh has been asked for */
+  u16_t hits; /**< lookups answered since the responce was stored */
+  u32_t refresh_ms; /**< sti_now_ms() when the refresh was asked for */
+  u16_t question_len; /**< length of the encoded question */
+  unsigned char question[RESOLV_QUESTION_MAX]; /**< key: QNAME, QTYPE and QCLASS */
+  u16_t resp_len; /**< length of the stored responce */
+  u32_t stored_ms; /**< sti_now_ms() when the responce was stored */
+  u32_t ttl; /**< smallest TTL of the answer records in seconds */
+  u32_t last_used; /**< value of use_clock when the entry was last read or written */
+  unsigned char resp[RESOLV_CACHE_ENTRY_SIZE]; /**< the responce as received */
+} CACHE_ENTRY;
+
+static CACHE_ENTRY cache[RESOLV_CACHE_ENTRIES]; /**< the cache table */
+static sti_mutex_t cache_mutex = NULL; /**< guards cache and the counters */
+static u32_t use_clock; /**< incremented on every use, orders entries for LRU */
+static u32_t cache_hits; /**< lookups answered from the cache */
+static u32_t cache_misses; /**< lookups that had to go to the network */
+static u32_t cache_negative_hits; /**< hits that returned a negative responce */
+static u32_t cache_prefetches; /**< refreshes asked for before expiry */
+static u32_t cache_stale_answers; /**< expired responces handed out */
+static u8_t cache_dirty; /**< set to 1 when a responce was stored since the last save */
+static u8_t cache_loaded; /**< set to 1 once cache_load() found a snapshot or none */
+static u32_t cache_saved_ms; /**< sti_now_ms() of the last save */
+static unsigned char store_buf[RESOLV_CACHE_ENTRY_SIZE]; /**< cache_store(): a chained responce made contiguous, guarded by cache_mutex */
+
+/** @brief walk every resource record of a responce
+  *
+  * Finds how long the responce may be cached and, when age is not zero,
+  * subtracts age seconds from the TTL of every record (never going below floor).
+  * That is the smallest TTL in the answer section, or for a negative responce
+  * (NXDOMAIN, or no answers) the negative TTL of rfc 2308 5: the smaller of the
+  * TTL and the MINIMUM field of the SOA record in the authority section, capped
+  * at RESOLV_NEG_TTL_MAX.
+  * @param negative  set to 1 if the responce is negative, may be NULL
+  * @returns the TTL, 0 if the responce is malformed or must not be cached */
+static u32_t
+walk_ttls(unsigned char *buf, int len, u32_t age, u32_t floor, u8_t *negative){
+  RESOLV_MSG msg;
+  RESOLV_RR rr;
+  RESOLV_SOA soa;
+  u32_t min_ttl = 0xFFFFFFFF;
+  u32_t neg_ttl = 0xFFFFFFFF;
+  u32_t ttl;
+  int ret;
+
+  if (resolv_msg_init(&msg, buf, len) != 0){
+    return 0;
+  }
+  while ((ret = resolv_rr_next(&msg, &rr)) > 0){
+    if (rr.type == RESOLV_TYPE_OPT){
+      continue; // the TTL field of OPT holds flags, not a TTL
+    }
+    if (rr.section == RESOLV_SECTION_ANSWER && rr.ttl < min_ttl){
+      min_ttl = rr.ttl;
+    }
+    if (rr.section == RESOLV_SECTION_AUTHORITY && resolv_rr_soa(&msg, &rr, &soa) == 0){
+      ttl = (soa.minimum < rr.ttl) ? soa.minimum : rr.ttl;
+      neg_ttl = (ttl < neg_ttl) ? ttl : neg_ttl;
+    }
+    if (age != 0){
+      ttl = (rr.ttl > age + floor) ? rr.ttl - age : floor;
+      buf[rr.ttl_off] = (unsigned char)(ttl >> 24);
+      buf[rr.ttl_off + 1] = (unsigned char)(ttl >> 16);
+      buf[rr.ttl_off + 2] = (unsigned char)(ttl >> 8);
+      buf[rr.ttl_off + 3] = (unsigned char) ttl;
+    }
+  }
+  if (ret < 0){
+    return 0;
+  }
+  if (RESOLV_RCODE(&msg) == DNS_RCODE_NXDOMAIN || msg.ancount == 0){
+    if (negative != NULL){
+      *negative = 1;
+    }
+    // without an SOA there is no negative TTL and rfc 2308 5 says not to cache
+    if (neg_ttl == 0xFFFFFFFF){
+      return 0;
+    }
+    return (neg_ttl > RESOLV_NEG_TTL_MAX) ? RESOLV_NEG_TTL_MAX : neg_ttl;
+  }
+  if (negative != NULL){
+    *negative = 0;
+  }
+  return (min_ttl == 0xFFFFFFFF) ? 0 : min_ttl;
+}
+
+err_t
+cache_init(void){
+  if (cache_mutex == NULL){
+    cache_mutex = sti_mutex_create();
+    if (cache_mutex == NULL){
+      return ERR_MEM;
+    }
+  }
+  return ERR_OK;
+}
+
+/** @brief find the entry for a question, called with cache_mutex held
+  * @returns the entry, NULL if the question is not cached */
+static CACHE_ENTRY *
+cache_find(const unsigned char *question, int question_len){
+  for (int i = 0; i < RESOLV_CACHE_ENTRIES; i++){
+    if (cache[i].in_use && cache[i].question_len == question_len &&
+        question_equal(cache[i].question, question, question_len)){
+      return &cache[i];
+    }
+  }
+  return NULL;
+}
+
+int
+cache_lookup(const unsigned char *question, int question_len,
+             unsigned char *answer, int anslen, u8_t *flags){
+  CACHE_ENTRY *entry;
+  u32_t now = sti_now_ms();
+  u32_t age;
+  int len = 0;
+
+  *flags = 0;
+  if (cache_mutex == NULL){
+    return 0;
+  }
+  sti_mutex_lock(cache_mutex);
+  entry = cache_find(question, question_len);
+  if (entry != NULL){
+    age = (now - entry->stored_ms) / 1000;
+    if (age >= entry->ttl){
+      if (age - entry->ttl < RESOLV_STALE_MAX_S){
+        *flags = CACHE_STALE; // kept for cache_lookup_stale()
+      }
+      else{
+        entry->in_use = 0; // expired, free the entry
+      }
+    }
+    else{
+      len = (entry->resp_len < anslen) ? entry->resp_len : anslen;
+      memcpy(answer, entry->resp, len);
+      walk_ttls(answer, len, age, 0, NULL);
+      entry->last_used = ++use_clock;
+      entry->hits += (entry->hits < 0xFFFF);
+      cache_negative_hits += entry->negative;
+      // a popular entry is refreshed at 90% of its TTL, so its next reader does
+      // not wait for the network; a refresh that got lost is asked for again
+      if (RESOLV_PREFETCH_HITS > 0 && entry->hits >= RESOLV_PREFETCH_HITS &&
+          age >= entry->ttl - entry->ttl / 10 &&
+          (!entry->refreshing || now - entry->refresh_ms >= RESOLV_TIMEOUT_MS)){
+        entry->refreshing = 1;
+        entry->refresh_ms = now;
+        cache_prefetches++;
+        *flags = CACHE_REFRESH;
+      }
+    }
+  }
+  if (len > 0){
+    cache_hits++;
+  }
+  else{
+    cache_misses++;
+  }
+  sti_mutex_unlock(cache_mutex);
+  return len;
+}
+
+int
+cache_lookup_stale(const unsigned char *question, int question_len,
+                   unsigned char *answer, int anslen){
+  CACHE_ENTRY *entry;
+  u32_t age;
+  int len = 0;
+
+  if (cache_mutex == NULL){
+    return 0;
+  }
+  sti_mutex_lock(cache_mutex);
+  entry = cache_find(question, question_len);
+  if (entry != NULL){
+    age = (sti_now_ms() - entry->stored_ms) / 1000;
+    if (age < entry->ttl + RESOLV_STALE_MAX_S){
+      len = (entry->resp_len < anslen) ? entry->resp_len : anslen;
+      memcpy(answer, entry->resp, len);
+      walk_ttls(answer, len, age, RESOLV_STALE_TTL, NULL);
+      cache_stale_answers++;
+    }
+  }
+  sti_mutex_unlock(cache_mutex);
+  return len;
+}
+
+void
+cache_store(const unsigned char *question, int question_len, const struct pbuf *resp){
+  RFC1035_HDR hdr;
+  CACHE_ENTRY *entry = NULL;
+  CACHE_ENTRY *oldest = NULL;
+  int resp_len = resp->tot_len;
+  unsigned char *buf;
+  u8_t negative = 0;
+  u32_t ttl;
+
+  if (cache_mutex == NULL || resp_len > RESOLV_CACHE_ENTRY_SIZE ||
+      resp_len < (int) sizeof(RFC1035_HDR) || question_len > RESOLV_QUESTION_MAX){
+    return;
+  }
+  pbuf_copy_partial(resp, &hdr, sizeof(hdr), 0);
+  // NXDOMAIN is kept like a successful responce, other errors are not (rfc 2308 7)
+  if ((hdr.flags1 & DNS_FLAG1_TRUNC) || ((hdr.flags2 & DNS_FLAG2_RCODE_MASK) != 0 &&
+      (hdr.flags2 & DNS_FLAG2_RCODE_MASK) != DNS_RCODE_NXDOMAIN)){
+    return;
+  }
+
+  sti_mutex_lock(cache_mutex);
+  // the TTL decides whether the responce is kept at all, before any entry is touched
+  buf = pbuf_get_contiguous(resp, store_buf, sizeof(store_buf), resp_len, 0);
+  ttl = (buf != NULL) ? walk_ttls(buf, resp_len, 0, 0, &negative) : 0;
+
+  // reuse the entry for the same question, else a free one, else the least recently used
+  for (int i = 0; i < RESOLV_CACHE_ENTRIES; i++){
+    if (cache[i].in_use && cache[i].question_len == question_len &&
+        question_equal(cache[i].question, question, question_len)){
+      entry = &cache[i];
+      break;
+    }
+    if (cache[i].in_use == 0){
+      if (oldest == NULL || oldest->in_use){
+        oldest = &cache[i];
+      }
+    }
+    else if (oldest == NULL || (oldest->in_use && cache[i].last_used < oldest->last_used)){
+      oldest = &cache[i];
+    }
+  }
+  if (ttl == 0){
+    // not cacheable: only an older answer to the same question goes
+    if (entry != NULL){
+      entry->in_use = 0;
+      cache_dirty = 1;
+    }
+    sti_mutex_unlock(cache_mutex);
+    return;
+  }
+  if (entry == NULL){
+    entry = oldest;
+  }
+
+  memcpy(entry->resp, buf, resp_len);
+  entry->negative = negative;
+  entry->in_use = 1;
+  entry->question_len = question_len;
+  memcpy(entry->question, question, question_len);
+  entry->resp_len = resp_len;
+  entry->stored_ms = sti_now_ms();
+  entry->ttl = ttl;
+  entry->last_used = ++use_clock;
+  entry->hits = 0;
+  entry->refreshing = 0;
+  cache_dirty = 1;
+  sti_mutex_unlock(cache_mutex);
+}
+
+/** @brief put a big endian number of len bytes at buf */
+static void
+snap_put(unsigned char *buf, u32_t val, int len){
+  for (int i = len - 1; i >= 0; i--){
+    buf[i] = (unsigned char) val;
+    val >>= 8;
+  }
+}
+
+/** @brief get a big endian number of len bytes from buf */
+static u32_t
+snap_get(const unsigned char *buf, int len){
+  u32_t val = 0;
+
+  for (int i = 0; i < len; i++){
+    val = (val << 8) | buf[i];
+  }
+  return val;
+}
+
+err_t
+resolv_cache_save(void){
+  static const char *TAG = "cache save  ";
+  u32_t wall = sti_wall_time();
+  u32_t now = sti_now_ms();
+  struct pbuf *p;
+  unsigned char *buf;
+  CACHE_ENTRY *entry;
+  int len = SNAP_HDR_LEN;
+  int count = 0;
+  u32_t age;
+  err_t ret;
+
+  if (!RESOLV_CACHE_PERSIST || cache_mutex == NULL){
+    return ERR_IF;
+  }
+  if (wall == 0){
+    return ERR_VAL; // expiry times could not be made absolute
+  }
+  p = pbuf_alloc(PBUF_RAW, (SNAP_MAX_LEN < 0xFFFF) ? SNAP_MAX_LEN : 0xFFFF, PBUF_RAM);
+  if (p == NULL){
+    return ERR_MEM;
+  }
+  buf = (unsigned char *) p->payload;
+
+  sti_mutex_lock(cache_mutex);
+  for (int i = 0; i < RESOLV_CACHE_ENTRIES; i++){
+    entry = &cache[i];
+    age = (now - entry->stored_ms) / 1000;
+    if (!entry->in_use || age >= entry->ttl ||
+        len + SNAP_ENTRY_HDR_LEN + entry->question_len + entry->resp_len > p->len){
+      continue;
+    }
+    snap_put(&buf[len], wall + entry->ttl - age, 4);
+    snap_put(&buf[len + 4], entry->question_len, 2);
+    snap_put(&buf[len + 6], entry->resp_len, 2);
+    len += SNAP_ENTRY_HDR_LEN;
+    memcpy(&buf[len], entry->question, entry->question_len);
+    len += entry->question_len;
+    memcpy(&buf[len], entry->resp, entry->resp_len);
+    len += entry->resp_len;
+    count++;
+  }
+  cache_dirty = 0;
+  cache_saved_ms = now;
+  sti_mutex_unlock(cache_mutex);
+
+  memcpy(buf, SNAP_MAGIC, 4);
+  snap_put(&buf[4], wall, 4);
+  snap_put(&buf[8], count, 2);
+  // the store may be slow (a flash write), so the cache is not locked meanwhile
+  ret = sti_store_write(SNAP_KEY, buf, len);
+  pbuf_free(p);
+  if (ret != ERR_OK){
+    sti_mutex_lock(cache_mutex);
+    cache_dirty = 1;
+    sti_mutex_unlock(cache_mutex);
+    if (ret != ERR_IF){ // no storage at all is not worth a message on every close
+      STI_LOGI(TAG, "...could not save %d entries, error %d", count, ret);
+    }
+    return ret;
+  }
+  STI_LOGD(TAG, "...saved %d entries, %d bytes", count, len);
+  return ERR_OK;
+}
+
+err_t
+resolv_cache_save_due(void){
+  u8_t due;
+
+  if (!RESOLV_CACHE_PERSIST || cache_mutex == NULL){
+    return ERR_IF;
+  }
+  if (RESOLV_CACHE_SAVE_S == 0){
+    return ERR_OK;
+  }
+  sti_mutex_lock(cache_mutex);
+  due = cache_dirty && (sti_now_ms() - cache_saved_ms) / 1000 >= RESOLV_CACHE_SAVE_S;
+  sti_mutex_unlock(cache_mutex);
+  return due ? resolv_cache_save() : ERR_OK;
+}
+
+void
+cache_close(void){
+  u8_t dirty;
+
+  if (!RESOLV_CACHE_PERSIST || cache_mutex == NULL){
+    return;
+  }
+  sti_mutex_lock(cache_mutex);
+  dirty = cache_dirty;
+  sti_mutex_unlock(cache_mutex);
+  if (dirty){
+    resolv_cache_save();
+  }
+}
+
+void
+cache_load(void){
+  static const char *TAG = "cache load  ";
+  u32_t wall = sti_wall_time();
+  u32_t now = sti_now_ms();
+  struct pbuf *p;
+  unsigned char *buf;
+  CACHE_ENTRY *entry;
+  int len, off, count, loaded = 0;
+  u32_t expires, ttl;
+  u16_t question_len, resp_len;
+
+  if (!RESOLV_CACHE_PERSIST || cache_mutex == NULL || cache_loaded || wall == 0){
+    return; // without the time the age of the entries is unknown, try again later
+  }
+  cache_loaded = 1;
+  p = pbuf_alloc(PBUF_RAW, (SNAP_MAX_LEN < 0xFFFF) ? SNAP_MAX_LEN : 0xFFFF, PBUF_RAM);
+  if (p == NULL){
+    return;
+  }
+  buf = (unsigned char *) p->payload;
+  len = sti_store_read(SNAP_KEY, buf, p->len);
+  // a snapshot from the future means the clock was wrong when it was saved, or is now
+  if (len < SNAP_HDR_LEN || memcmp(buf, SNAP_MAGIC, 4) != 0 || snap_get(&buf[4], 4) > wall){
+    pbuf_free(p);
+    return;
+  }
+  count = snap_get(&buf[8], 2);
+  off = SNAP_HDR_LEN;
+
+  sti_mutex_lock(cache_mutex);
+  for (int i = 0; i < count && off + SNAP_ENTRY_HDR_LEN <= len; i++){
+    expires = snap_get(&buf[off], 4);
+    question_len = snap_get(&buf[off + 4], 2);
+    resp_len = snap_get(&buf[off + 6], 2);
+    off += SNAP_ENTRY_HDR_LEN;
+    if (off + question_len + resp_len > len){
+      break; // cut short
+    }
+    entry = NULL;
+    for (int j = 0; j < RESOLV_CACHE_ENTRIES && entry == NULL; j++){
+      entry = cache[j].in_use ? NULL : &cache[j];
+    }
+    if (entry == NULL || expires <= wall || question_len > RESOLV_QUESTION_MAX ||
+        resp_len > RESOLV_CACHE_ENTRY_SIZE || cache_find(&buf[off], question_len) != NULL){
+      off += question_len + resp_len;
+      continue; // expired, does not fit or already asked for again
+    }
+    memcpy(entry->question, &buf[off], question_len);
+    off += question_len;
+    memcpy(entry->resp, &buf[off], resp_len);
+    off += resp_len;
+    ttl = walk_ttls(entry->resp, resp_len, 0, 0, &entry->negative);
+    if (ttl == 0){
+      continue;
+    }
+    // the responce keeps its original TTLs, so it is backdated by the time it has used
+    if (expires - wall < ttl){
+      entry->stored_ms = now - (ttl - (expires - wall)) * 1000;
+    }
+    else{
+      entry->stored_ms = now;
+    }
+    entry->in_use = 1;
+    entry->question_len = question_len;
+    entry->resp_len = resp_len;
+    entry->ttl = ttl;
+    entry->last_used = ++use_clock;
+    entry->hits = 0;
+    entry->refreshing = 0;
+    loaded++;
+  }
+  sti_mutex_unlock(cache_mutex);
+  pbuf_free(p);
+  STI_LOGI(TAG, "...%d of %d entries restored", loaded, count);
+}
+
+void
+resolv_cache_get_stats(RESOLV_CACHE_STATS *stats){
+  if (cache_mutex == NULL){
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  sti_mutex_lock(cache_mutex);
+  stats->hits = cache_hits;
+  stats->misses = cache_misses;
+  stats->negative_hits = cache_negative_hits;
+  stats->prefetches = cache_prefetches;
+  stats->stale_answers = cache_stale_answers;
+  stats->entries = 0;
+  for (int i = 0; i < RESOLV_CACHE_ENTRIES; i++){
+    stats->entries += cache[i].in_use;
+  }
+  sti_mutex_unlock(cache_mutex);
+}
+
+void
+cache_reset_stats(void){
+  if (cache_mutex == NULL){
+    return;
+  }
+  sti_mutex_lock(cache_mutex);
+  cache_hits = 0;
+  cache_misses = 0;
+  cache_negative_hits = 0;
+  cache_prefetches = 0;
+  cache_stale_answers = 0;
+  sti_mutex_unlock(cache_mutex);
+}
+
+void
+resolv_cache_flush(void){
+  if (cache_mutex == NULL){
+    return;
+  }
+  sti_mutex_lock(cache_mutex);
+  for (int i = 0; i < RESOLV_CACHE_ENTRIES; i++){
+    cache[i].in_use = 0;
+  }
+  cache_dirty = 1; // so that the saved copy is emptied too
+  sti_mutex_unlock(cache_mutex);
+}
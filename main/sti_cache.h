@@ -0,0 +1,107 @@
+/** @file sti_cache.h
+ *  @brief Answer cache used by res_query()
+ *
+ *  A fixed size table of recent DNS responces keyed by the encoded question
+ *  (QNAME, QTYPE and QCLASS). Entries live for the smallest TTL found in the
+ *  answer section and the least recently used entry is replaced when the table
+ *  is full. The table can be kept in storage across restarts. This header is
+ *  internal to the resolver.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_CACHE_H
+#define STI_CACHE_H
+
+/* The largest responce that is cached, in bytes */
+#ifdef CONFIG_STI_RESOLV_CACHE_ENTRY_SIZE
+#define RESOLV_CACHE_ENTRY_SIZE CONFIG_STI_RESOLV_CACHE_ENTRY_SIZE
+#else
+#define RESOLV_CACHE_ENTRY_SIZE 512
+#endif
+
+#define CACHE_REFRESH 0x01 /**< cache_lookup(): refresh this popular entry before it expires */
+#define CACHE_STALE 0x02 /**< cache_lookup(): only an expired responce is cached, see cache_lookup_stale() */
+
+/** @brief create the lock that guards the cache table
+  * @returns ERR_OK or ERR_MEM */
+err_t
+cache_init(void);
+
+/** @brief look up a question in the cache
+  *
+  * On a hit the stored responce is copied into answer and the TTL of every
+  * resource record is reduced by the time the entry has been in the cache.
+  * A hit on an entry that has been asked for CONFIG_STI_RESOLV_PREFETCH_HITS
+  * times and has less than 10% of its TTL left sets CACHE_REFRESH, once; the
+  * caller should then ask the question again in the background. A miss on an
+  * entry that expired less than CONFIG_STI_RESOLV_STALE_MAX_S ago sets CACHE_STALE.
+  * @param question  the encoded question as it is sent to the server
+  * @param question_len  length of the encoded question
+  * @param answer  buffer the responce is copied into
+  * @param anslen  size of the answer buffer
+  * @param flags  set to CACHE_REFRESH, CACHE_STALE or 0
+  * @returns the number of bytes copied into answer, 0 on a miss */
+int
+cache_lookup(const unsigned char *question, int question_len,
+             unsigned char *answer, int anslen, u8_t *flags);
+
+/** @brief get an expired responce that is still within its grace period
+  *
+  * Used when the DNS servers do not answer in time (rfc 8767). The TTL of every
+  * expired record in the copy is set to 30 seconds.
+  * @returns the number of bytes copied into answer, 0 if there is no such responce */
+int
+cache_lookup_stale(const unsigned char *question, int question_len,
+                   unsigned char *answer, int anslen);
+
+/** @brief add a responce to the cache
+  *
+  * Complete responces with at least one answer record and a non zero TTL are kept.
+  * So are NXDOMAIN and empty answers (rfc 2308) that carry an SOA record, for at
+  * most CONFIG_STI_RESOLV_NEG_TTL_MAX seconds. Other errors and responces larger
+  * than an entry are not cached. A responce that is not cached leaves every entry
+  * as it was, except that an older answer to the same question is dropped.
+  * @param question  the encoded question the responce answers
+  * @param question_len  length of the encoded question
+  * @param resp  the responce as received from the server, may be a pbuf chain */
+void
+cache_store(const unsigned char *question, int question_len, const struct pbuf *resp);
+
+/** @brief restore the snapshot written by resolv_cache_save()
+  *
+  * Entries that expired in the meantime are dropped. Does nothing once a snapshot
+  * has been looked for, and nothing while sti_wall_time() is not set; it is then
+  * tried again on the next call. */
+void
+cache_load(void);
+
+/** @brief save the cache if it changed since the last save, on resolv_close() */
+void
+cache_close(void);
+
+/** @brief set the counters of resolv_cache_get_stats() to 0 */
+void
+cache_reset_stats(void);
+
+#endif /* STI_CACHE_H */
@@ -0,0 +1,90 @@
+/** @file sti_hosts.c
+ *  @brief Names pinned at build time, answered without the network
+ *
+ *  See sti_hosts.h. The build runs gen_hosts_table.py over
+ *  CONFIG_STI_RESOLV_STATIC_HOSTS_FILE and CONFIG_STI_RESOLV_STATIC_HOSTS_LIST
+ *  and passes STI_HOSTS_TABLE when it wrote sti_hosts_table.h. The table holds a
+ *  complete responce per question, in const data (flash on the ESP32), and a
+ *  minimal perfect hash over the questions: the case folded QNAME and QTYPE pick
+ *  a bucket, whose seed gives a second hash that picks the only slot the
+ *  question can be in. A lookup is two hashes and one compare, without locks.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_resolv_priv.h"
+#include "sti_hosts.h"
+
+/** @brief One slot of the table */
+typedef struct s_HOSTS_ENTRY {
+  u16_t offset; /**< where the responce starts in hosts_msgs */
+  u16_t len; /**< length of the responce, 0 for an empty slot */
+  u16_t question_len; /**< length of the question, which follows the header */
+} HOSTS_ENTRY;
+
+#if defined(CONFIG_STI_RESOLV_STATIC_HOSTS) && !defined(STI_HOSTS_TABLE)
+#error "CONFIG_STI_RESOLV_STATIC_HOSTS is set but the build did not generate sti_hosts_table.h"
+#endif
+
+#if defined(CONFIG_STI_RESOLV_STATIC_HOSTS)
+#include "sti_hosts_table.h"
+#else
+#define HOSTS_SLOTS 0
+#endif
+
+#if HOSTS_SLOTS > 0
+/** @brief FNV-1a of the QNAME and QTYPE of an encoded question, case folded,
+  * with the offset basis changed by seed as in gen_hosts_table.py */
+static u32_t
+hosts_hash(u32_t seed, const unsigned char *question, int question_len){
+  u32_t hash = 2166136261u ^ seed;
+
+  for (int i = 0; i < question_len - 2; i++){
+    hash = (hash ^ (u8_t) tolower(question[i])) * 16777619u;
+  }
+  return hash;
+}
+#endif
+
+int
+hosts_lookup(const unsigned char *question, int question_len, unsigned char *answer, int anslen){
+#if HOSTS_SLOTS > 0
+  const HOSTS_ENTRY *entry;
+  u16_t seed;
+
+  seed = hosts_seeds[hosts_hash(0, question, question_len) % HOSTS_BUCKETS];
+  entry = &hosts_slots[hosts_hash(seed, question, question_len) % HOSTS_SLOTS];
+  if (entry->len == 0 || entry->question_len != question_len || entry->len > anslen ||
+      !question_equal(&hosts_msgs[entry->offset + sizeof(RFC1035_HDR)], question, question_len)){
+    return 0;
+  }
+  memcpy(answer, &hosts_msgs[entry->offset], entry->len);
+  return entry->len;
+#else
+  return 0;
+#endif
+}
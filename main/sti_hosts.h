@@ -0,0 +1,46 @@
+/** @file sti_hosts.h
+ *  @brief Names pinned at build time, answered without the network
+ *
+ *  With CONFIG_STI_RESOLV_STATIC_HOSTS the A and AAAA questions for the names of
+ *  a hosts-style list are answered from a constant table generated at build time
+ *  by gen_hosts_table.py, before the cache and the DNS servers are tried. This
+ *  header is internal to the resolver.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_HOSTS_H
+#define STI_HOSTS_H
+
+/** @brief look up a question in the static hosts table
+  * The responce is copied into answer with an ID of 0.
+  * @param question  the encoded question as it is sent to the server
+  * @param question_len  length of the encoded question
+  * @param answer  buffer for the responce
+  * @param anslen  size of answer
+  * @returns the length of the responce, 0 if the name and type are not pinned
+  *   or the responce does not fit in answer */
+int
+hosts_lookup(const unsigned char *question, int question_len, unsigned char *answer, int anslen);
+
+#endif /* STI_HOSTS_H */
@@ -0,0 +1,172 @@
+/** @file sti_pool.c
+ *  @brief Fixed pool of responce buffers handed out as pbufs
+ *
+ *  See sti_pool.h. The pool is a table of CONFIG_STI_RESOLV_POOL_BUFFERS buffers
+ *  whose free ones are kept on a singly linked stack, so taking and giving back
+ *  a buffer is O(1) and never touches the heap. Buffers are given back by the
+ *  custom free function lwIP calls from pbuf_free(), in whatever task frees
+ *  the pbuf; pool_mutex is the innermost lock of the resolver.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_cache.h"
+#include "sti_pool.h"
+
+/* The number of responce buffers, as many as the lookups expected to hold an
+   answer at the same time; lwIP without custom pbufs uses the heap only */
+#if !LWIP_SUPPORT_CUSTOM_PBUF
+#define RESOLV_POOL_BUFFERS 0
+#elif defined(CONFIG_STI_RESOLV_POOL_BUFFERS)
+#define RESOLV_POOL_BUFFERS CONFIG_STI_RESOLV_POOL_BUFFERS
+#else
+#define RESOLV_POOL_BUFFERS 8
+#endif
+
+/* Bytes in each buffer, responces larger than that always come from the heap */
+#if RESOLV_POOL_BUFFERS > 0
+#define RESOLV_POOL_BUFFER_SIZE RESOLV_CACHE_ENTRY_SIZE
+#else
+#define RESOLV_POOL_BUFFER_SIZE 0
+#endif
+
+#if RESOLV_POOL_BUFFERS > 0
+/** @brief One buffer of the pool */
+typedef struct s_POOL_BUF {
+  struct pbuf_custom pc; /**< the pbuf handed out, must be first */
+  struct s_POOL_BUF *next; /**< next free buffer */
+  u8_t payload[RESOLV_CACHE_ENTRY_SIZE]; /**< the responce */
+} POOL_BUF;
+
+static POOL_BUF pool[RESOLV_POOL_BUFFERS]; /**< the buffer table */
+static POOL_BUF *pool_free_list; /**< top of the stack of free buffers */
+#endif
+static sti_mutex_t pool_mutex = NULL; /**< guards pool_free_list and the counters */
+static u16_t pool_in_use; /**< buffers handed out */
+static u16_t pool_high_water; /**< most buffers handed out at the same time */
+static u32_t pool_taken; /**< buffers taken from the pool */
+static u32_t pool_heap; /**< pbufs from the heap as every buffer was in use */
+static u32_t pool_oversize; /**< pbufs from the heap as they were larger than a buffer */
+
+err_t
+pool_init(void){
+  if (pool_mutex != NULL){
+    return ERR_OK;
+  }
+  pool_mutex = sti_mutex_create();
+  if (pool_mutex == NULL){
+    return ERR_MEM;
+  }
+#if RESOLV_POOL_BUFFERS > 0
+  pool_free_list = NULL;
+  for (int i = RESOLV_POOL_BUFFERS - 1; i >= 0; i--){
+    pool[i].next = pool_free_list;
+    pool_free_list = &pool[i];
+  }
+#endif
+  return ERR_OK;
+}
+
+#if RESOLV_POOL_BUFFERS > 0
+/** @brief custom free function of a pool pbuf, puts its buffer back on the free list */
+static void
+pool_pbuf_free(struct pbuf *p){
+  POOL_BUF *b = (POOL_BUF *) p;
+
+  sti_mutex_lock(pool_mutex);
+  b->next = pool_free_list;
+  pool_free_list = b;
+  pool_in_use--;
+  sti_mutex_unlock(pool_mutex);
+}
+#endif
+
+struct pbuf *
+pool_pbuf_alloc(u16_t len){
+  struct pbuf *p;
+#if RESOLV_POOL_BUFFERS > 0
+  POOL_BUF *b = NULL;
+
+  if (pool_mutex != NULL && len <= RESOLV_POOL_BUFFER_SIZE){
+    sti_mutex_lock(pool_mutex);
+    b = pool_free_list;
+    if (b != NULL){
+      pool_free_list = b->next;
+      pool_taken++;
+      if (++pool_in_use > pool_high_water){
+        pool_high_water = pool_in_use;
+      }
+    }
+    sti_mutex_unlock(pool_mutex);
+  }
+  if (b != NULL){
+    b->pc.custom_free_function = pool_pbuf_free;
+    return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &b->pc, b->payload, sizeof(b->payload));
+  }
+#endif
+  p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+  if (p != NULL && pool_mutex != NULL){
+    sti_mutex_lock(pool_mutex);
+    if (RESOLV_POOL_BUFFERS > 0 && len > RESOLV_POOL_BUFFER_SIZE){
+      pool_oversize++;
+    }
+    else{
+      pool_heap++;
+    }
+    sti_mutex_unlock(pool_mutex);
+  }
+  return p;
+}
+
+void
+pool_reset_stats(void){
+  if (pool_mutex == NULL){
+    return;
+  }
+  sti_mutex_lock(pool_mutex);
+  pool_taken = 0;
+  pool_heap = 0;
+  pool_oversize = 0;
+  pool_high_water = pool_in_use;
+  sti_mutex_unlock(pool_mutex);
+}
+
+void
+resolv_pool_get_stats(RESOLV_POOL_STATS *stats){
+  memset(stats, 0, sizeof(*stats));
+  stats->buffers = RESOLV_POOL_BUFFERS;
+  stats->buffer_size = RESOLV_POOL_BUFFER_SIZE;
+  if (pool_mutex == NULL){
+    return;
+  }
+  sti_mutex_lock(pool_mutex);
+  stats->in_use = pool_in_use;
+  stats->high_water = pool_high_water;
+  stats->taken = pool_taken;
+  stats->heap = pool_heap;
+  stats->oversize = pool_oversize;
+  sti_mutex_unlock(pool_mutex);
+}
@@ -0,0 +1,51 @@
+/** @file sti_pool.h
+ *  @brief Fixed pool of responce buffers handed out as pbufs
+ *
+ *  The answers the resolver makes itself, copies out of the cache and for
+ *  lookups that joined a query on the wire, are held in buffers of
+ *  RESOLV_CACHE_ENTRY_SIZE bytes taken from a table reserved at resolv_init().
+ *  Each is wrapped in an lwIP custom pbuf, so callers release it with
+ *  pbuf_free() as any other responce. This header is internal to the resolver.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_POOL_H
+#define STI_POOL_H
+
+/** @brief create the lock that guards the pool and put every buffer on the free list
+  * @returns ERR_OK or ERR_MEM */
+err_t
+pool_init(void);
+
+/** @brief get a pbuf of len bytes, from the pool when it fits in a free buffer
+  * Otherwise it is allocated from the heap and counted in RESOLV_POOL_STATS.
+  * @returns the pbuf, NULL if there is no memory */
+struct pbuf *
+pool_pbuf_alloc(u16_t len);
+
+/** @brief set the pool counters to 0, the high water mark to the buffers in use */
+void
+pool_reset_stats(void);
+
+#endif /* STI_POOL_H */
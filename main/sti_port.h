@@ -0,0 +1,185 @@
+/** @file sti_port.h
+ *  @brief Platform layer between the resolver and the IP stack and operating system
+ *
+ *  The resolver only uses what is declared here: a UDP endpoint, a single TCP
+ *  connection, locks, wakeup events, a millisecond clock, random numbers and
+ *  logging. Two backends implement it:
+ *  (1) sti_port_esp.c for ESP-IDF, on lwIP raw UDP/TCP and FreeRTOS
+ *  (2) host/sti_port_posix.c for Linux, on sockets, pthreads and clock_gettime
+ *
+ *  Messages are carried in lwIP pbufs on both. The host backend supplies the
+ *  small part of the lwIP types and pbuf API the resolver uses.
+ *
+ *  Timeouts run in the network context too, which is where the resolver
+ *  retransmits and completes queries.
+ *
+ *  Network callbacks (UDP receive and every TCP callback) run in one network
+ *  context, the lwIP thread on ESP-IDF and the port's network thread on Linux.
+ *  The sti_tcp_* calls must be made from that context; use sti_net_call() to get
+ *  there from an application task.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_PORT_H
+#define STI_PORT_H
+
+#ifdef ESP_PLATFORM
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+
+#define STI_LOGE(tag, fmt, ...) ESP_LOGE(tag, fmt, ##__VA_ARGS__)
+#define STI_LOGW(tag, fmt, ...) ESP_LOGW(tag, fmt, ##__VA_ARGS__)
+#define STI_LOGI(tag, fmt, ...) ESP_LOGI(tag, fmt, ##__VA_ARGS__)
+#define STI_LOGD(tag, fmt, ...) ESP_LOGD(tag, fmt, ##__VA_ARGS__)
+/* 16 bytes a line at debug level, compiled out when the maximum log verbosity
+   set in menuconfig (LOG_LOCAL_LEVEL) is below debug */
+#define STI_LOG_HEX(tag, buf, len) ESP_LOG_BUFFER_HEXDUMP(tag, buf, len, ESP_LOG_DEBUG)
+#else
+#include "sti_port_posix.h"
+#endif
+
+typedef void *sti_mutex_t; /**< a lock, not recursive */
+typedef void *sti_event_t; /**< a binary event one task can wait on */
+
+/** @brief create a lock
+  * @returns the lock, NULL if out of memory */
+sti_mutex_t
+sti_mutex_create(void);
+
+void
+sti_mutex_lock(sti_mutex_t mutex);
+
+void
+sti_mutex_unlock(sti_mutex_t mutex);
+
+/** @brief create an event, initially not signalled
+  * @returns the event, NULL if out of memory */
+sti_event_t
+sti_event_create(void);
+
+/** @brief wait until the event is signalled, then clear it
+  * @param timeout_ms  longest time to wait, 0 only polls
+  * @returns 1 if the event was signalled, 0 on timeout */
+int
+sti_event_wait(sti_event_t event, u32_t timeout_ms);
+
+/** @brief signal an event. Safe to call from the network context */
+void
+sti_event_signal(sti_event_t event);
+
+/** @brief milliseconds since an arbitrary start, wraps after 49 days */
+u32_t
+sti_now_ms(void);
+
+/** @brief a 32 bit random number, used for transaction IDs and jitter */
+u32_t
+sti_random(void);
+
+/** @brief seconds since 1970 from a clock that keeps running across restarts
+  * @returns the time, 0 if the clock has not been set (e.g. before SNTP ran) */
+u32_t
+sti_wall_time(void);
+
+/** @brief store a blob that survives a restart, replacing one with the same key
+  * Safe to call from any task except the network context, writes may be slow.
+  * @returns ERR_OK, ERR_IF if there is no storage, or ERR_MEM if it is full */
+err_t
+sti_store_write(const char *key, const void *buf, u32_t len);
+
+/** @brief read a blob written by sti_store_write()
+  * @returns the length of the blob, -1 if there is none or it is longer than len */
+int
+sti_store_read(const char *key, void *buf, u32_t len);
+
+/** @brief run fn(ctx) in the network context
+  * On ESP-IDF this is queued to the lwIP thread, on Linux it runs at once under
+  * the network lock. */
+void
+sti_net_call(void (*fn)(void *ctx), void *ctx);
+
+/** @brief run fn(ctx) once in the network context after ms milliseconds
+  * Must be called in the network context. Only a few timeouts may be pending at
+  * once, so users keep one and re-arm it. */
+void
+sti_net_timeout(u32_t ms, void (*fn)(void *ctx), void *ctx);
+
+/** @brief cancel a pending sti_net_timeout() with the same fn and ctx
+  * Must be called in the network context. */
+void
+sti_net_untimeout(void (*fn)(void *ctx), void *ctx);
+
+/** @brief called in the network context for every datagram received on the UDP
+  * endpoint. The callee owns p. */
+typedef void (*sti_udp_recv_fn)(struct pbuf *p, const ip_addr_t *addr, u16_t port);
+
+/** @brief open the UDP endpoint on an ephemeral port
+  * @returns ERR_OK, or an lwIP error code */
+err_t
+sti_udp_open(sti_udp_recv_fn recv);
+
+/** @brief send a datagram from the UDP endpoint. Safe to call from any task
+  * @returns ERR_OK, or an lwIP error code */
+err_t
+sti_udp_sendto(const void *buf, u16_t len, const ip_addr_t *addr, u16_t port);
+
+/** @brief close the UDP endpoint */
+void
+sti_udp_close(void);
+
+/** @brief callbacks of the TCP connection, all run in the network context */
+typedef struct s_STI_TCP_CALLBACKS {
+  void (*connected)(void); /**< the connection is up */
+  void (*recv)(struct pbuf *p); /**< data received, the callee owns p; NULL when the peer closed */
+  void (*sent)(void); /**< data was acknowledged, there is room to write again */
+  void (*err)(void); /**< the connection failed or was reset and is already gone */
+  void (*poll)(void); /**< called about every second while the connection exists */
+} STI_TCP_CALLBACKS;
+
+/** @brief start connecting the TCP connection. Only one connection exists at a time
+  * @returns ERR_OK if the connect was started, or an lwIP error code */
+err_t
+sti_tcp_connect(const ip_addr_t *addr, u16_t port, const STI_TCP_CALLBACKS *callbacks);
+
+/** @brief queue bytes on the connection, all or nothing
+  * @returns ERR_OK, or ERR_MEM if there is no room for len bytes now */
+err_t
+sti_tcp_write(const void *buf, u16_t len);
+
+/** @brief push queued bytes onto the network */
+void
+sti_tcp_output(void);
+
+/** @brief close the connection gracefully. No further callbacks are made */
+void
+sti_tcp_close(void);
+
+/** @brief reset the connection. No further callbacks are made */
+void
+sti_tcp_abort(void);
+
+#endif /* STI_PORT_H */
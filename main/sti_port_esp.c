@@ -0,0 +1,336 @@
+/** @file sti_port_esp.c
+ *  @brief ESP-IDF backend of the platform layer, on lwIP raw UDP/TCP and FreeRTOS
+ *
+ *  See sti_port.h. The UDP endpoint and the TCP connection are lwIP raw pcbs,
+ *  so their callbacks run in the lwIP thread. udp_sendto() is called from the
+ *  application task as the resolver always has.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+#include "lwip/udp.h"
+#include "lwip/tcp.h"
+#include "lwip/tcpip.h"
+#include "lwip/timeouts.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+
+#include "sti_port.h"
+
+#define TCP_POLL_INTERVAL 2 // tcp_poll() interval in coarse timer ticks (500 ms each)
+#define STORE_NAMESPACE "sti_resolv" // NVS namespace of sti_store_write()
+#define WALL_TIME_SET 1577836800 // 2020-01-01, the system time is earlier until it is set
+
+static struct udp_pcb *udp_conn = NULL; /**< the UDP endpoint */
+static sti_udp_recv_fn udp_recv_cb = NULL; /**< where received datagrams go */
+static struct tcp_pcb *tcp_conn = NULL; /**< the TCP connection, lwIP thread only */
+static const STI_TCP_CALLBACKS *tcp_cb = NULL; /**< callbacks of tcp_conn */
+static u8_t tcp_aborted; /**< set when a callback aborted tcp_conn */
+
+sti_mutex_t
+sti_mutex_create(void){
+  return (sti_mutex_t) xSemaphoreCreateMutex();
+}
+
+void
+sti_mutex_lock(sti_mutex_t mutex){
+  xSemaphoreTake((SemaphoreHandle_t) mutex, portMAX_DELAY);
+}
+
+void
+sti_mutex_unlock(sti_mutex_t mutex){
+  xSemaphoreGive((SemaphoreHandle_t) mutex);
+}
+
+sti_event_t
+sti_event_create(void){
+  return (sti_event_t) xSemaphoreCreateBinary();
+}
+
+int
+sti_event_wait(sti_event_t event, u32_t timeout_ms){
+  // one tick more so that a wait never ends before timeout_ms has passed
+  TickType_t ticks = timeout_ms ? pdMS_TO_TICKS(timeout_ms) + 1 : 0;
+
+  return xSemaphoreTake((SemaphoreHandle_t) event, ticks) == pdTRUE;
+}
+
+void
+sti_event_signal(sti_event_t event){
+  xSemaphoreGive((SemaphoreHandle_t) event);
+}
+
+u32_t
+sti_now_ms(void){
+  return sys_now();
+}
+
+u32_t
+sti_random(void){
+  return (u32_t) LWIP_RAND();
+}
+
+u32_t
+sti_wall_time(void){
+  time_t now = time(NULL);
+
+  // set by SNTP or settimeofday(), and kept by the RTC through deep sleep
+  return (now >= WALL_TIME_SET) ? (u32_t) now : 0;
+}
+
+err_t
+sti_store_write(const char *key, const void *buf, u32_t len){
+  nvs_handle_t nvs;
+  esp_err_t ret;
+
+  if (nvs_open(STORE_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK){
+    return ERR_IF; // nvs_flash_init() has not been called
+  }
+  ret = nvs_set_blob(nvs, key, buf, len);
+  if (ret == ESP_OK){
+    ret = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  return (ret == ESP_OK) ? ERR_OK : ERR_MEM;
+}
+
+int
+sti_store_read(const char *key, void *buf, u32_t len){
+  nvs_handle_t nvs;
+  size_t size = len;
+  esp_err_t ret;
+
+  if (nvs_open(STORE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK){
+    return -1;
+  }
+  ret = nvs_get_blob(nvs, key, buf, &size);
+  nvs_close(nvs);
+  return (ret == ESP_OK) ? (int) size : -1;
+}
+
+void
+sti_net_call(void (*fn)(void *ctx), void *ctx){
+  tcpip_callback(fn, ctx);
+}
+
+void
+sti_net_timeout(u32_t ms, void (*fn)(void *ctx), void *ctx){
+  sys_timeout(ms, fn, ctx);
+}
+
+void
+sti_net_untimeout(void (*fn)(void *ctx), void *ctx){
+  sys_untimeout(fn, ctx);
+}
+
+/** @brief udp_recv callback */
+static void
+udp_conn_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+              const ip_addr_t *addr, u16_t port){
+  if (udp_recv_cb == NULL){
+    pbuf_free(p);
+    return;
+  }
+  udp_recv_cb(p, addr, port);
+}
+
+err_t
+sti_udp_open(sti_udp_recv_fn recv){
+  err_t ret;
+
+  // one pcb for IPv4 and IPv6 servers
+  udp_conn = udp_new_ip_type(IPADDR_TYPE_ANY);
+  if (udp_conn == NULL){
+    return ERR_MEM;
+  }
+  ret = udp_bind(udp_conn, IP_ANY_TYPE, 0);
+  if (ret != ERR_OK){
+    udp_remove(udp_conn);
+    udp_conn = NULL;
+    return ret;
+  }
+  udp_recv_cb = recv;
+  udp_recv(udp_conn, udp_conn_recv, NULL);
+  return ERR_OK;
+}
+
+err_t
+sti_udp_sendto(const void *buf, u16_t len, const ip_addr_t *addr, u16_t port){
+  struct pbuf *p;
+  err_t ret;
+
+  if (udp_conn == NULL){
+    return ERR_CONN;
+  }
+  // a query fits one buffer of the fixed size pbuf pool, which is quicker to get
+  // than heap memory and does not fragment the heap; the heap is the fallback
+  p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_POOL);
+  if (p == NULL){
+    p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  }
+  if (p == NULL){
+    return ERR_MEM;
+  }
+  pbuf_take(p, buf, len);
+  ret = udp_sendto(udp_conn, p, addr, port);
+  pbuf_free(p);
+  return ret;
+}
+
+void
+sti_udp_close(void){
+  if (udp_conn != NULL){
+    udp_remove(udp_conn);
+    udp_conn = NULL;
+  }
+  udp_recv_cb = NULL;
+}
+
+/** @brief stop lwIP calling back for tcp_conn */
+static void
+tcp_conn_detach(void){
+  tcp_arg(tcp_conn, NULL);
+  tcp_recv(tcp_conn, NULL);
+  tcp_sent(tcp_conn, NULL);
+  tcp_err(tcp_conn, NULL);
+  tcp_poll(tcp_conn, NULL, 0);
+}
+
+/** @brief tcp_recv callback */
+static err_t
+tcp_conn_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err){
+  if (p != NULL && err != ERR_OK){
+    pbuf_free(p);
+    return ERR_OK;
+  }
+  if (p != NULL){
+    tcp_recved(pcb, p->tot_len);
+  }
+  tcp_aborted = 0;
+  tcp_cb->recv(p);
+  return tcp_aborted ? ERR_ABRT : ERR_OK;
+}
+
+/** @brief tcp_sent callback */
+static err_t
+tcp_conn_sent(void *arg, struct tcp_pcb *pcb, u16_t len){
+  tcp_aborted = 0;
+  tcp_cb->sent();
+  return tcp_aborted ? ERR_ABRT : ERR_OK;
+}
+
+/** @brief tcp_connected callback */
+static err_t
+tcp_conn_connected(void *arg, struct tcp_pcb *pcb, err_t err){
+  tcp_aborted = 0;
+  tcp_cb->connected();
+  return tcp_aborted ? ERR_ABRT : ERR_OK;
+}
+
+/** @brief tcp_poll callback */
+static err_t
+tcp_conn_poll(void *arg, struct tcp_pcb *pcb){
+  tcp_aborted = 0;
+  tcp_cb->poll();
+  return tcp_aborted ? ERR_ABRT : ERR_OK;
+}
+
+/** @brief tcp_err callback: lwIP has already freed the pcb */
+static void
+tcp_conn_err(void *arg, err_t err){
+  tcp_conn = NULL;
+  tcp_cb->err();
+}
+
+err_t
+sti_tcp_connect(const ip_addr_t *addr, u16_t port, const STI_TCP_CALLBACKS *callbacks){
+  err_t ret;
+
+  if (tcp_conn != NULL){
+    return ERR_ISCONN;
+  }
+  tcp_conn = tcp_new_ip_type(IP_IS_V6(addr) ? IPADDR_TYPE_V6 : IPADDR_TYPE_V4);
+  if (tcp_conn == NULL){
+    return ERR_MEM;
+  }
+  tcp_cb = callbacks;
+  tcp_arg(tcp_conn, NULL);
+  tcp_recv(tcp_conn, tcp_conn_recv);
+  tcp_sent(tcp_conn, tcp_conn_sent);
+  tcp_err(tcp_conn, tcp_conn_err);
+  tcp_poll(tcp_conn, tcp_conn_poll, TCP_POLL_INTERVAL);
+  ret = tcp_connect(tcp_conn, addr, port, tcp_conn_connected);
+  if (ret != ERR_OK){
+    tcp_conn_detach();
+    tcp_abort(tcp_conn);
+    tcp_conn = NULL;
+  }
+  return ret;
+}
+
+err_t
+sti_tcp_write(const void *buf, u16_t len){
+  if (tcp_conn == NULL){
+    return ERR_CONN;
+  }
+  if (tcp_sndbuf(tcp_conn) < len){
+    return ERR_MEM;
+  }
+  return tcp_write(tcp_conn, buf, len, TCP_WRITE_FLAG_COPY);
+}
+
+void
+sti_tcp_output(void){
+  if (tcp_conn != NULL){
+    tcp_output(tcp_conn);
+  }
+}
+
+void
+sti_tcp_close(void){
+  if (tcp_conn == NULL){
+    return;
+  }
+  tcp_conn_detach();
+  if (tcp_close(tcp_conn) != ERR_OK){
+    tcp_abort(tcp_conn); // lwIP could not queue the FIN
+    tcp_aborted = 1;
+  }
+  tcp_conn = NULL;
+}
+
+void
+sti_tcp_abort(void){
+  if (tcp_conn == NULL){
+    return;
+  }
+  tcp_conn_detach();
+  tcp_abort(tcp_conn);
+  tcp_conn = NULL;
+  tcp_aborted = 1;
+}
@@ -31,232 +31,1404 @@
  *  @bug No known bugs.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
-#include "lwip/stats.h"
-#include "lwip/mem.h"
-#include "lwip/udp.h"
-#include "lwip/ip_addr.h"
-#include "lwip/netif.h"
-#include "lwip/inet.h"
-#include "netif/etharp.h"
-#include "lwip/sys.h"
-#include "lwip/opt.h"
-
+#include "sti_port.h"
 #include "sti_resolv.h"
-//#include "esp_system.h"
-//#include "esp_event.h"
-#include "esp_log.h"
-//added to get error checks
-#include "esp_netif.h"
-//#include "esp_netif_ppp.h"
-
-/* The maximum length of a host name supported in the name table. */
-#define MAX_NAME_LENGTH 32
+#include "sti_resolv_priv.h"
+#include "sti_cache.h"
+#include "sti_rr.h"
+#include "sti_tcp.h"
+#include "sti_server.h"
+#include "sti_pool.h"
+#include "sti_hosts.h"
+
 /* The maximum number of retries when asking for a name. */
+#ifdef CONFIG_STI_RESOLV_MAX_RETRIES
+#define MAX_RETRIES CONFIG_STI_RESOLV_MAX_RETRIES
+#else
 #define MAX_RETRIES 8
+#endif
+
+#define RESOLV_RTO_MAX_MS 4000 // backoff stops growing here
+
+/* Send the first attempt of every query to the two best servers at once */
+#ifdef CONFIG_STI_RESOLV_RACE
+#define RESOLV_RACE 1
+#else
+#define RESOLV_RACE 0
+#endif
 
 #ifndef DNS_SERVER_PORT
 #define DNS_SERVER_PORT 53
 #endif
 
-#define DNS_FLAG1_RD 0x01 // DNS recursion requested
-
-/** @brief The DNS message header. \n
-  The DNS header is 12 x 8-bit bytes and is defined in RFC-1035\n
-  The header is used to send queries to DNS server. The header is also part of
-  the answer returned by the DNS server.
-  @note order of the fields in the struct must not be changed as the struct is used as
-  an overlay that allows information to be extracted from the returned answer buffer*/
-typedef struct s_RFC1035_HDR {
-  u16_t id; /**< ID Number of the request */
-  u8_t flags1; /**< Flags for QR| Opcode |AA|TC|RD */
-  u8_t flags2; /**< Flags for RA| Z | RCODE | */
-  u16_t qdcount; /**< number of entries in the question section */
-  u16_t ancount; /**< number of resource records in the answer section */
-  u16_t nscount; /**< no. of name server resource records in the authority records*/
-  u16_t arcount; /**< number of resource records in the additional records section */
-} RFC1035_HDR;
-
-static struct udp_pcb *resolv_pcb = NULL; /**< UDP connection to DNS server */
+/* UDP payload size advertised with an EDNS0 OPT record (rfc 6891), 0 sends plain queries */
+#ifdef CONFIG_STI_RESOLV_EDNS_UDP_SIZE
+#define RESOLV_EDNS_UDP_SIZE CONFIG_STI_RESOLV_EDNS_UDP_SIZE
+#else
+#define RESOLV_EDNS_UDP_SIZE 1232
+#endif
+
+/* The number of queries that may be waiting for an answer at the same time */
+#ifdef CONFIG_STI_RESOLV_MAX_PENDING
+#define RESOLV_MAX_PENDING CONFIG_STI_RESOLV_MAX_PENDING
+#else
+#define RESOLV_MAX_PENDING 16
+#endif
+
+/* How long a caller waits for the DNS servers before an expired cached answer is
+   served instead, the client response timer of rfc 8767 5 */
+#ifdef CONFIG_STI_RESOLV_STALE_ANSWER_MS
+#define RESOLV_STALE_ANSWER_MS CONFIG_STI_RESOLV_STALE_ANSWER_MS
+#else
+#define RESOLV_STALE_ANSWER_MS 1800
+#endif
+
+/* Records kept by the query trace, 0 leaves the trace out */
+#ifdef CONFIG_STI_RESOLV_TRACE_ENTRIES
+#define RESOLV_TRACE_ENTRIES CONFIG_STI_RESOLV_TRACE_ENTRIES
+#else
+#define RESOLV_TRACE_ENTRIES 0
+#endif
+
+#define DNS_RCODE_SERVFAIL 2 // the server could not get an answer
+#define DNS_RCODE_REFUSED 5 // the server will not answer us
+
+/* Longest UDP query: header, question and OPT record */
+#define RESOLV_QUERY_MAX (sizeof(RFC1035_HDR) + RESOLV_QUESTION_MAX + DNS_OPT_RR_LEN)
+
+/* The encoded question of a request, inside its query */
+#define REQ_QUESTION(req) ((req)->query + sizeof(RFC1035_HDR))
+
+/** @brief State of an entry in the pending request table */
+typedef enum e_RESOLV_REQ_STATE {
+  REQ_FREE = 0, /**< slot is available */
+  REQ_WAITING,  /**< waiting for the answer, retransmitted by resolv_service() */
+  REQ_JOINED,   /**< same question as a waiting request, shares its answer */
+  REQ_DONE      /**< result known, callback not yet made */
+} RESOLV_REQ_STATE;
+
+/** @brief One outstanding query.
+  The answer is routed to the request whose ID and question match the responce */
+typedef struct s_RESOLV_REQ {
+  RESOLV_REQ_STATE state; /**< where the request is in its life cycle */
+  u16_t gen; /**< bumped each time the slot is claimed, part of the handle */
+  s8_t leader; /**< REQ_JOINED: index of the request asking on the wire */
+  u16_t id; /**< transaction ID in host byte order */
+  u16_t question_len; /**< length of the encoded question, see REQ_QUESTION() */
+  u16_t query_len; /**< length of query */
+  unsigned char query[RESOLV_QUERY_MAX]; /**< the UDP query as sent: header, question
+                                              (QNAME, QTYPE and QCLASS) and OPT record */
+  struct pbuf *resp; /**< the responce, owned by the request once it is received */
+  err_t err; /**< result passed to the callback */
+  u8_t via_tcp; /**< set to 1 once the question was passed to the TCP transport */
+  u8_t edns; /**< set to 1 if the query carries an OPT record */
+  u8_t stale; /**< set to 1 if an expired answer is cached that may be served */
+  u8_t cached; /**< set to 1 if answered from the cache when started, not timed */
+  u8_t attempts; /**< number of times the query was sent over UDP */
+  u8_t sent_mask; /**< bit n set if server n was sent the query */
+  u8_t attempt_mask; /**< servers sent the latest attempt */
+  u32_t sent_ms; /**< sti_now_ms() when the query was last sent */
+  u32_t start_ms; /**< sti_now_ms() when the query was started */
+  u32_t next_ms; /**< sti_now_ms() when the query is sent again or times out */
+  u32_t rto; /**< retransmission timeout of the next attempt */
+  res_query_cb cb; /**< called once with the result */
+  void *arg; /**< argument of cb */
+} RESOLV_REQ;
+
+/** @brief A completion collected under the lock and reported after it is released */
+typedef struct s_RESOLV_DONE {
+  res_query_cb cb; /**< the request's callback */
+  void *arg; /**< argument of cb */
+  err_t err; /**< the result */
+  struct pbuf *resp; /**< the responce, passed to cb */
+} RESOLV_DONE;
+
+/** @brief What a blocking caller waits on */
+typedef struct s_RESOLV_WAIT {
+  sti_event_t event; /**< signalled by query_wait_cb() */
+  err_t err; /**< the result */
+  struct pbuf *resp; /**< the responce, NULL if none */
+} RESOLV_WAIT;
+
 static u8_t initFlag; /**< set to 1 if UDP initialized*/
-static u8_t respFlag = 0; /**< set to 1 if responce received*/
-static u8_t payload_len = 0; /**< length of the received payload buffer*/
-static unsigned char * user_buffer_ptr;
+static RESOLV_REQ resolv_reqs[RESOLV_MAX_PENDING]; /**< pending request table */
+static sti_mutex_t resolv_reqs_mutex = NULL; /**< guards resolv_reqs and wait_events */
+static sti_event_t wait_events[RESOLV_MAX_PENDING]; /**< events for blocking callers */
+static u8_t wait_events_used[RESOLV_MAX_PENDING]; /**< set to 1 while an event is lent out */
+static RESOLV_STATS resolv_stats; /**< counters of the wire queries, guarded by resolv_reqs_mutex */
+#if RESOLV_TRACE_ENTRIES > 0
+static RESOLV_TRACE trace_ring[RESOLV_TRACE_ENTRIES]; /**< the query trace, written without a lock */
+static u32_t trace_seq; /**< seq of the newest record in trace_ring */
+#endif
 
-/** print_buf function prints out a buffer to terminal. This makes it easier to troubleshoot
+/** print_buf function hex dumps a buffer to the log. This makes it easier to troubleshoot
   * buffers sent to or received from the DNS server */
 void
 print_buf(unsigned char *buf, int length){
-  unsigned char * buf_char_ptr;
   static const char *TAG = "print_buf   ";
-  buf_char_ptr = buf;
-  for (int i=0; i < length; i++){
-    if ((*buf_char_ptr > 64 && *buf_char_ptr <91) ||
-      (*buf_char_ptr > 96 && *buf_char_ptr <123)){
-      ESP_LOGI(TAG, "....%d Letter in received buffer: %c", i+1, *buf_char_ptr);
+
+  STI_LOG_HEX(TAG, buf, length);
+}
+
+int
+format_hostname(unsigned char * dname, unsigned char * qname){
+  int name_len = strlen((char *) dname);
+  unsigned char *len_ptr = qname; // where the length of the current subname goes
+  int subname_len = 0;
+
+  if (name_len > 0 && dname[name_len - 1] == '.'){
+    name_len--; // an absolute name, the root label is added below anyway
+  }
+  if (name_len == 0){
+    if (dname[0] == '.'){
+      *qname = 0; // the root
+      return 1;
+    }
+    return 0;
+  }
+  if (name_len > MAX_NAME_LENGTH){
+    return 0;
+  }
+  // each subname is copied one byte to the right, leaving room for its length
+  for (int n = 0; n <= name_len; n++){
+    if (n == name_len || dname[n] == '.'){
+      if (subname_len == 0 || subname_len > RESOLV_LABEL_MAX){
+        return 0;
+      }
+      *len_ptr = subname_len;
+      len_ptr = &qname[n + 1];
+      subname_len = 0;
     }
     else{
-      ESP_LOGI(TAG, "....%d Hex in received buffer   : %X", i+1, *buf_char_ptr);
+      qname[n + 1] = dname[n];
+      subname_len++;
     }
-    buf_char_ptr++;
   }
+  qname[name_len + 1] = 0;
+  return name_len + 2;
 }
 
-int
-format_hostname(unsigned char * dname, unsigned char * qname){
-  int encoded_len;
-  int subname_len = 0;
-  unsigned char * num_ptr;
-
-  num_ptr = qname;
-  qname ++;
-  for (int n = 1; n < (MAX_NAME_LENGTH + 1); n++){
-    encoded_len = n; //number of char in buffer
-    if( *dname == 0 ){
-      *num_ptr = subname_len;
-      *qname = 0;
-      encoded_len ++;
+/** @brief claim a free slot in the pending request table
+  * A random transaction ID that no other pending request is using is assigned.
+  * Must be called with resolv_reqs_mutex held.
+  * @returns the claimed request, NULL if the table is full */
+static RESOLV_REQ *
+req_alloc(void){
+  RESOLV_REQ *req = NULL;
+  u16_t id;
+  int in_use;
+
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    if (resolv_reqs[i].state == REQ_FREE){
+      req = &resolv_reqs[i];
       break;
     }
-    else if(*dname == '.'){
-      *num_ptr = subname_len;
-      num_ptr = qname;
-      dname++;
-      qname++;
-      subname_len = 0;
+  }
+  if (req == NULL){
+    return NULL;
+  }
+  do {
+    id = (u16_t) sti_random();
+    in_use = 0;
+    for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+      if (resolv_reqs[i].state != REQ_FREE && resolv_reqs[i].id == id){
+        in_use = 1;
+      }
+    }
+  } while (in_use);
+
+  req->id = id;
+  req->gen++;
+  req->state = REQ_WAITING;
+  return req;
+}
+
+/** @brief encode a question (QNAME, QTYPE and QCLASS) in wire format
+  * @returns length of the encoded question, 0 if the name cannot be encoded */
+static int
+question_encode(const char *dname, int class, int type, unsigned char *question){
+  int qname_len;
+
+  qname_len = format_hostname((unsigned char *) dname, question);
+  if (qname_len == 0){
+    return 0;
+  }
+
+  // complete the question with QTYPE and QCLASS, 16 bits each in network byte
+  // order, so that types above 255 (e.g. CAA, 257) are asked for as given
+  question[qname_len] = (unsigned char)(type >> 8);      // MSB request type
+  question[qname_len + 1] = (unsigned char) type;        // LSB request type
+  question[qname_len + 2] = (unsigned char)(class >> 8); // MSB request class
+  question[qname_len + 3] = (unsigned char) class;       // LSB request class
+  return qname_len + 4;
+}
+
+/** @brief double a retransmission timeout and add up to 1/4 of random jitter
+  * so that queries lost together are not retransmitted together */
+static u32_t
+rto_backoff(u32_t rto){
+  rto *= 2;
+  if (rto > RESOLV_RTO_MAX_MS){
+    rto = RESOLV_RTO_MAX_MS;
+  }
+  return rto + sti_random() % (rto / 4 + 1);
+}
+
+/** @brief FNV-1a hash of the QNAME of an encoded question, case folded */
+static u32_t
+question_hash(const unsigned char *question, int question_len){
+  u32_t hash = 2166136261u;
+
+  for (int i = 0; i < question_len - 4; i++){
+    hash = (hash ^ (u8_t) tolower(question[i])) * 16777619u;
+  }
+  return hash;
+}
+
+/** @brief add a record to the query trace
+  *
+  * Called from any task and from the network context without a lock: the writer
+  * claims a record with an atomic increment of trace_seq, clears its seq while it
+  * fills it in and stores the seq last, so a reader can tell a record that was
+  * overwritten under it. Compiled out when RESOLV_TRACE_ENTRIES is 0.
+  * @param question  the encoded question, NULL if not known */
+static void
+trace_add(u8_t event, u16_t id, const unsigned char *question, int question_len,
+          s8_t server, u16_t size, u8_t rcode, s8_t outcome){
+#if RESOLV_TRACE_ENTRIES > 0
+  u32_t seq = __atomic_add_fetch(&trace_seq, 1, __ATOMIC_RELAXED);
+  RESOLV_TRACE *rec = &trace_ring[(seq - 1) % RESOLV_TRACE_ENTRIES];
+
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->ms = sti_now_ms();
+  rec->qhash = (question != NULL) ? question_hash(question, question_len) : 0;
+  rec->id = id;
+  rec->type = (question != NULL) ? (question[question_len - 4] << 8) | question[question_len - 3] : 0;
+  rec->size = size;
+  rec->event = event;
+  rec->server = server;
+  rec->rcode = rcode;
+  rec->outcome = outcome;
+  __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+#endif
+}
+
+#if RESOLV_TRACE_ENTRIES > 0
+/** @brief copy one record of the query trace
+  * @returns 1 if rec holds record seq, 0 if it has been overwritten */
+static int
+trace_copy(u32_t seq, RESOLV_TRACE *rec){
+  const RESOLV_TRACE *src = &trace_ring[(seq - 1) % RESOLV_TRACE_ENTRIES];
+
+  if (__atomic_load_n(&src->seq, __ATOMIC_ACQUIRE) != seq){
+    return 0;
+  }
+  *rec = *src;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/** @brief seq of the oldest of the newest max records in the trace, or of the
+  * oldest record kept if there are fewer */
+static u32_t
+trace_first(u32_t last, int max){
+  u32_t kept = (last < RESOLV_TRACE_ENTRIES) ? last : RESOLV_TRACE_ENTRIES;
+
+  if ((u32_t) max < kept){
+    kept = max;
+  }
+  return last - kept + 1;
+}
+#endif
+
+int
+resolv_trace_read(RESOLV_TRACE *records, int max){
+  int n = 0;
+#if RESOLV_TRACE_ENTRIES > 0
+  u32_t last = __atomic_load_n(&trace_seq, __ATOMIC_ACQUIRE);
+
+  for (u32_t seq = trace_first(last, max); seq <= last && last != 0; seq++){
+    n += trace_copy(seq, &records[n]);
+  }
+#endif
+  return n;
+}
+
+int
+resolv_trace_dump(void){
+  int n = 0;
+#if RESOLV_TRACE_ENTRIES > 0
+  static const char *events[] = {"?", "hit", "start", "send", "recv", "tcp", "done"};
+  u32_t last = __atomic_load_n(&trace_seq, __ATOMIC_ACQUIRE);
+  RESOLV_TRACE rec;
+
+  printf("# seq ms event id qhash type server size rcode outcome\n");
+  for (u32_t seq = trace_first(last, RESOLV_TRACE_ENTRIES); seq <= last && last != 0; seq++){
+    if (!trace_copy(seq, &rec)){
+      continue;
+    }
+    printf("TRACE %u %u %s %04x %08x %u %d %u %u %d\n", (unsigned) rec.seq, (unsigned) rec.ms,
+           events[(rec.event <= RESOLV_TRACE_DONE) ? rec.event : 0], rec.id, (unsigned) rec.qhash,
+           rec.type, rec.server, rec.size, rec.rcode, rec.outcome);
+    n++;
+  }
+#endif
+  return n;
+}
+
+u32_t
+resolv_trace_qhash(const char *dname){
+  unsigned char question[RESOLV_QUESTION_MAX];
+  int question_len = question_encode(dname, RESOLV_CLASS_IN, 0, question);
+
+  return (question_len > 0) ? question_hash(question, question_len) : 0;
+}
+
+/** @brief build the query of a request around its question
+  * Done once when the request starts, and again if the OPT record is dropped.
+  * Every attempt then sends the query as it is, with the same transaction ID.
+  * Called with resolv_reqs_mutex held. */
+static void
+query_build(RESOLV_REQ *req){
+  static const char *TAG = "res_query   ";
+  RFC1035_HDR *hdr = (RFC1035_HDR *) req->query;
+  unsigned char *opt;
+  u16_t edns_size = req->edns ? RESOLV_EDNS_UDP_SIZE : 0;
+
+  memset(hdr, 0, sizeof(RFC1035_HDR));
+  if (edns_size){
+    // OPT pseudo RR: root owner name, TYPE 41, CLASS carries our UDP payload size,
+    // TTL carries extended RCODE, version and flags (all 0), no RDATA
+    opt = REQ_QUESTION(req) + req->question_len;
+    memset(opt, 0, DNS_OPT_RR_LEN);
+    opt[2] = RESOLV_TYPE_OPT;
+    opt[3] = (unsigned char)(edns_size >> 8);
+    opt[4] = (unsigned char) edns_size;
+    hdr->arcount = htons(1);
+  }
+
+  /* Fill in header information observing Big Endian / Little Endian considerations*/
+  hdr->id = htons(req->id);
+  hdr->flags1 = DNS_FLAG1_RD; //This is 8bits so no need to worry about htons
+  hdr->qdcount = htons(1); // number of questions
+  req->query_len = sizeof(RFC1035_HDR) + req->question_len + (edns_size ? DNS_OPT_RR_LEN : 0);
+  STI_LOG_HEX(TAG, req->query, req->query_len);
+}
+
+/** @brief send the query of a request over UDP to one server
+  * Called in the network context with resolv_reqs_mutex held.
+  * @param req  the request
+  * @param server  index of the server to send to
+  * @returns ERR_OK, or the error from the port layer */
+static err_t
+query_send(RESOLV_REQ *req, int server){
+  err_t ret;
+
+  ret = sti_udp_sendto(req->query, req->query_len, server_addr(server), DNS_SERVER_PORT);
+  if (ret != ERR_OK){
+    return ret;
+  }
+  resolv_stats.sent++;
+  server_sent(server);
+  trace_add(RESOLV_TRACE_SEND, req->id, REQ_QUESTION(req), req->question_len, server,
+            req->query_len, 0, req->attempts);
+  req->sent_mask |= 1 << server;
+  req->attempt_mask |= 1 << server;
+  return ERR_OK;
+}
+
+/** @brief the handle of a claimed request */
+static RESOLV_HANDLE
+req_handle(const RESOLV_REQ *req){
+  return ((RESOLV_HANDLE) req->gen << 8) | (RESOLV_HANDLE)(req - resolv_reqs + 1);
+}
+
+/** @brief record the result of a request; resolv_service() makes the callback
+  * Requests that joined it get the same result, each with its own copy of the
+  * responce. Called with resolv_reqs_mutex held. */
+static void
+req_finish(RESOLV_REQ *req, err_t err, struct pbuf *resp){
+  int leader = req - resolv_reqs;
+  RESOLV_REQ *follower;
+  struct pbuf *copy;
+
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    follower = &resolv_reqs[i];
+    if (follower->state != REQ_JOINED || follower->leader != leader){
+      continue;
+    }
+    copy = NULL;
+    if (resp != NULL){
+      copy = pool_pbuf_alloc(resp->tot_len);
+      if (copy != NULL){
+        pbuf_copy_partial(resp, copy->payload, resp->tot_len, 0);
+      }
+    }
+    follower->err = (resp != NULL && copy == NULL) ? ERR_MEM : err;
+    follower->resp = copy;
+    follower->state = REQ_DONE;
+  }
+  req->err = err;
+  req->resp = resp;
+  req->state = REQ_DONE;
+}
+
+/** @brief find a waiting request for the same question
+  * Called with resolv_reqs_mutex held.
+  * @returns its index, -1 if there is none */
+static int
+req_find_leader(const unsigned char *question, int question_len){
+  RESOLV_REQ *req;
+
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    req = &resolv_reqs[i];
+    if (req->state == REQ_WAITING && req->question_len == question_len &&
+        question_equal(REQ_QUESTION(req), question, question_len)){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** @brief hand the wire query of a cancelled request to one that joined it
+  * Called with resolv_reqs_mutex held.
+  * @returns 1 if a joined request took over, 0 if none had joined */
+static int
+req_promote(RESOLV_REQ *req){
+  int leader = req - resolv_reqs;
+  RESOLV_REQ *heir = NULL;
+  RESOLV_REQ keep;
+
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    if (resolv_reqs[i].state != REQ_JOINED || resolv_reqs[i].leader != leader){
+      continue;
+    }
+    if (heir == NULL){
+      heir = &resolv_reqs[i];
     }
     else{
-        *qname = *dname;
-        subname_len ++;
-        dname++;
-        qname++;
+      resolv_reqs[i].leader = heir - resolv_reqs;
     }
   }
-  if(encoded_len >= MAX_NAME_LENGTH) encoded_len = 0;
+  if (heir == NULL){
+    return 0;
+  }
+  // the heir keeps its own handle and callback, and takes over ID, timers and state
+  keep = *heir;
+  *heir = *req;
+  heir->gen = keep.gen;
+  heir->cb = keep.cb;
+  heir->arg = keep.arg;
+  heir->leader = -1;
+  return 1;
+}
 
-  return encoded_len;
+/** @brief res_query_cb of a background refresh; resolv_deliver() has already
+  * cached the answer */
+static void
+query_refresh_cb(void *arg, err_t err, struct pbuf *resp){
+  if (resp != NULL){
+    pbuf_free(resp);
+  }
+}
+
+/** @brief get the expired cached answer of a request, see cache_lookup_stale()
+  * @returns a pbuf holding it, NULL if there is none */
+static struct pbuf *
+req_stale_answer(RESOLV_REQ *req){
+  struct pbuf *p;
+  int len;
+
+  req->stale = 0;
+  p = pool_pbuf_alloc(RESOLV_CACHE_ENTRY_SIZE);
+  if (p == NULL){
+    return NULL;
+  }
+  len = cache_lookup_stale(REQ_QUESTION(req), req->question_len, p->payload, p->len);
+  if (len <= 0){
+    pbuf_free(p);
+    return NULL;
+  }
+  pbuf_realloc(p, len);
+  return p;
+}
+
+/** @brief answer a request whose servers are slow with its expired cached answer
+  *
+  * The callers get the stale answer now (rfc 8767 5). The wire query moves to a
+  * free slot, keeping its ID and timers, and goes on in the background so that
+  * its answer refreshes the cache. Without a free slot it is given up.
+  * Called with resolv_reqs_mutex held. */
+static void
+req_serve_stale(RESOLV_REQ *req){
+  static const char *TAG = "res_query   ";
+  struct pbuf *p = req_stale_answer(req);
+  RESOLV_REQ *bg = NULL;
+  u16_t gen;
+
+  if (p == NULL){
+    return;
+  }
+  STI_LOGD(TAG, "...servers slow, serving an expired answer");
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    if (resolv_reqs[i].state == REQ_FREE){
+      bg = &resolv_reqs[i];
+      break;
+    }
+  }
+  if (bg != NULL){
+    gen = bg->gen + 1;
+    *bg = *req;
+    bg->gen = gen;
+    bg->cb = query_refresh_cb;
+    bg->arg = NULL;
+  }
+  else if (req->via_tcp){
+    tcp_query_cancel(req->id);
+  }
+  req_finish(req, ERR_OK, p);
+}
+
+/** @brief complete a request that got no usable answer
+  * The expired cached answer is used if there is one (rfc 8767 4).
+  * Called with resolv_reqs_mutex held. */
+static void
+req_fail(RESOLV_REQ *req, err_t err){
+  struct pbuf *p = req->stale ? req_stale_answer(req) : NULL;
+
+  req_finish(req, (p != NULL) ? ERR_OK : err, p);
+}
+
+/** @brief the bucket of the latency histogram a lookup falls into */
+static int
+latency_bucket(u32_t ms){
+  int bucket = 0;
+
+  while (bucket < RESOLV_LATENCY_BUCKETS - 1 && ms >= (2u << bucket)){
+    bucket++;
+  }
+  return bucket;
+}
+
+/** @brief send, retransmit and time out queries, and make completion callbacks
+  *
+  * Runs in the network context: from the timeout it keeps armed, after a query is
+  * started and after a responce is delivered. A query is sent again with the same
+  * ID each time its retransmission timeout expires without an answer, up to
+  * MAX_RETRIES more times. The first attempt goes to the server with the lowest RTO
+  * (and, with CONFIG_STI_RESOLV_RACE, also to the second best), each retransmission
+  * to the next server in rank. The timeout starts at the best server's RTO and
+  * doubles, with jitter, after every attempt. A server that let an attempt time out
+  * is charged with a failure. Every query completes within RESOLV_TIMEOUT_MS.
+  * Requests that joined a waiting request are completed with it. A request with
+  * an expired answer in the cache is answered from it after RESOLV_STALE_ANSWER_MS,
+  * or when it times out. */
+static void
+resolv_service(void *ctx){
+  RESOLV_DONE done[RESOLV_MAX_PENDING];
+  RESOLV_REQ *req;
+  u32_t now = sti_now_ms();
+  u32_t elapsed, wait, due;
+  s32_t next = -1;
+  int ndone = 0;
+  int server;
+
+  sti_mutex_lock(resolv_reqs_mutex);
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    req = &resolv_reqs[i];
+    elapsed = now - req->start_ms;
+    if (req->state == REQ_WAITING && req->stale && elapsed >= RESOLV_STALE_ANSWER_MS){
+      req_serve_stale(req);
+    }
+    if (req->state == REQ_WAITING && (s32_t)(now - req->next_ms) >= 0){
+      if (req->via_tcp){
+        tcp_query_cancel(req->id); // only the overall timeout applies over TCP
+        req_fail(req, ERR_TIMEOUT);
+      }
+      else{
+        if (req->attempts > 0){
+          for (int j = 0; j < server_count(); j++){
+            if (req->attempt_mask & (1 << j)){
+              server_failed(j);
+            }
+          }
+          req->rto = rto_backoff(req->rto);
+        }
+        if (req->attempts > MAX_RETRIES || elapsed >= RESOLV_TIMEOUT_MS){
+          req_fail(req, ERR_TIMEOUT);
+        }
+        else{
+          req->attempt_mask = 0;
+          resolv_stats.retries += (req->attempts > 0);
+          server = server_pick(req->attempts);
+          query_send(req, server);
+          if (RESOLV_RACE && req->attempts == 0 && server_count() > 1){
+            query_send(req, server_pick(1));
+          }
+          req->attempts++;
+          req->sent_ms = now;
+          wait = (req->rto < RESOLV_TIMEOUT_MS - elapsed) ? req->rto : RESOLV_TIMEOUT_MS - elapsed;
+          req->next_ms = now + wait;
+        }
+      }
+    }
+  }
+  // a finished request may have completed others earlier in the table
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    req = &resolv_reqs[i];
+    if (req->state == REQ_DONE){
+      if (!req->cached){
+        resolv_stats.latency[latency_bucket(now - req->start_ms)]++;
+      }
+      resolv_stats.timeouts += (req->err == ERR_TIMEOUT);
+      if (!req->cached){
+        trace_add(RESOLV_TRACE_DONE, req->id, REQ_QUESTION(req), req->question_len, -1,
+                  (req->resp != NULL) ? req->resp->tot_len : 0, 0, req->err);
+      }
+      done[ndone].cb = req->cb;
+      done[ndone].arg = req->arg;
+      done[ndone].err = req->err;
+      done[ndone].resp = req->resp;
+      ndone++;
+      req->resp = NULL;
+      req->state = REQ_FREE;
+    }
+    if (req->state != REQ_WAITING){
+      continue;
+    }
+    due = req->next_ms;
+    if (req->stale && (s32_t)(req->start_ms + RESOLV_STALE_ANSWER_MS - due) < 0){
+      due = req->start_ms + RESOLV_STALE_ANSWER_MS;
+    }
+    if (next < 0 || (s32_t)(due - now) < next){
+      next = (s32_t)(due - now);
+      next = (next > 0) ? next : 0;
+    }
+  }
+  sti_mutex_unlock(resolv_reqs_mutex);
+
+  // one timeout serves the whole table, armed for the earliest request
+  sti_net_untimeout(resolv_service, NULL);
+  if (next >= 0){
+    sti_net_timeout(next, resolv_service, NULL);
+  }
+
+  for (int i = 0; i < ndone; i++){
+    done[i].cb(done[i].arg, done[i].err, done[i].resp);
+  }
+}
+
+/** @brief claim a request for a question and pass it to the network context
+  *
+  * A question that is already being asked is not sent again: the new request
+  * joins the waiting one and gets a copy of its answer, so a burst of identical
+  * lookups costs one query on the wire.
+  * @param cached  an answer from the cache, or NULL to ask the DNS servers
+  * @param stale  1 if the cache holds an expired answer that may be served
+  * @returns the handle, 0 if the request table is full */
+static RESOLV_HANDLE
+query_start(const unsigned char *question, int question_len, struct pbuf *cached,
+            u8_t stale, res_query_cb cb, void *arg){
+  static const char *TAG = "res_query   ";
+  RESOLV_HANDLE handle;
+  RESOLV_REQ *req;
+  int leader;
+
+  sti_mutex_lock(resolv_reqs_mutex);
+  leader = (cached == NULL) ? req_find_leader(question, question_len) : -1;
+  req = req_alloc();
+  if (req == NULL){
+    sti_mutex_unlock(resolv_reqs_mutex);
+    STI_LOGI(TAG, "...too many queries pending");
+    return 0;
+  }
+  req->question_len = question_len;
+  memcpy(REQ_QUESTION(req), question, question_len);
+  req->cb = cb;
+  req->arg = arg;
+  req->resp = NULL;
+  req->via_tcp = 0;
+  req->edns = RESOLV_EDNS_UDP_SIZE > 0;
+  req->stale = stale;
+  req->cached = (cached != NULL);
+  req->attempts = 0;
+  req->sent_mask = 0;
+  req->attempt_mask = 0;
+  req->start_ms = sti_now_ms();
+  req->next_ms = req->start_ms;
+  req->rto = server_rto(server_pick(0));
+  req->leader = -1;
+  query_build(req);
+  if (cached != NULL){
+    trace_add(RESOLV_TRACE_HIT, 0, question, question_len, -1, cached->tot_len, 0, 0);
+    req_finish(req, ERR_OK, cached);
+  }
+  else if (leader >= 0){
+    req->state = REQ_JOINED;
+    req->leader = leader;
+    resolv_stats.joined++;
+    resolv_reqs[leader].stale |= stale;
+    trace_add(RESOLV_TRACE_START, req->id, question, question_len, -1, 0, 0, 1);
+  }
+  else{
+    trace_add(RESOLV_TRACE_START, req->id, question, question_len, -1, 0, 0, 0);
+  }
+  handle = req_handle(req);
+  sti_mutex_unlock(resolv_reqs_mutex);
+
+  if (leader < 0){
+    sti_net_call(resolv_service, NULL);
+  }
+  return handle;
+}
+
+/** @brief ask a question again in the background to refresh its cache entry */
+static void
+query_refresh(const unsigned char *question, int question_len){
+  static const char *TAG = "res_query   ";
+
+  STI_LOGD(TAG, "...refreshing a popular cache entry");
+  query_start(question, question_len, NULL, 0, query_refresh_cb, NULL);
+}
+
+/** @brief look a question up in the static hosts table, see hosts_lookup()
+  * @returns the length of the responce copied into answer, 0 if it is not pinned */
+static int
+query_static(const unsigned char *question, int question_len, unsigned char *answer, int anslen){
+  int len = hosts_lookup(question, question_len, answer, anslen);
+
+  if (len > 0){
+    sti_mutex_lock(resolv_reqs_mutex);
+    resolv_stats.static_hits++;
+    sti_mutex_unlock(resolv_reqs_mutex);
+  }
+  return len;
+}
+
+/** @brief look a question up in the static hosts table, then in the cache
+  * A popular entry close to expiry is refreshed in the background.
+  * @param flags  set as by cache_lookup()
+  * @returns a pbuf holding the unexpired answer, NULL on a miss */
+static struct pbuf *
+query_cached(const unsigned char *question, int question_len, u8_t *flags){
+  struct pbuf *p;
+  int len;
+
+  *flags = 0;
+  p = pool_pbuf_alloc(RESOLV_CACHE_ENTRY_SIZE);
+  if (p == NULL){
+    return NULL;
+  }
+  len = query_static(question, question_len, p->payload, p->len);
+  if (len > 0){
+    pbuf_realloc(p, len);
+    return p;
+  }
+  len = cache_lookup(question, question_len, p->payload, p->len, flags);
+  if (*flags & CACHE_REFRESH){
+    query_refresh(question, question_len);
+  }
+  if (len <= 0){
+    pbuf_free(p);
+    return NULL;
+  }
+  pbuf_realloc(p, len);
+  return p;
+}
+
+/** @brief res_query_async starts a query and returns without waiting
+ * The question is asked exactly as res_query() would ask it. The callback is made
+ * once, from the network context, unless the query is cancelled first.
+ */
+RESOLV_HANDLE
+res_query_async(const char *dname, int class, int type, res_query_cb cb, void *arg){
+  unsigned char question[RESOLV_QUESTION_MAX];
+  int question_len;
+  RESOLV_HANDLE handle;
+  struct pbuf *p;
+  u8_t flags;
+
+  if (initFlag != 1 || cb == NULL){
+    return 0;
+  }
+  question_len = question_encode(dname, class, type, question);
+  if (question_len == 0){
+    return 0;
+  }
+  // a pinned name or an unexpired answer for the same question is served without
+  // using the network
+  p = query_cached(question, question_len, &flags);
+  handle = query_start(question, question_len, p, (flags & CACHE_STALE) != 0, cb, arg);
+  if (handle == 0 && p != NULL){
+    pbuf_free(p);
+  }
+  return handle;
+}
+
+/** @brief res_query_cb of resolv_prewarm(), the responce is already in the cache */
+static void
+prewarm_cb(void *arg, err_t err, struct pbuf *resp){
+  if (resp != NULL){
+    pbuf_free(resp);
+  }
+}
+
+/** @brief the type of a resolv_prewarm() entry
+  * @returns the RR type, 0 for both A and AAAA, -1 if it is not known */
+static int
+prewarm_type(const char *text, int len){
+  static const struct {
+    const char *name;
+    int type;
+  } types[] = {
+    {"A", RESOLV_TYPE_A}, {"AAAA", RESOLV_TYPE_AAAA}, {"SRV", RESOLV_TYPE_SRV},
+    {"TXT", RESOLV_TYPE_TXT}
+  };
+  int type = 0;
+  int j;
+
+  if (len == 0){
+    return 0;
+  }
+  for (int i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++){
+    for (j = 0; j < len && types[i].name[j] == toupper((unsigned char) text[j]); j++);
+    if (j == len && types[i].name[j] == 0){
+      return types[i].type;
+    }
+  }
+  for (int i = 0; i < len; i++){
+    if (!isdigit((unsigned char) text[i]) || type > 0xFFFF){
+      return -1;
+    }
+    type = type * 10 + (text[i] - '0');
+  }
+  return (type > 0 && type <= 0xFFFF) ? type : -1;
+}
+
+int
+resolv_prewarm(const char *list){
+  static const char *TAG = "prewarm     ";
+  char name[RESOLV_NAME_MAX + 1];
+  const char *end, *colon;
+  int name_len, type, qtype, started = 0;
+
+  while (*list != 0){
+    if (*list == ',' || *list == ' '){
+      list++;
+      continue;
+    }
+    end = list + strcspn(list, ", ");
+    colon = memchr(list, ':', end - list);
+    name_len = ((colon != NULL) ? colon : end) - list;
+    type = (colon != NULL) ? prewarm_type(colon + 1, end - colon - 1) : 0;
+    if (type < 0 || name_len == 0 || name_len > RESOLV_NAME_MAX){
+      STI_LOGI(TAG, "...skipping %.*s", (int)(end - list), list);
+      list = end;
+      continue;
+    }
+    memcpy(name, list, name_len);
+    name[name_len] = 0;
+    list = end;
+    for (int i = 0; i < ((type != 0) ? 1 : 2); i++){
+      qtype = (type != 0) ? type : ((i == 0) ? RESOLV_TYPE_A : RESOLV_TYPE_AAAA);
+      if (res_query_async(name, RESOLV_CLASS_IN, qtype, prewarm_cb, NULL) == 0){
+        STI_LOGI(TAG, "...could not start %s type %d", name, qtype);
+        return started;
+      }
+      started++;
+    }
+  }
+  STI_LOGD(TAG, "...%d lookups started", started);
+  return started;
+}
+
+void
+resolv_get_stats(RESOLV_STATS *stats){
+  RESOLV_CACHE_STATS cache_stats;
+
+  memset(stats, 0, sizeof(*stats));
+  if (resolv_reqs_mutex == NULL){
+    return;
+  }
+  sti_mutex_lock(resolv_reqs_mutex);
+  *stats = resolv_stats;
+  sti_mutex_unlock(resolv_reqs_mutex);
+  resolv_cache_get_stats(&cache_stats);
+  stats->cache_hits = cache_stats.hits;
+  stats->cache_misses = cache_stats.misses;
+  stats->queries = stats->static_hits + cache_stats.hits + cache_stats.misses;
+  stats->nservers = server_get_stats(stats->servers);
+}
+
+void
+resolv_reset_stats(void){
+  if (resolv_reqs_mutex == NULL){
+    return;
+  }
+  sti_mutex_lock(resolv_reqs_mutex);
+  memset(&resolv_stats, 0, sizeof(resolv_stats));
+  sti_mutex_unlock(resolv_reqs_mutex);
+  cache_reset_stats();
+  server_reset_stats();
+  pool_reset_stats();
+}
+
+err_t
+res_query_cancel(RESOLV_HANDLE handle){
+  int slot = (int)(handle & 0xFF) - 1;
+  RESOLV_REQ *req;
+
+  if (slot < 0 || slot >= RESOLV_MAX_PENDING || resolv_reqs_mutex == NULL){
+    return ERR_ARG;
+  }
+  req = &resolv_reqs[slot];
+  sti_mutex_lock(resolv_reqs_mutex);
+  if (req->state == REQ_FREE || req->gen != (u16_t)(handle >> 8)){
+    sti_mutex_unlock(resolv_reqs_mutex);
+    return ERR_VAL; // completed, its callback has been or is being made
+  }
+  if (req->state == REQ_WAITING && req_promote(req)){
+    req->state = REQ_FREE; // the wire query goes on for the requests that joined it
+    sti_mutex_unlock(resolv_reqs_mutex);
+    return ERR_OK;
+  }
+  if (req->state == REQ_WAITING && req->via_tcp){
+    tcp_query_cancel(req->id);
+  }
+  if (req->resp != NULL){
+    pbuf_free(req->resp);
+    req->resp = NULL;
+  }
+  req->state = REQ_FREE; // a pending retransmission finds nothing to do
+  sti_mutex_unlock(resolv_reqs_mutex);
+  return ERR_OK;
+}
+
+/** @brief res_query_cb that wakes a blocking caller */
+static void
+query_wait_cb(void *arg, err_t err, struct pbuf *resp){
+  RESOLV_WAIT *wait = (RESOLV_WAIT *) arg;
+
+  wait->err = err;
+  wait->resp = resp;
+  sti_event_signal(wait->event);
+}
+
+sti_event_t
+resolv_event_get(void){
+  sti_event_t event = NULL;
+
+  sti_mutex_lock(resolv_reqs_mutex);
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    if (wait_events_used[i] == 0){
+      wait_events_used[i] = 1;
+      event = wait_events[i];
+      break;
+    }
+  }
+  sti_mutex_unlock(resolv_reqs_mutex);
+  return event;
+}
+
+void
+resolv_event_put(sti_event_t event){
+  sti_event_wait(event, 0); // drop a signal no one waited for
+  sti_mutex_lock(resolv_reqs_mutex);
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    if (wait_events[i] == event){
+      wait_events_used[i] = 0;
+    }
+  }
+  sti_mutex_unlock(resolv_reqs_mutex);
+}
+
+/** @brief block until a query started with query_wait_cb completes
+  *
+  * resolv_service() completes every query within RESOLV_TIMEOUT_MS. Should the
+  * start never have reached the network context (e.g. the lwIP mailbox was full)
+  * the query is cancelled after RESOLV_WAIT_SLACK_MS more.
+  * @returns length of the responce in *resp, 0 if there is none */
+static int
+query_wait(RESOLV_WAIT *wait, RESOLV_HANDLE handle, struct pbuf **resp){
+  while (!sti_event_wait(wait->event, RESOLV_TIMEOUT_MS + RESOLV_WAIT_SLACK_MS)){
+    if (res_query_cancel(handle) == ERR_OK){
+      break; // no callback will come
+    }
+  }
+  resolv_event_put(wait->event);
+  *resp = wait->resp;
+  return (wait->resp != NULL) ? wait->resp->tot_len : 0;
+}
+
+/** @brief res_query_pbuf querries a DNS server and hands back the received pbuf
+ * The responce is not copied; the caller takes ownership of the pbuf chain and
+ * releases it with pbuf_free() when done. Use resolv_msg_init_pbuf() to parse it.
+ * This is res_query_async() followed by a wait for its callback.
+ */
+int
+res_query_pbuf(const char *dname, int class, int type, struct pbuf **resp){
+  static const char *TAG = "res_query   ";
+  RESOLV_WAIT wait;
+  RESOLV_HANDLE handle;
+
+  *resp = NULL;
+  /* Check if UDP connection initialized */
+  if (initFlag != 1){
+    return 0;
+  }
+  wait.event = resolv_event_get();
+  if (wait.event == NULL){
+    STI_LOGI(TAG, "...too many queries pending");
+    return 0;
+  }
+  wait.resp = NULL;
+  wait.err = ERR_TIMEOUT;
+  handle = res_query_async(dname, class, type, query_wait_cb, &wait);
+  if (handle == 0){
+    resolv_event_put(wait.event);
+    return 0;
+  }
+  return query_wait(&wait, handle, resp);
 }
 
 /** @brief res_query querries a DNS server and return a buffer with the answer(s)
  * The res_query() function provides an interface to the server query mechanism.
  * It constructs a query, sends it to the DNS server, awaits a response, and
- * makes preliminary checks on the reply. The reply message is left in the answer buffer
+ * makes preliminary checks on the reply. The reply message is left in the answer buffer.
+ * Several tasks may call res_query() at the same time; each query gets its own
+ * transaction ID and the responce is routed back to the task that asked for it.
+ * This is the copy-out form of res_query_pbuf().
  */
 int
 res_query(const char *dname, int class, int type, unsigned char *answer, int anslen){
-  int qname_len;
   static const char *TAG = "res_query   ";
-
-  RFC1035_HDR *hdr;
+  unsigned char question[RESOLV_QUESTION_MAX];
+  int question_len;
+  RESOLV_WAIT wait;
+  RESOLV_HANDLE handle;
   struct pbuf *p;
-  unsigned char *query;
+  u8_t flags;
+  int len;
 
   /* Check if UDP connection initialized */
   if (initFlag != 1){
     return 0;
   }
+  question_len = question_encode(dname, class, type, question);
+  if (question_len == 0){
+    return 0;
+  }
 
-  p = pbuf_alloc(PBUF_TRANSPORT, sizeof(RFC1035_HDR)+MAX_NAME_LENGTH+5, PBUF_RAM);
-  hdr = (RFC1035_HDR *)p->payload;
-  memset(hdr, 0, sizeof(RFC1035_HDR));
+  // a pinned name, or an unexpired answer for the same question, is copied
+  // straight out of the static hosts table or the cache
+  len = query_static(question, question_len, answer, anslen);
+  if (len > 0){
+    trace_add(RESOLV_TRACE_HIT, 0, question, question_len, -1, len, 0, 0);
+    return len;
+  }
+  len = cache_lookup(question, question_len, answer, anslen, &flags);
+  if (flags & CACHE_REFRESH){
+    query_refresh(question, question_len);
+  }
+  if (len > 0){
+    trace_add(RESOLV_TRACE_HIT, 0, question, question_len, -1, len, 0, 0);
+    return len;
+  }
 
-  user_buffer_ptr = answer;   // make start of answer header globally available
+  wait.event = resolv_event_get();
+  if (wait.event == NULL){
+    STI_LOGI(TAG, "...too many queries pending");
+    return 0;
+  }
+  wait.resp = NULL;
+  wait.err = ERR_TIMEOUT;
+  handle = query_start(question, question_len, NULL, (flags & CACHE_STALE) != 0,
+                       query_wait_cb, &wait);
+  if (handle == 0){
+    resolv_event_put(wait.event);
+    return 0;
+  }
+  len = query_wait(&wait, handle, &p);
+  if (len > 0){
+    len = pbuf_copy_partial(p, answer, (len < anslen) ? len : anslen, 0);
+    pbuf_free(p);
+  }
+  return len;
+}
 
-  /* Fill in header information observing Big Endian / Little Endian considerations*/
-  hdr->id = htons(99);
-  hdr->flags1 = DNS_FLAG1_RD; //This is 8bits so no need to worry about htons
-  hdr->qdcount = htons(1); // number of questions
-  query = (unsigned char *)hdr + sizeof(RFC1035_HDR);
-
-  qname_len = format_hostname((unsigned char *) dname, (unsigned char *) query);
-  query += qname_len;
-
-  // complete the question by (1) terminating the QNAME with 0, (2) specifying
-  // QTYPE and (3) specifying QCLASS
-  static unsigned char endquery[4];
-  endquery[0] = 0;                      // MSB request type
-  endquery[1] = (unsigned char) type;   // LSB request type
-  endquery[2] = 0;                      // MSB request class
-  endquery[3] = (unsigned char) class;  // LSB request class
-  memcpy(query, endquery, 4);
-
-  pbuf_realloc(p, sizeof(RFC1035_HDR) + qname_len + 4);
-  respFlag = 0; //clear responce flag. It will be set to 1 when buffer received
-
-  udp_send(resolv_pcb, p);
-  ESP_LOGI(TAG, "...query sent to DNS server" );
-  pbuf_free(p);
-
-  for (int time =0; time < 10; time++){
-    vTaskDelay(200 / portTICK_PERIOD_MS);
-    if (respFlag == 1){
+/** @brief route a responce to the request waiting for it
+  *
+  * Runs in the network context. Finds the pending request with the same transaction
+  * ID and question and hands the pbuf to that request; resolv_service() then makes
+  * its callback. A server that does not understand the OPT record answers FORMERR
+  * (rfc 6891 7); the question is then asked again without it. A truncated UDP
+  * responce is not handed over; the question is queued on the TCP transport instead.
+  * One with the TC bit still set (TCP disabled or the TCP query table full) is
+  * handed over as received and never cached. A SERVFAIL or REFUSED responce to a
+  * question with an expired answer in the cache is replaced by that answer.
+  * Responces nobody is waiting for are dropped.
+  */
+void
+resolv_deliver(struct pbuf *p, int server){
+  static const char *TAG = "res_query   ";
+  unsigned char head[sizeof(RFC1035_HDR) + RESOLV_QUESTION_MAX];
+  const unsigned char *hp;
+  RFC1035_HDR *hdr;
+  RESOLV_REQ *req;
+  struct pbuf *stale;
+  u16_t head_len;
+  u16_t id;
+  u16_t size = p->tot_len;
+  u8_t rcode;
+  u8_t via_tcp = (server == RESOLV_SERVER_TCP);
+  int kick_tcp = 0;
+  int matched = 0;
+
+  // the header and question are usually in the first pbuf of the chain
+  head_len = (p->tot_len < sizeof(head)) ? p->tot_len : sizeof(head);
+  hp = pbuf_get_contiguous(p, head, sizeof(head), head_len, 0);
+  if (hp == NULL || head_len < sizeof(RFC1035_HDR)){
+    pbuf_free(p);
+    return;
+  }
+  hdr = (RFC1035_HDR *)hp;
+  if ((hdr->flags1 & DNS_FLAG1_RESPONSE) == 0){
+    pbuf_free(p);
+    return;
+  }
+  id = ntohs(hdr->id);
+  rcode = hdr->flags2 & DNS_FLAG2_RCODE_MASK;
+  STI_LOG_HEX(TAG, hp, head_len);
+
+  sti_mutex_lock(resolv_reqs_mutex);
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    req = &resolv_reqs[i];
+    if (req->state != REQ_WAITING || req->id != id ||
+        (!via_tcp && (req->sent_mask & (1 << server)) == 0) ||
+        head_len < sizeof(RFC1035_HDR) + req->question_len ||
+        !question_equal(REQ_QUESTION(req), hp + sizeof(RFC1035_HDR), req->question_len)){
+      continue;
+    }
+    matched = 1;
+    trace_add(RESOLV_TRACE_RECV, id, REQ_QUESTION(req), req->question_len, server, size, rcode, 1);
+    if (req->edns && (hdr->flags2 & DNS_FLAG2_RCODE_MASK) == DNS_RCODE_FORMERR){
+      STI_LOGI(TAG, "...server rejected EDNS0, asking again without it");
+      req->edns = 0;
+      query_build(req);
+      req->attempts = 0;
+      req->sent_mask = 0;
+      req->attempt_mask = 0;
+      req->start_ms = sti_now_ms();
+      req->next_ms = req->start_ms; // resolv_service() sends it below
+      break;
+    }
+    resolv_stats.truncated += (!via_tcp && (hdr->flags1 & DNS_FLAG1_TRUNC));
+    if (RESOLV_TCP && !via_tcp && (hdr->flags1 & DNS_FLAG1_TRUNC) &&
+        tcp_query_enqueue(req->id, REQ_QUESTION(req), req->question_len) == ERR_OK){
+      req->via_tcp = 1; // same ID, the full answer comes over TCP
+      trace_add(RESOLV_TRACE_TCP, id, REQ_QUESTION(req), req->question_len, -1, size, 0, 0);
+      req->next_ms = req->start_ms + RESOLV_TIMEOUT_MS;
+      kick_tcp = 1;
+      server_answered(server, -1);
       break;
     }
+    if (hdr->flags1 & DNS_FLAG1_TRUNC){
+      STI_LOGD(TAG, "...responce truncated by the server (TC set)");
+    }
+    // rfc 8767 4: an expired answer is better than a server failure
+    if (req->stale && ((hdr->flags2 & DNS_FLAG2_RCODE_MASK) == DNS_RCODE_SERVFAIL ||
+                       (hdr->flags2 & DNS_FLAG2_RCODE_MASK) == DNS_RCODE_REFUSED) &&
+        (stale = req_stale_answer(req)) != NULL){
+      req_finish(req, ERR_OK, stale);
+      break;
+    }
+    // only answers to questions we asked are cached, and this must happen
+    // before the callback owns the pbuf and may free it
+    cache_store(REQ_QUESTION(req), req->question_len, p);
+    if (!via_tcp){
+      // Karn's rule: a responce to a retransmitted query cannot be timed
+      server_answered(server, (req->attempts == 1) ? (s32_t)(sti_now_ms() - req->sent_ms) : -1);
+    }
+    req_finish(req, ERR_OK, p);
+    p = NULL;
+    break;
   }
-  if ( respFlag != 1){
-    return 0;
+  sti_mutex_unlock(resolv_reqs_mutex);
+
+  if (!matched){
+    trace_add(RESOLV_TRACE_RECV, id, NULL, 0, server, size, rcode, 0);
   }
+  if (kick_tcp){
+    tcp_query_kick(server_addr(server));
+  }
+  if (p != NULL){
+    pbuf_free(p);
+  }
+  resolv_service(NULL);
+}
 
-  return payload_len;
+void
+resolv_tcp_failed(const u16_t *ids, int n, err_t err){
+  RESOLV_REQ *req;
+
+  if (n == 0){
+    return;
+  }
+  sti_mutex_lock(resolv_reqs_mutex);
+  for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+    req = &resolv_reqs[i];
+    if (req->state != REQ_WAITING || !req->via_tcp){
+      continue;
+    }
+    for (int j = 0; j < n; j++){
+      if (req->id == ids[j]){
+        req_fail(req, err);
+        break;
+      }
+    }
+  }
+  sti_mutex_unlock(resolv_reqs_mutex);
+  resolv_service(NULL);
 }
 
-/** @brief Callback executed when DNS server response is received
+/** @brief Callback executed when DNS server response is received over UDP
   */
 static void
-resolv_recv(void *s, struct udp_pcb *pcb, struct pbuf *p,
-                                  const ip_addr_t *addr, u16_t port)
+resolv_recv(struct pbuf *p, const ip_addr_t *addr, u16_t port)
 {
-  respFlag = 1;
-  payload_len = p->len;
+  int server = server_find(addr);
 
-  memcpy(user_buffer_ptr, p->payload, payload_len);
-  free(p);
-  return;
+  // only datagrams from one of our servers' DNS port are considered
+  if (server < 0 || port != DNS_SERVER_PORT){
+    pbuf_free(p);
+    return;
+  }
+  resolv_deliver(p, server);
 }
 
-/** @brief Initialize a UDP connection
-  * @parameter *dnsserver_ip_addr_ptr the dns server IP as ip_addr_t
+/** @brief sti_net_call target: install the server list staged by
+  * resolv_init_servers() while the resolver is open
+  *
+  * The sent and attempt masks of pending requests hold server indices; they are
+  * moved along with the servers, and the bits of servers that left are dropped,
+  * so that answers are matched to, and timeouts charged to, the servers that
+  * were actually asked. */
+static void
+servers_apply(void *ctx){
+  ip_addr_t addrs[RESOLV_MAX_SERVERS];
+  int moved[RESOLV_MAX_SERVERS];
+  RESOLV_REQ *req;
+  u8_t sent, attempt;
+  int count;
+
+  sti_mutex_lock(resolv_reqs_mutex);
+  count = server_unstage(addrs);
+  if (count > 0){
+    server_set(addrs, count, moved);
+    for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+      req = &resolv_reqs[i];
+      if (req->state != REQ_WAITING){
+        continue;
+      }
+      sent = 0;
+      attempt = 0;
+      for (int j = 0; j < RESOLV_MAX_SERVERS; j++){
+        if (moved[j] >= 0){
+          sent |= ((req->sent_mask >> j) & 1) << moved[j];
+          attempt |= ((req->attempt_mask >> j) & 1) << moved[j];
+        }
+      }
+      req->sent_mask = sent;
+      req->attempt_mask = attempt;
+    }
+  }
+  sti_mutex_unlock(resolv_reqs_mutex);
+}
+
+/** @brief Initialize the resolver with a list of DNS servers
+  * @parameter servers the dns server IPs as ip_addr_t, in order of preference
+  * @parameter count number of entries in servers
   * @returns err_t enumertion
   */
 err_t
-resolv_init(ip_addr_t *dnsserver_ip_addr_ptr) {
+resolv_init_servers(const ip_addr_t *servers, int count) {
   static const char *TAG = "resolv init ";
   err_t ret;
+  char addr_text[IPADDR_STRLEN_MAX];
 
-  if(resolv_pcb != NULL){
-    ESP_LOGI(TAG, "...resolv_pcb exists...delete it");
-    udp_remove(resolv_pcb);
+  if(count < 1){
+    return ERR_ARG;
+  }
+  if(resolv_reqs_mutex == NULL){
+    if(cache_init() != ERR_OK || server_init() != ERR_OK || tcp_query_init() != ERR_OK ||
+       pool_init() != ERR_OK){
+      STI_LOGI(TAG, "...could not create cache, server, TCP or pool semaphore");
+      return ERR_MEM;
+    }
+    resolv_reqs_mutex = sti_mutex_create();
+    for (int i = 0; i < RESOLV_MAX_PENDING; i++){
+      resolv_reqs[i].state = REQ_FREE;
+      wait_events[i] = sti_event_create();
+      if(wait_events[i] == NULL){
+        resolv_reqs_mutex = NULL;
+      }
+    }
+    if(resolv_reqs_mutex == NULL){
+      STI_LOGI(TAG, "...could not create request table semaphores");
+      return ERR_MEM;
+    }
   }
 
-  resolv_pcb = udp_new();
-  udp_bind(resolv_pcb, IP_ADDR_ANY, 0);
-
-  ret = udp_connect(resolv_pcb, dnsserver_ip_addr_ptr, DNS_SERVER_PORT);
-  if (ret < 0 ){
-    ESP_LOGI(TAG, "...udp connect failed to: " IPSTR, IP2STR(&dnsserver_ip_addr_ptr->u_addr.ip4));
-    return ERR_CONN;
+  for (int i = 0; i < count; i++){
+    STI_LOGI(TAG, "...DNS server %d: %s", i,
+             ipaddr_ntoa_r(&servers[i], addr_text, sizeof(addr_text)));
   }
-  else{
-    ESP_LOGI(TAG, "...udp connected to: " IPSTR, IP2STR(&dnsserver_ip_addr_ptr->u_addr.ip4));
+  // a snapshot passed over because the clock was not set yet is loaded now
+  cache_load();
+  if(initFlag){
+    // e.g. a new DHCP lease: queries in flight keep the endpoint they were sent on
+    if (server_stage(servers, count)){
+      sti_net_call(servers_apply, NULL);
+    }
+    return ERR_OK;
   }
 
-  typedef void(* udp_recv_fn) (void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
-  udp_recv_fn udp_r = &resolv_recv;
-  udp_recv (resolv_pcb, udp_r, NULL);
+  server_set(servers, count, NULL);
+
+  // the endpoint is not connected, so one local port serves every server
+  ret = sti_udp_open(resolv_recv);
+  if (ret != ERR_OK){
+    STI_LOGI(TAG, "...udp bind failed");
+    return ERR_CONN;
+  }
 
   initFlag = 1;
   return ERR_OK;
 }
 
-/** @brief Close the UDP connection
+/** @brief Initialize a UDP connection
+  * @parameter *dnsserver_ip_addr_ptr the dns server IP as ip_addr_t
+  * @returns err_t enumertion
+  */
+err_t
+resolv_init(ip_addr_t *dnsserver_ip_addr_ptr) {
+  return resolv_init_servers(dnsserver_ip_addr_ptr, 1);
+}
+
+/** @brief Close the UDP connection and the TCP connection if one is open
+  * A cache that changed since it was last saved is saved first.
   *
   * @returns err_t enumertion success is ERR_OK
   */
 err_t
 resolv_close(void) {
-  udp_remove(resolv_pcb);
-  resolv_pcb = NULL;
+  cache_close();
+  tcp_query_close();
+  sti_udp_close();
   initFlag = 0;
   return ERR_OK;
 }
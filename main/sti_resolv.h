@@ -34,6 +34,17 @@
 #ifndef STI_RESOLV_H
 #define STI_RESOLV_H
 
+/* The number of DNS servers the resolver can use */
+#ifdef CONFIG_STI_RESOLV_MAX_SERVERS
+#define RESOLV_MAX_SERVERS CONFIG_STI_RESOLV_MAX_SERVERS
+#else
+#define RESOLV_MAX_SERVERS 3
+#endif
+
+/* Buckets of the lookup latency histogram: bucket n counts lookups that took
+   less than 2^(n+1) ms, the last one every lookup that took longer */
+#define RESOLV_LATENCY_BUCKETS 12
+
 /** @brief Initialize this resolver
   *
   * Create a UDP connection with the DNS server so that DNS record queries can be made
@@ -46,6 +57,23 @@
 err_t
 resolv_init(ip_addr_t *dnsserver_ip_addr_ptr); /* working to pass ip_addr_t*/
 
+/** @brief Initialize this resolver with several DNS servers
+  *
+  * The resolver measures the round trip time of every server and sends each query
+  * to the fastest one that is answering. Retransmissions go to the next server, and
+  * a server that stops answering is moved to the back of the list for a while.
+  *
+  * Called again while the resolver is open, e.g. with the servers of a new DHCP
+  * lease, it only replaces the server list, in the network context. The UDP
+  * endpoint and the queries in flight are kept. A saved cache that could not be
+  * loaded before, because the system time was not set, is loaded then.
+  *
+  * @param servers  the IP addresses of the DNS servers, in order of preference
+  * @param count  number of servers; at most CONFIG_STI_RESOLV_MAX_SERVERS are used
+  * @returns ERR_OK: UDP endpoint created, LWIP error code otherwise */
+err_t
+resolv_init_servers(const ip_addr_t *servers, int count);
+
 /** @brief close the UDP connection and free the memory
   */
 err_t
@@ -54,33 +82,275 @@ resolv_close(void);
 /** @brief full function resolv query to get type A and type SRV records
   *
   * this function allows small computers to get a return buffers from the dns server
+  * The A and AAAA questions for names pinned with CONFIG_STI_RESOLV_STATIC_HOSTS are
+  * answered from a table built into the firmware, without the cache or the network.
+  * If an unexpired answer to the same question is in the cache it is returned at once,
+  * with every TTL reduced by the time the answer has been cached. A popular answer
+  * is asked for again in the background shortly before it expires. When the servers
+  * fail to answer a question whose answer expired recently, that answer is returned
+  * instead (see CONFIG_STI_RESOLV_STALE_MAX_S).
+  * The calling task blocks until the responce arrives or CONFIG_STI_RESOLV_TIMEOUT_MS
+  * milliseconds have passed. A query that is not answered within the retransmission
+  * timeout, derived from the measured round trip time, is sent again. It is safe to call from several tasks at once; up to
+  * CONFIG_STI_RESOLV_MAX_PENDING queries can be outstanding at the same time.
+  * It is a blocking wrapper around the same machinery as res_query_async().
   * @param *dname  the domain name information is sought for
   * @param class  the class as specified by RFC 1035 (expect Internet Class)
   * @param type  the type as specified by RFC 1035 (expect type A or SRV)
   * @param *answer  a pointer to the buffer the DNS result should be loaded into
-  * @param anslen the length of the supplied buffer
-  * @returns int the length of the received buffer (number of 8 bit bytes)
+  * @param anslen the length of the supplied buffer, longer responces are cut to this length
+  * @note The query carries an EDNS0 OPT record advertising CONFIG_STI_RESOLV_EDNS_UDP_SIZE,
+  * so responces can be larger than 512 bytes. If the server still had to truncate the
+  * responce the TC bit is set in the returned header (RESOLV_MSG flags1 & 0x02).
+  * @returns int the length of the received buffer (number of 8 bit bytes), 0 on timeout
+  * or when the pending request table is full
   */
 int
 res_query(const char *dname, int class, int type, unsigned char *answer, int anslen);
 
+/** @brief resolv query that hands the received pbuf to the caller
+  *
+  * Same as res_query() but the responce is not copied. On success *resp points to
+  * the pbuf chain as received from lwIP (or a pbuf holding the cached answer) and the
+  * caller owns it; release it with pbuf_free() when done. Parse it in place with
+  * resolv_msg_init_pbuf().
+  * @param *dname  the domain name information is sought for
+  * @param class  the class as specified by RFC 1035 (expect Internet Class)
+  * @param type  the type as specified by RFC 1035 (expect type A or SRV)
+  * @param resp  set to the responce, NULL when nothing was received
+  * @returns int the length of the responce (number of 8 bit bytes), 0 on timeout
+  */
+int
+res_query_pbuf(const char *dname, int class, int type, struct pbuf **resp);
+
+/** @brief Handle of a query started with res_query_async(), 0 is never a valid handle */
+typedef u32_t RESOLV_HANDLE;
+
+/** @brief called once when a query started with res_query_async() completes
+  *
+  * Runs in the network context (the lwIP thread on ESP-IDF), so it must return
+  * quickly and must not block or call res_query().
+  * @param arg  the arg given to res_query_async()
+  * @param err  ERR_OK if a responce was received, ERR_TIMEOUT if none arrived in time
+  * @param resp  on ERR_OK the responce, which the callee owns and must pbuf_free();
+  * NULL otherwise */
+typedef void (*res_query_cb)(void *arg, err_t err, struct pbuf *resp);
+
+/** @brief start a query without waiting for the answer
+  *
+  * The question is asked as res_query() would ask it: from the cache if possible,
+  * otherwise over UDP with retransmission and over TCP after truncation. The call
+  * returns at once and cb reports the result. Up to CONFIG_STI_RESOLV_MAX_PENDING
+  * queries, blocking or not, can be in flight at the same time.
+  * @note cb may be called before res_query_async() returns, e.g. on a cache hit.
+  * @param *dname  the domain name information is sought for
+  * @param class  the class as specified by RFC 1035 (expect Internet Class)
+  * @param type  the type as specified by RFC 1035
+  * @param cb  called once with the result, unless the query is cancelled
+  * @param arg  passed to cb
+  * @returns the handle of the query, 0 if it could not be started (resolver not
+  * initialized, bad name or too many queries pending); cb is not called then
+  */
+RESOLV_HANDLE
+res_query_async(const char *dname, int class, int type, res_query_cb cb, void *arg);
+
+/** @brief cancel a query started with res_query_async()
+  * @param handle  the handle returned by res_query_async()
+  * @returns ERR_OK if the query was cancelled and its callback will not be made,
+  * ERR_VAL if it has already completed (the callback has been or is being made),
+  * ERR_ARG if the handle is not valid */
+err_t
+res_query_cancel(RESOLV_HANDLE handle);
+
+/** @brief start lookups whose only purpose is to fill the answer cache
+  *
+  * Meant to be called as soon as the network is up (e.g. by the task that
+  * IP_EVENT_STA_GOT_IP wakes, after resolv_init_servers()), so that the names
+  * the application needs are cached before it asks for them. Every lookup is
+  * started at once with res_query_async() and the call does not wait.
+  * @param list  names separated by commas or spaces, each optionally followed by
+  * ':' and a type (A, AAAA, SRV, TXT or a number), e.g. "example.com,_sip._udp.example.com:SRV".
+  * A name without a type gets both A and AAAA, as res_query_addr() asks for.
+  * @returns the number of lookups started, fewer than asked for if too many are pending */
+int
+resolv_prewarm(const char *list);
+
+/** @brief Counters kept by the answer cache */
+typedef struct s_RESOLV_CACHE_STATS {
+  u32_t hits; /**< queries answered from the cache */
+  u32_t misses; /**< queries that had to be sent to the DNS server */
+  u32_t negative_hits; /**< hits that returned NXDOMAIN or an empty answer */
+  u32_t prefetches; /**< popular responces refreshed before they expired */
+  u32_t stale_answers; /**< expired responces served because the servers did not answer */
+  u32_t entries; /**< responces currently held in the cache */
+} RESOLV_CACHE_STATS;
+
+/** @brief get the answer cache counters
+  * @param stats  filled with the current counters */
+void
+resolv_cache_get_stats(RESOLV_CACHE_STATS *stats);
+
+/** @brief Counters kept for one DNS server */
+typedef struct s_RESOLV_SERVER_STATS {
+  ip_addr_t addr; /**< address of the server */
+  u32_t srtt; /**< smoothed round trip time in ms, 0 until the first sample */
+  u32_t rto; /**< current retransmission timeout in ms */
+  u32_t sent; /**< queries sent to the server, retransmissions included */
+  u32_t answered; /**< responces received from the server */
+  u32_t timeouts; /**< queries the server did not answer within its timeout */
+} RESOLV_SERVER_STATS;
+
+/** @brief Counters kept by the resolver */
+typedef struct s_RESOLV_STATS {
+  u32_t queries; /**< lookups made, static_hits + cache_hits + cache_misses */
+  u32_t static_hits; /**< lookups answered from the static hosts table */
+  u32_t cache_hits; /**< lookups answered from the cache */
+  u32_t cache_misses; /**< lookups that had to go to the network */
+  u32_t joined; /**< misses that joined the same question already on the wire */
+  u32_t sent; /**< UDP queries sent, retransmissions included */
+  u32_t retries; /**< retransmissions */
+  u32_t timeouts; /**< lookups that got no answer within the timeout */
+  u32_t truncated; /**< UDP responces with the TC bit set */
+  u32_t latency[RESOLV_LATENCY_BUCKETS]; /**< time to the answer of every miss, see RESOLV_LATENCY_BUCKETS */
+  int nservers; /**< entries used in servers */
+  RESOLV_SERVER_STATS servers[RESOLV_MAX_SERVERS]; /**< one per DNS server, in list order */
+} RESOLV_STATS;
+
+/** @brief get the resolver counters and the latency histogram
+  * The counters of the answer cache are in resolv_cache_get_stats().
+  * @param stats  filled with the counters since start up or resolv_reset_stats() */
+void
+resolv_get_stats(RESOLV_STATS *stats);
+
+/** @brief set every counter of resolv_get_stats(), resolv_cache_get_stats() and
+  * resolv_pool_get_stats() to 0
+  * Round trip time estimates are kept, the pool high water mark restarts from
+  * the buffers in use. */
+void
+resolv_reset_stats(void);
+
+/** @brief Use of the responce buffer pool
+  *
+  * Answers handed out from the cache and the copies given to lookups that joined
+  * a query on the wire are held in CONFIG_STI_RESOLV_POOL_BUFFERS buffers of
+  * CONFIG_STI_RESOLV_CACHE_ENTRY_SIZE bytes reserved at resolv_init(). A larger
+  * responce, or one asked for while every buffer is in use, comes from the heap.
+  * Responces over TCP are often larger and counted apart in oversize.
+  * A high_water below buffers with heap at 0 means the pool is large enough. */
+typedef struct s_RESOLV_POOL_STATS {
+  u16_t buffers; /**< buffers in the pool */
+  u16_t buffer_size; /**< bytes in each buffer */
+  u16_t in_use; /**< buffers held now */
+  u16_t high_water; /**< most buffers held at the same time */
+  u32_t taken; /**< buffers taken from the pool */
+  u32_t heap; /**< responce buffers from the heap as every pool buffer was in use */
+  u32_t oversize; /**< responce buffers from the heap as they were larger than a pool buffer */
+} RESOLV_POOL_STATS;
+
+/** @brief get the use of the responce buffer pool
+  * @param stats  filled with the counters since start up or resolv_reset_stats() */
+void
+resolv_pool_get_stats(RESOLV_POOL_STATS *stats);
+
+/* Events of the query trace, see RESOLV_TRACE */
+#define RESOLV_TRACE_HIT 1 // answered from the cache or static hosts, size is the answer length
+#define RESOLV_TRACE_START 2 // a cache miss started a query, outcome 1 if it joined one on the wire
+#define RESOLV_TRACE_SEND 3 // the query went to server over UDP, outcome is the attempt from 0
+#define RESOLV_TRACE_RECV 4 // a responce came from server (-1: TCP), outcome 0 if nobody waited for it
+#define RESOLV_TRACE_TCP 5 // the responce was truncated, the question was passed to TCP
+#define RESOLV_TRACE_DONE 6 // the query completed, outcome is the err_t given to the callback
+
+/** @brief One record of the query trace
+  *
+  * With CONFIG_STI_RESOLV_TRACE_ENTRIES the resolver records every lookup, query
+  * sent and responce received in a ring of that many records. Records of one query
+  * share id and qhash. The names are not kept: resolv_trace_qhash() tells which
+  * name a qhash belongs to. */
+typedef struct s_RESOLV_TRACE {
+  u32_t seq; /**< number of the record, 1 for the first one since start up */
+  u32_t ms; /**< sti_now_ms() of the event */
+  u32_t qhash; /**< hash of the name asked for, 0 if not known */
+  u16_t id; /**< transaction ID of the query, 0 for a cache hit */
+  u16_t type; /**< RR type asked for, 0 if not known */
+  u16_t size; /**< length of the query or responce */
+  u8_t event; /**< one of RESOLV_TRACE_HIT ... RESOLV_TRACE_DONE */
+  s8_t server; /**< index of the server, -1 for TCP or none */
+  u8_t rcode; /**< RESOLV_TRACE_RECV: RCODE of the responce */
+  s8_t outcome; /**< depends on event, see RESOLV_TRACE_HIT ... */
+} RESOLV_TRACE;
+
+/** @brief copy the newest records of the query trace, oldest first
+  * Safe to call at any time, the trace is not stopped. Records that are being
+  * overwritten while they are copied are left out.
+  * @param records  where to copy them
+  * @param max  size of records
+  * @returns the number of records copied, 0 if the trace is not configured */
+int
+resolv_trace_read(RESOLV_TRACE *records, int max);
+
+/** @brief print the query trace on the console (stdout), one record a line
+  * The lines start with "TRACE " and are read by the host tool resolv_trace.
+  * @returns the number of records printed */
+int
+resolv_trace_dump(void);
+
+/** @brief the qhash the query trace records for a name
+  * @param dname  the name, case and a trailing dot do not matter
+  * @returns the hash, 0 if the name is not valid */
+u32_t
+resolv_trace_qhash(const char *dname);
+
+/** @brief remove every responce from the answer cache */
+void
+resolv_cache_flush(void);
+
+/** @brief save the unexpired responces of the answer cache to storage (NVS)
+  *
+  * They are loaded again by the first resolv_init() or resolv_init_servers() after
+  * a restart that finds the system time set, so that the first lookups need not
+  * wait for the network. resolv_close() saves a changed
+  * cache, and resolv_cache_save_due() saves it at most every
+  * CONFIG_STI_RESOLV_CACHE_SAVE_S seconds. Lookups never save it.
+  * The expiry times are kept as wall clock time: the system time must be set
+  * (SNTP, or kept by the RTC through deep sleep) for saving and loading to work.
+  * Must not be called in the network context.
+  * @returns ERR_OK, ERR_VAL if the time is not set, ERR_IF if persistence is not
+  * configured or storage is not available, ERR_MEM if it is full */
+err_t
+resolv_cache_save(void);
+
+/** @brief save the cache if it changed and CONFIG_STI_RESOLV_CACHE_SAVE_S passed
+  * since the last save
+  *
+  * Saving allocates a buffer for the snapshot and writes flash, so it is kept off
+  * the lookup path: call this from an application task or timer, e.g. once a
+  * minute. Must not be called in the network context.
+  * @returns ERR_OK if saved or not due, otherwise as resolv_cache_save() */
+err_t
+resolv_cache_save_due(void);
+
 /** @brief get_qname_len() - Walk through the encoded answer buffer and return
  * the length of the encoded name in chars.
  *---------------------------------------------------------------------------*/
 int
 get_qname_len(unsigned char *name_ptr);
 
-/** @brief print_buf prints out a buffer. This makes it easier to troubleshoot
-  * buffers sent or received from the DNS server */
+/** @brief print_buf hex dumps a buffer, 16 bytes a line, at debug level.
+  * This makes it easier to troubleshoot buffers sent or received from the DNS
+  * server. The dump is compiled out when the log level is below debug. */
 void print_buf(unsigned char *buf, int length);
 
 /** @brief format_hostname to network format.
   * Takes as input a full hostname of subnames separated by decimal points
   * and loads an output buffer with subnames preceded by subname length
-  * this is well described in RFC1035
+  * this is well described in RFC1035. A trailing decimal point is allowed.
+  * Names longer than CONFIG_STI_RESOLV_MAX_NAME_LENGTH (at most 253), empty
+  * subnames and subnames longer than 63 are rejected.
   * @param dname the domain name information is desired for
-  * @param qname a pointer to the location the encoded hostname needs to be written
-  * @returns The lenght of the encoded hostname in 8 bt bytes*/
+  * @param qname a pointer to the location the encoded hostname needs to be written,
+  * room for RESOLV_NAME_MAX bytes is enough
+  * @returns The lenght of the encoded hostname in 8 bt bytes, including the
+  * terminating 0, or 0 if the name is not valid */
 int
 format_hostname(unsigned char * dname, unsigned char * qname);
 
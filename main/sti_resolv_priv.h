@@ -0,0 +1,193 @@
+/** @file sti_resolv_priv.h
+ *  @brief Definitions shared by the modules of the resolver
+ *
+ *  These are not part of the public interface in sti_resolv.h. They describe the
+ *  wire format of DNS messages as defined in rfc 1035 and the limits the resolver
+ *  was built with.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_RESOLV_PRIV_H
+#define STI_RESOLV_PRIV_H
+
+/* The longest name that can be looked up, in characters without a trailing dot.
+   253 is the rfc 1035 limit of 255 bytes once encoded */
+#ifdef CONFIG_STI_RESOLV_MAX_NAME_LENGTH
+#define MAX_NAME_LENGTH CONFIG_STI_RESOLV_MAX_NAME_LENGTH
+#else
+#define MAX_NAME_LENGTH 253
+#endif
+
+#define RESOLV_LABEL_MAX 63 // longest label of a name, rfc 1035 2.3.4
+
+/* Longest encoded question: QNAME with its length bytes and root label, then QTYPE and QCLASS */
+#define RESOLV_QUESTION_MAX (MAX_NAME_LENGTH + 2 + 4)
+
+/* How long res_query() waits for the DNS server to answer, including
+   retransmissions, in milliseconds */
+#ifdef CONFIG_STI_RESOLV_TIMEOUT_MS
+#define RESOLV_TIMEOUT_MS CONFIG_STI_RESOLV_TIMEOUT_MS
+#else
+#define RESOLV_TIMEOUT_MS 5000
+#endif
+
+/* Extra time a blocking caller waits beyond RESOLV_TIMEOUT_MS before it cancels
+   a query whose completion never arrived */
+#define RESOLV_WAIT_SLACK_MS 1000
+
+#define DNS_FLAG1_RESPONSE 0x80 // QR bit, set in messages from the server
+#define DNS_FLAG1_TRUNC 0x02 // TC bit, the message was truncated
+#define DNS_FLAG1_RD 0x01 // DNS recursion requested
+#define DNS_FLAG2_RCODE_MASK 0x0F // responce code in the low bits of flags2
+#define DNS_RCODE_FORMERR 1 // the server could not interpret the query
+#define DNS_RCODE_NXDOMAIN 3 // the name does not exist
+
+#define DNS_OPT_RR_LEN 11 // OPT RR with an empty RDATA: name, type, class, ttl, rdlength
+
+/** @brief The DNS message header. \n
+  The DNS header is 12 x 8-bit bytes and is defined in RFC-1035\n
+  The header is used to send queries to DNS server. The header is also part of
+  the answer returned by the DNS server.
+  @note order of the fields in the struct must not be changed as the struct is used as
+  an overlay that allows information to be extracted from the returned answer buffer*/
+typedef struct s_RFC1035_HDR {
+  u16_t id; /**< ID Number of the request */
+  u8_t flags1; /**< Flags for QR| Opcode |AA|TC|RD */
+  u8_t flags2; /**< Flags for RA| Z | RCODE | */
+  u16_t qdcount; /**< number of entries in the question section */
+  u16_t ancount; /**< number of resource records in the answer section */
+  u16_t nscount; /**< no. of name server resource records in the authority records*/
+  u16_t arcount; /**< number of resource records in the additional records section */
+} RFC1035_HDR;
+
+#define RESOLV_SERVER_TCP (-1) // resolv_deliver() server argument for the TCP transport
+
+/** @brief route a responce to the request waiting for it
+  * Called in the network context by the UDP and TCP transports. Takes ownership of p.
+  * @param p  the responce, starting with the DNS header
+  * @param server  index of the server the UDP responce came from, or RESOLV_SERVER_TCP */
+void
+resolv_deliver(struct pbuf *p, int server);
+
+/** @brief complete the requests waiting for TCP responces that will not come
+  * Called in the network context by the TCP transport, which has forgotten the queries.
+  * @param ids  transaction IDs of the queries, in host byte order
+  * @param n  number of IDs
+  * @param err  the error the requests complete with */
+void
+resolv_tcp_failed(const u16_t *ids, int n, err_t err);
+
+/** @brief lend out an event for a task that blocks on asynchronous queries
+  * @returns the event, NULL if every event is in use */
+sti_event_t
+resolv_event_get(void);
+
+/** @brief return an event lent out by resolv_event_get() */
+void
+resolv_event_put(sti_event_t event);
+
+/** @brief One address family of an address lookup */
+typedef struct s_ADDR_FAMILY {
+  u16_t type; /**< RESOLV_TYPE_A or RESOLV_TYPE_AAAA */
+  u8_t done; /**< set to 1 once the query needs no more waiting for */
+  u8_t found; /**< number of addresses in resp, at most 255 */
+  u32_t done_ms; /**< sti_now_ms() when the query completed */
+  RESOLV_HANDLE handle; /**< the query, 0 if it could not be started */
+  struct pbuf *resp; /**< the responce as a single pbuf, NULL if none */
+} ADDR_FAMILY;
+
+/** @brief A and AAAA queries for one name, asked at the same time (rfc 8305) */
+typedef struct s_ADDR_LOOKUP {
+  ADDR_FAMILY family[2]; /**< [0] the preferred family, [1] the other one */
+  sti_event_t event; /**< signalled when a query completes */
+} ADDR_LOOKUP;
+
+/** @brief start the A and AAAA queries of a name
+  * @param lookup  the lookup, must stay valid until addr_lookup_wait() returns
+  * @param name  the name to look up, NULL for a lookup that is already complete
+  * @param event  signalled as the queries complete, from resolv_event_get() */
+void
+addr_lookup_start(ADDR_LOOKUP *lookup, const char *name, sti_event_t event);
+
+/** @brief block until every lookup has its addresses
+  * A lookup is complete when both queries have completed, or when one family
+  * answered with addresses and the other has not followed within
+  * CONFIG_STI_RESOLV_FAMILY_DELAY_MS; the late query is then cancelled.
+  * @param lookups  the lookups, all started with the same event
+  * @param n  number of lookups */
+void
+addr_lookup_wait(ADDR_LOOKUP *lookups, int n, sti_event_t event);
+
+/** @brief One address found by a lookup, see resolv_found_fn */
+typedef struct s_RESOLV_FOUND {
+  ip_addr_t addr; /**< the address */
+  u32_t ttl; /**< seconds it may be used, the smallest TTL of the records leading to it */
+  const struct s_RESOLV_MSG *msg; /**< the responce holding the owner name (sti_rr.h) */
+  u16_t name_off; /**< owner name of the address record, the canonical name of the host */
+  const struct s_RESOLV_SRV *srv; /**< the SRV record of the target, NULL if not an SRV lookup */
+} RESOLV_FOUND;
+
+/** @brief called for each address of a lookup, in the order they should be tried
+  * found and the responce it points into are only valid during the call.
+  * @returns 1 for the next address, 0 to stop */
+typedef int (*resolv_found_fn)(void *ctx, const RESOLV_FOUND *found);
+
+/** @brief hand the addresses of a completed lookup to fn and free its responces
+  * Families alternate, starting with the preferred one (rfc 8305 4).
+  * @param fn  called for each address, NULL to only free the responces
+  * @returns 0 if fn asked to stop, 1 otherwise */
+int
+addr_lookup_each(ADDR_LOOKUP *lookup, resolv_found_fn fn, void *ctx);
+
+/** @brief look up the addresses of a name, as res_query_addr(), and hand them to fn
+  * Blocks. */
+void
+addr_resolve(const char *name, resolv_found_fn fn, void *ctx);
+
+/** @brief look up an SRV name and hand its endpoints to fn
+  * In the order res_query_srv() returns them, with found.srv set. The TTL of an
+  * endpoint is the smaller of the SRV and address TTLs. Blocks. */
+void
+srv_resolve(const char *name, resolv_found_fn fn, void *ctx);
+
+/** @brief make a responce a single pbuf so it can be walked without scratch space
+  * @returns the responce, NULL if it could not be gathered (p is then freed) */
+struct pbuf *
+resolv_pbuf_contiguous(struct pbuf *p);
+
+/** @brief compare two encoded questions (QNAME, QTYPE, QCLASS)
+  * Names are compared without regard to case as required by RFC 1035
+  * @returns 1 if the questions are the same */
+static inline int
+question_equal(const unsigned char *a, const unsigned char *b, int question_len){
+  int name_len = question_len - 4;
+
+  for (int i = 0; i < name_len; i++){
+    if (tolower(a[i]) != tolower(b[i])){
+      return 0;
+    }
+  }
+  return memcmp(a + name_len, b + name_len, 4) == 0;
+}
+
+#endif /* STI_RESOLV_PRIV_H */
@@ -0,0 +1,337 @@
+/** @file sti_rr.c
+ *  @brief Walk the resource records of a DNS responce in place
+ *
+ *  See sti_rr.h. Key references are
+ *  (1) rfc 1035 DOMAIN NAMES - IMPLEMENTATION AND SPECIFICATION, 4.1 Format
+ *  (2) rfc 2782 A DNS RR for specifying the location of services (DNS SRV)
+ *  (3) rfc 3596 DNS Extensions to Support IP Version 6
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_resolv_priv.h"
+#include "sti_rr.h"
+
+#define DNS_PTR_MASK 0xC0 // top two bits of a length byte set: compression pointer
+#define DNS_LABEL_MAX 63 // longest label allowed by rfc 1035
+#define DNS_RR_FIXED_LEN 10 // TYPE, CLASS, TTL and RDLENGTH following the owner name
+#define DNS_SOA_FIXED_LEN 20 // SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM
+
+/** @brief read a 16 bit big endian value */
+static inline u16_t
+get16(const unsigned char *p){
+  return (u16_t)((p[0] << 8) | p[1]);
+}
+
+/** @brief read a 32 bit big endian value */
+static inline u32_t
+get32(const unsigned char *p){
+  return ((u32_t)p[0] << 24) | ((u32_t)p[1] << 16) | ((u32_t)p[2] << 8) | p[3];
+}
+
+/** @brief step over an encoded name in buf[0..len)
+  *
+  * Only pointers to earlier bytes are followed, which limits the number of jumps
+  * and rules out loops. The expanded length is limited to RESOLV_NAME_MAX.
+  * @returns offset after the name where it appears in the buffer, -1 if malformed */
+static int
+name_skip(const unsigned char *buf, int len, int off){
+  int end = -1; // offset after the name, set at the first pointer
+  int expanded = 0;
+  int label_start = off;
+
+  while (off < len){
+    u8_t c = buf[off];
+    if ((c & DNS_PTR_MASK) == DNS_PTR_MASK){
+      if (off + 2 > len){
+        return -1;
+      }
+      int target = ((c & ~DNS_PTR_MASK) << 8) | buf[off + 1];
+      if (target >= label_start){
+        return -1; // must point strictly backwards
+      }
+      if (end < 0){
+        end = off + 2;
+      }
+      off = label_start = target;
+      continue;
+    }
+    if (c & DNS_PTR_MASK){
+      return -1; // 0x40 and 0x80 label types are not defined
+    }
+    if (c == 0){
+      expanded += 1;
+      if (expanded > RESOLV_NAME_MAX){
+        return -1;
+      }
+      return (end < 0) ? off + 1 : end;
+    }
+    expanded += c + 1;
+    if (expanded > RESOLV_NAME_MAX){
+      return -1;
+    }
+    off += c + 1;
+  }
+  return -1;
+}
+
+int
+resolv_name_skip(const RESOLV_MSG *msg, int off){
+  return name_skip(msg->buf, msg->len, off);
+}
+
+int
+get_qname_len(unsigned char *name_ptr){
+  unsigned char *p = name_ptr;
+
+  while (*p != 0){
+    if ((*p & DNS_PTR_MASK) == DNS_PTR_MASK){
+      return (int)(p - name_ptr) + 2;
+    }
+    p += *p + 1;
+  }
+  return (int)(p - name_ptr) + 1;
+}
+
+int
+resolv_msg_init(RESOLV_MSG *msg, const unsigned char *buf, int len){
+  int off = sizeof(RFC1035_HDR);
+
+  if (len < (int) sizeof(RFC1035_HDR) || len > 0xFFFF){
+    return -1;
+  }
+  msg->buf = buf;
+  msg->len = (u16_t) len;
+  msg->id = get16(buf);
+  msg->flags1 = buf[2];
+  msg->flags2 = buf[3];
+  msg->qdcount = get16(buf + 4);
+  msg->ancount = get16(buf + 6);
+  msg->nscount = get16(buf + 8);
+  msg->arcount = get16(buf + 10);
+  msg->question_off = (u16_t) off;
+
+  for (int i = 0; i < msg->qdcount; i++){
+    off = name_skip(buf, len, off);
+    if (off < 0 || off + 4 > len){
+      return -1;
+    }
+    off += 4; // QTYPE and QCLASS
+  }
+  msg->next_off = (u16_t) off;
+  msg->next_index = 0;
+  return 0;
+}
+
+int
+resolv_msg_init_pbuf(RESOLV_MSG *msg, const struct pbuf *p,
+                     unsigned char *scratch, int scratch_len){
+  const unsigned char *buf;
+
+  if (p->len == p->tot_len){
+    return resolv_msg_init(msg, p->payload, p->len);
+  }
+  if (scratch == NULL){
+    return -1;
+  }
+  buf = pbuf_get_contiguous(p, scratch, scratch_len, p->tot_len, 0);
+  if (buf == NULL){
+    return -1;
+  }
+  return resolv_msg_init(msg, buf, p->tot_len);
+}
+
+int
+resolv_rr_next(RESOLV_MSG *msg, RESOLV_RR *rr){
+  const unsigned char *buf = msg->buf;
+  int total = msg->ancount + msg->nscount + msg->arcount;
+  int off = msg->next_off;
+  int idx = msg->next_index;
+
+  if (idx >= total){
+    return 0;
+  }
+  rr->name_off = (u16_t) off;
+  off = name_skip(buf, msg->len, off);
+  if (off < 0 || off + DNS_RR_FIXED_LEN > msg->len){
+    return -1;
+  }
+  rr->type = get16(buf + off);
+  rr->class = get16(buf + off + 2);
+  rr->ttl_off = (u16_t)(off + 4);
+  rr->ttl = get32(buf + off + 4);
+  rr->rdlength = get16(buf + off + 8);
+  off += DNS_RR_FIXED_LEN;
+  if (off + rr->rdlength > msg->len){
+    return -1;
+  }
+  rr->rdata_off = (u16_t) off;
+  rr->rdata = buf + off;
+
+  if (idx < msg->ancount){
+    rr->section = RESOLV_SECTION_ANSWER;
+  }
+  else if (idx < msg->ancount + msg->nscount){
+    rr->section = RESOLV_SECTION_AUTHORITY;
+  }
+  else{
+    rr->section = RESOLV_SECTION_ADDITIONAL;
+  }
+  msg->next_off = (u16_t)(off + rr->rdlength);
+  msg->next_index = (u16_t)(idx + 1);
+  return 1;
+}
+
+int
+resolv_name_text(const RESOLV_MSG *msg, int off, char *out, int outlen){
+  const unsigned char *buf = msg->buf;
+  int n = 0;
+
+  if (outlen <= 0 || name_skip(buf, msg->len, off) < 0){
+    return -1; // validated once, so the loop below can trust the labels
+  }
+  while (buf[off] != 0){
+    if ((buf[off] & DNS_PTR_MASK) == DNS_PTR_MASK){
+      off = ((buf[off] & ~DNS_PTR_MASK) << 8) | buf[off + 1];
+      continue;
+    }
+    int label_len = buf[off];
+    if (n + (n > 0) + label_len + 1 > outlen){
+      out[0] = 0;
+      return -1;
+    }
+    if (n > 0){
+      out[n++] = '.';
+    }
+    memcpy(out + n, buf + off + 1, label_len);
+    n += label_len;
+    off += label_len + 1;
+  }
+  out[n] = 0;
+  return n;
+}
+
+int
+resolv_name_equal(const RESOLV_MSG *a, int a_off, const RESOLV_MSG *b, int b_off){
+  const unsigned char *pa = a->buf;
+  const unsigned char *pb = b->buf;
+
+  if (name_skip(pa, a->len, a_off) < 0 || name_skip(pb, b->len, b_off) < 0){
+    return 0;
+  }
+  for (;;){
+    while ((pa[a_off] & DNS_PTR_MASK) == DNS_PTR_MASK){
+      a_off = ((pa[a_off] & ~DNS_PTR_MASK) << 8) | pa[a_off + 1];
+    }
+    while ((pb[b_off] & DNS_PTR_MASK) == DNS_PTR_MASK){
+      b_off = ((pb[b_off] & ~DNS_PTR_MASK) << 8) | pb[b_off + 1];
+    }
+    int label_len = pa[a_off];
+    if (label_len != pb[b_off]){
+      return 0;
+    }
+    if (label_len == 0){
+      return 1;
+    }
+    for (int i = 1; i <= label_len; i++){
+      if (tolower(pa[a_off + i]) != tolower(pb[b_off + i])){
+        return 0;
+      }
+    }
+    a_off += label_len + 1;
+    b_off += label_len + 1;
+  }
+}
+
+const unsigned char *
+resolv_rr_a(const RESOLV_RR *rr){
+  if (rr->type != RESOLV_TYPE_A || rr->rdlength != 4){
+    return NULL;
+  }
+  return rr->rdata;
+}
+
+const unsigned char *
+resolv_rr_aaaa(const RESOLV_RR *rr){
+  if (rr->type != RESOLV_TYPE_AAAA || rr->rdlength != 16){
+    return NULL;
+  }
+  return rr->rdata;
+}
+
+int
+resolv_rr_srv(const RESOLV_MSG *msg, const RESOLV_RR *rr, RESOLV_SRV *srv){
+  int end = rr->rdata_off + rr->rdlength;
+
+  if (rr->type != RESOLV_TYPE_SRV || rr->rdlength < 7){
+    return -1;
+  }
+  srv->priority = get16(rr->rdata);
+  srv->weight = get16(rr->rdata + 2);
+  srv->port = get16(rr->rdata + 4);
+  srv->target_off = (u16_t)(rr->rdata_off + 6);
+  if (name_skip(msg->buf, end, srv->target_off) != end){
+    return -1; // the target must fill the rest of the record exactly
+  }
+  return 0;
+}
+
+int
+resolv_rr_cname(const RESOLV_MSG *msg, const RESOLV_RR *rr){
+  int end = rr->rdata_off + rr->rdlength;
+
+  if (rr->type != RESOLV_TYPE_CNAME || name_skip(msg->buf, end, rr->rdata_off) != end){
+    return -1;
+  }
+  return rr->rdata_off;
+}
+
+int
+resolv_rr_soa(const RESOLV_MSG *msg, const RESOLV_RR *rr, RESOLV_SOA *soa){
+  int end = rr->rdata_off + rr->rdlength;
+  int off;
+
+  if (rr->type != RESOLV_TYPE_SOA){
+    return -1;
+  }
+  soa->mname_off = rr->rdata_off;
+  off = name_skip(msg->buf, end, rr->rdata_off);
+  if (off < 0){
+    return -1;
+  }
+  soa->rname_off = (u16_t) off;
+  off = name_skip(msg->buf, end, off);
+  if (off < 0 || off + DNS_SOA_FIXED_LEN != end){
+    return -1;
+  }
+  soa->serial = get32(msg->buf + off);
+  soa->refresh = get32(msg->buf + off + 4);
+  soa->retry = get32(msg->buf + off + 8);
+  soa->expire = get32(msg->buf + off + 12);
+  soa->minimum = get32(msg->buf + off + 16);
+  return 0;
+}
@@ -0,0 +1,197 @@
+/** @file sti_rr.h
+ *  @brief Walk the resource records of a DNS responce in place
+ *
+ *  The functions in this file read a responce returned by res_query() without
+ *  copying it and without allocating memory. A RESOLV_MSG is set up over the
+ *  buffer, then resolv_rr_next() returns one resource record at a time from the
+ *  answer, authority and additional sections. Records refer back into the buffer,
+ *  and names are kept as offsets so compression pointers (rfc 1035 4.1.4) can be
+ *  followed only when a name is actually needed.
+ *
+ *  Every offset and length read from the message is checked against the end of
+ *  the buffer, compression pointers must point backwards and expanded names are
+ *  limited to 255 bytes, so malformed or hostile responces are rejected rather
+ *  than read past.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_RR_H
+#define STI_RR_H
+
+#define RESOLV_TYPE_A 1 /**< host address */
+#define RESOLV_TYPE_NS 2 /**< authoritative name server */
+#define RESOLV_TYPE_CNAME 5 /**< canonical name for an alias */
+#define RESOLV_TYPE_SOA 6 /**< start of a zone of authority */
+#define RESOLV_TYPE_TXT 16 /**< text strings */
+#define RESOLV_TYPE_AAAA 28 /**< IPv6 host address, rfc 3596 */
+#define RESOLV_TYPE_SRV 33 /**< service location, rfc 2782 */
+#define RESOLV_TYPE_OPT 41 /**< EDNS0 pseudo record, rfc 6891 */
+#define RESOLV_CLASS_IN 1 /**< the Internet class */
+
+#define RESOLV_FLAG1_TC 0x02 /**< flags1: the responce was truncated */
+#define RESOLV_RCODE(msg) ((msg)->flags2 & 0x0F) /**< responce code, 0 is no error */
+
+#define RESOLV_NAME_MAX 255 /**< longest encoded name allowed by rfc 1035 */
+
+/** @brief The section of the message a resource record was found in */
+typedef enum e_RESOLV_SECTION {
+  RESOLV_SECTION_ANSWER = 0,
+  RESOLV_SECTION_AUTHORITY,
+  RESOLV_SECTION_ADDITIONAL
+} RESOLV_SECTION;
+
+/** @brief A responce being walked. Set up by resolv_msg_init() */
+typedef struct s_RESOLV_MSG {
+  const unsigned char *buf; /**< start of the responce, the DNS header */
+  u16_t len; /**< length of the responce */
+  u16_t id; /**< transaction ID */
+  u8_t flags1; /**< QR| Opcode |AA|TC|RD */
+  u8_t flags2; /**< RA| Z | RCODE */
+  u16_t qdcount; /**< entries in the question section */
+  u16_t ancount; /**< records in the answer section */
+  u16_t nscount; /**< records in the authority section */
+  u16_t arcount; /**< records in the additional section */
+  u16_t question_off; /**< offset of the first question */
+  u16_t next_off; /**< offset of the next record resolv_rr_next() returns */
+  u16_t next_index; /**< number of records already returned */
+} RESOLV_MSG;
+
+/** @brief One resource record. The fields point into the walked buffer */
+typedef struct s_RESOLV_RR {
+  RESOLV_SECTION section; /**< section the record was found in */
+  u16_t name_off; /**< offset of the owner name, may be compressed */
+  u16_t type; /**< RR type, e.g. RESOLV_TYPE_A */
+  u16_t class; /**< RR class, e.g. RESOLV_CLASS_IN */
+  u32_t ttl; /**< time to live in seconds */
+  u16_t ttl_off; /**< offset of the TTL field, used to age a cached copy */
+  u16_t rdlength; /**< length of the record data */
+  u16_t rdata_off; /**< offset of the record data */
+  const unsigned char *rdata; /**< the record data */
+} RESOLV_RR;
+
+/** @brief The record data of an SRV record, rfc 2782 */
+typedef struct s_RESOLV_SRV {
+  u16_t priority; /**< lower values are tried first */
+  u16_t weight; /**< relative weight among records of the same priority */
+  u16_t port; /**< port of the service on the target */
+  u16_t target_off; /**< offset of the target host name */
+} RESOLV_SRV;
+
+/** @brief The record data of an SOA record */
+typedef struct s_RESOLV_SOA {
+  u16_t mname_off; /**< offset of the primary name server name */
+  u16_t rname_off; /**< offset of the responsible mailbox name */
+  u32_t serial; /**< zone serial number */
+  u32_t refresh; /**< seconds before the zone should be refreshed */
+  u32_t retry; /**< seconds before a failed refresh is retried */
+  u32_t expire; /**< seconds until the zone is no longer authoritative */
+  u32_t minimum; /**< TTL for negative responces, rfc 2308 */
+} RESOLV_SOA;
+
+/** @brief set up a walk over a responce
+  *
+  * Reads the header and steps over the question section.
+  * @param msg  the walk state to initialize
+  * @param buf  the responce
+  * @param len  length of the responce
+  * @returns 0 on success, -1 if the header or question section is malformed */
+int
+resolv_msg_init(RESOLV_MSG *msg, const unsigned char *buf, int len);
+
+/** @brief set up a walk over a responce held in a pbuf chain
+  *
+  * A single pbuf is walked in place. A chain is first gathered into scratch with
+  * pbuf_get_contiguous(), so scratch must be as large as the responce in that case.
+  * @param msg  the walk state to initialize
+  * @param p  the responce, e.g. from res_query_pbuf()
+  * @param scratch  buffer used only when the responce spans several pbufs, may be NULL
+  * @param scratch_len  size of scratch
+  * @returns 0 on success, -1 if the responce is malformed or does not fit scratch */
+int
+resolv_msg_init_pbuf(RESOLV_MSG *msg, const struct pbuf *p,
+                     unsigned char *scratch, int scratch_len);
+
+/** @brief get the next resource record
+  *
+  * Records are returned in order from the answer, authority and additional sections.
+  * @param msg  the walk state
+  * @param rr  filled with the record
+  * @returns 1 if a record was returned, 0 at the end of the message, -1 if the
+  * record is malformed */
+int
+resolv_rr_next(RESOLV_MSG *msg, RESOLV_RR *rr);
+
+/** @brief step over an encoded name
+  *
+  * Checks the labels of the name and every name reached through compression pointers.
+  * @param msg  the message holding the name
+  * @param off  offset of the name
+  * @returns offset of the first byte after the name, -1 if the name is malformed */
+int
+resolv_name_skip(const RESOLV_MSG *msg, int off);
+
+/** @brief write an encoded name as dotted text, e.g. "xmpp.dismail.de"
+  * @param msg  the message holding the name
+  * @param off  offset of the name
+  * @param out  buffer for the text, always 0 terminated when outlen > 0
+  * @param outlen  size of out
+  * @returns length of the text, -1 if the name is malformed or does not fit */
+int
+resolv_name_text(const RESOLV_MSG *msg, int off, char *out, int outlen);
+
+/** @brief compare two encoded names without regard to case
+  * @param a  message holding the first name
+  * @param a_off  offset of the first name
+  * @param b  message holding the second name, may be the same as a
+  * @param b_off  offset of the second name
+  * @returns 1 if the names are equal, 0 if not or if either is malformed */
+int
+resolv_name_equal(const RESOLV_MSG *a, int a_off, const RESOLV_MSG *b, int b_off);
+
+/** @brief get the address of an A record
+  * @returns pointer to the 4 address bytes in network order, NULL if rr is not a valid A record */
+const unsigned char *
+resolv_rr_a(const RESOLV_RR *rr);
+
+/** @brief get the address of an AAAA record
+  * @returns pointer to the 16 address bytes in network order, NULL if rr is not a valid AAAA record */
+const unsigned char *
+resolv_rr_aaaa(const RESOLV_RR *rr);
+
+/** @brief decode an SRV record
+  * @returns 0 on success, -1 if rr is not a valid SRV record */
+int
+resolv_rr_srv(const RESOLV_MSG *msg, const RESOLV_RR *rr, RESOLV_SRV *srv);
+
+/** @brief get the canonical name of a CNAME record
+  * @returns offset of the canonical name, -1 if rr is not a valid CNAME record */
+int
+resolv_rr_cname(const RESOLV_MSG *msg, const RESOLV_RR *rr);
+
+/** @brief decode an SOA record
+  * @returns 0 on success, -1 if rr is not a valid SOA record */
+int
+resolv_rr_soa(const RESOLV_MSG *msg, const RESOLV_RR *rr, RESOLV_SOA *soa);
+
+#endif /* STI_RR_H */
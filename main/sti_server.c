@@ -0,0 +1,282 @@
+/** @file sti_server.c
+ *  @brief The DNS servers the resolver may ask, ranked by how well they answer
+ *
+ *  See sti_server.h. The round trip time estimate follows
+ *  rfc 6298 Computing TCP's Retransmission Timer.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_server.h"
+
+/* Retransmission timeout used before the first RTT has been measured, in milliseconds */
+#ifdef CONFIG_STI_RESOLV_RTO_INIT_MS
+#define RESOLV_RTO_INIT_MS CONFIG_STI_RESOLV_RTO_INIT_MS
+#else
+#define RESOLV_RTO_INIT_MS 500
+#endif
+
+#define RESOLV_RTO_MIN_MS 50 // never retransmit sooner than this
+#define RESOLV_RTO_MAX_MS 4000 // timeouts stop growing here
+#define RESOLV_SERVER_DEAD_FAILS 3 // unanswered queries in a row before a server is demoted
+#define RESOLV_SERVER_HOLDDOWN_MS 30000 // how long a demoted server stays at the back
+
+/** @brief Round trip time estimate and health of one DNS server */
+typedef struct s_RESOLV_SERVER {
+  ip_addr_t addr; /**< address of the server, port 53 */
+  u32_t srtt; /**< smoothed round trip time in ms, 0 until the first sample */
+  u32_t rttvar; /**< round trip time variation in ms */
+  u32_t rto; /**< retransmission timeout in ms */
+  u8_t failures; /**< queries in a row the server did not answer */
+  u32_t dead_until; /**< sti_now_ms() when a demoted server is tried again */
+  u32_t sent; /**< queries sent, see RESOLV_SERVER_STATS */
+  u32_t answered; /**< responces received */
+  u32_t timeouts; /**< queries not answered within the timeout */
+} RESOLV_SERVER;
+
+static RESOLV_SERVER servers[RESOLV_MAX_SERVERS]; /**< the server table */
+static int nservers; /**< number of entries in use */
+static sti_mutex_t server_mutex = NULL; /**< guards servers */
+static ip_addr_t staged[RESOLV_MAX_SERVERS]; /**< list for server_unstage(), guarded by server_mutex */
+static int nstaged = -1; /**< number of addresses in staged, -1 if nothing is staged */
+
+/** @brief 1 if the server has been demoted and its hold down time has not passed */
+static int
+server_dead(const RESOLV_SERVER *server, u32_t now){
+  return server->failures >= RESOLV_SERVER_DEAD_FAILS &&
+         (s32_t)(server->dead_until - now) > 0;
+}
+
+err_t
+server_init(void){
+  if (server_mutex == NULL){
+    server_mutex = sti_mutex_create();
+    if (server_mutex == NULL){
+      return ERR_MEM;
+    }
+  }
+  return ERR_OK;
+}
+
+int
+server_set(const ip_addr_t *addrs, int count, int *moved){
+  RESOLV_SERVER old[RESOLV_MAX_SERVERS];
+  int nold;
+
+  if (count > RESOLV_MAX_SERVERS){
+    count = RESOLV_MAX_SERVERS;
+  }
+  sti_mutex_lock(server_mutex);
+  memcpy(old, servers, sizeof(old));
+  nold = nservers;
+  memset(servers, 0, sizeof(servers));
+  for (int j = 0; moved != NULL && j < RESOLV_MAX_SERVERS; j++){
+    moved[j] = -1;
+  }
+  for (int i = 0; i < count; i++){
+    ip_addr_copy(servers[i].addr, addrs[i]);
+    servers[i].rto = RESOLV_RTO_INIT_MS;
+    for (int j = 0; j < nold; j++){
+      if (ip_addr_cmp(&old[j].addr, &addrs[i])){
+        servers[i] = old[j]; // a server that stays keeps what was learned of it
+        if (moved != NULL){
+          moved[j] = i;
+        }
+        break;
+      }
+    }
+  }
+  nservers = count;
+  sti_mutex_unlock(server_mutex);
+  return count;
+}
+
+int
+server_stage(const ip_addr_t *addrs, int count){
+  int first;
+
+  if (count > RESOLV_MAX_SERVERS){
+    count = RESOLV_MAX_SERVERS;
+  }
+  sti_mutex_lock(server_mutex);
+  first = nstaged < 0; // otherwise an install is pending and takes the newer list
+  memcpy(staged, addrs, count * sizeof(ip_addr_t));
+  nstaged = count;
+  sti_mutex_unlock(server_mutex);
+  return first;
+}
+
+int
+server_unstage(ip_addr_t *addrs){
+  int count;
+
+  sti_mutex_lock(server_mutex);
+  count = nstaged;
+  if (count > 0){
+    memcpy(addrs, staged, count * sizeof(ip_addr_t));
+  }
+  nstaged = -1;
+  sti_mutex_unlock(server_mutex);
+  return count;
+}
+
+int
+server_count(void){
+  return nservers;
+}
+
+const ip_addr_t *
+server_addr(int server){
+  return &servers[server].addr;
+}
+
+int
+server_find(const ip_addr_t *addr){
+  for (int i = 0; i < nservers; i++){
+    if (ip_addr_cmp(&servers[i].addr, addr)){
+      return i;
+    }
+  }
+  return -1;
+}
+
+int
+server_pick(int rank){
+  int order[RESOLV_MAX_SERVERS];
+  u32_t now = sti_now_ms();
+  int n, tmp;
+
+  sti_mutex_lock(server_mutex);
+  n = nservers;
+  for (int i = 0; i < n; i++){
+    order[i] = i;
+  }
+  // insertion sort: live servers by timeout, then demoted ones, list order breaks ties
+  for (int i = 1; i < n; i++){
+    for (int j = i; j > 0; j--){
+      RESOLV_SERVER *a = &servers[order[j - 1]];
+      RESOLV_SERVER *b = &servers[order[j]];
+      int a_dead = server_dead(a, now);
+      int b_dead = server_dead(b, now);
+      if (a_dead < b_dead || (a_dead == b_dead && a->rto <= b->rto)){
+        break;
+      }
+      tmp = order[j - 1];
+      order[j - 1] = order[j];
+      order[j] = tmp;
+    }
+  }
+  sti_mutex_unlock(server_mutex);
+  return (n > 0) ? order[rank % n] : 0;
+}
+
+u32_t
+server_rto(int server){
+  return servers[server].rto;
+}
+
+void
+server_sent(int server){
+  sti_mutex_lock(server_mutex);
+  servers[server].sent++;
+  sti_mutex_unlock(server_mutex);
+}
+
+void
+server_answered(int server, s32_t rtt){
+  RESOLV_SERVER *s = &servers[server];
+  u32_t delta;
+
+  sti_mutex_lock(server_mutex);
+  s->answered++;
+  s->failures = 0;
+  if (rtt >= 0){
+    // rfc 6298 2.2 and 2.3
+    if (s->srtt == 0){
+      s->srtt = rtt ? rtt : 1;
+      s->rttvar = rtt / 2;
+    }
+    else{
+      delta = (s->srtt > (u32_t) rtt) ? s->srtt - rtt : rtt - s->srtt;
+      s->rttvar = (3 * s->rttvar + delta) / 4;
+      s->srtt = (7 * s->srtt + rtt) / 8;
+    }
+    s->rto = s->srtt + 4 * s->rttvar;
+    if (s->rto < RESOLV_RTO_MIN_MS){
+      s->rto = RESOLV_RTO_MIN_MS;
+    }
+    if (s->rto > RESOLV_RTO_MAX_MS){
+      s->rto = RESOLV_RTO_MAX_MS;
+    }
+  }
+  sti_mutex_unlock(server_mutex);
+}
+
+void
+server_failed(int server){
+  RESOLV_SERVER *s = &servers[server];
+
+  sti_mutex_lock(server_mutex);
+  s->timeouts++;
+  if (s->failures < 255){
+    s->failures++;
+  }
+  // rfc 6298 5.5: back the timer off until the server answers again
+  s->rto = (s->rto * 2 > RESOLV_RTO_MAX_MS) ? RESOLV_RTO_MAX_MS : s->rto * 2;
+  if (s->failures >= RESOLV_SERVER_DEAD_FAILS){
+    s->dead_until = sti_now_ms() + RESOLV_SERVER_HOLDDOWN_MS;
+  }
+  sti_mutex_unlock(server_mutex);
+}
+
+int
+server_get_stats(RESOLV_SERVER_STATS *stats){
+  int n;
+
+  sti_mutex_lock(server_mutex);
+  n = nservers;
+  for (int i = 0; i < n; i++){
+    ip_addr_copy(stats[i].addr, servers[i].addr);
+    stats[i].srtt = servers[i].srtt;
+    stats[i].rto = servers[i].rto;
+    stats[i].sent = servers[i].sent;
+    stats[i].answered = servers[i].answered;
+    stats[i].timeouts = servers[i].timeouts;
+  }
+  sti_mutex_unlock(server_mutex);
+  return n;
+}
+
+void
+server_reset_stats(void){
+  sti_mutex_lock(server_mutex);
+  for (int i = 0; i < nservers; i++){
+    servers[i].sent = 0;
+    servers[i].answered = 0;
+    servers[i].timeouts = 0;
+  }
+  sti_mutex_unlock(server_mutex);
+}
@@ -0,0 +1,117 @@
+/** @file sti_server.h
+ *  @brief The DNS servers the resolver may ask, ranked by how well they answer
+ *
+ *  Each server keeps a smoothed round trip time and retransmission timeout as in
+ *  rfc 6298 and a count of consecutive unanswered queries. Queries go to the
+ *  server with the lowest timeout; a server that misses RESOLV_SERVER_DEAD_FAILS
+ *  queries in a row is moved behind the others for RESOLV_SERVER_HOLDDOWN_MS and
+ *  then tried again. This header is internal to the resolver.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_SERVER_H
+#define STI_SERVER_H
+
+/** @brief create the lock that guards the server table
+  * @returns ERR_OK or ERR_MEM */
+err_t
+server_init(void);
+
+/** @brief replace the server list. A server that stays in the list keeps its
+  * statistics, those of a new one start over. Must be called in the network
+  * context once the resolver runs, with resolv_reqs_mutex held so that the server
+  * indices of pending requests can be moved along
+  * @param servers  the server addresses, the first is preferred until RTTs are known
+  * @param count  number of servers, at most RESOLV_MAX_SERVERS are used
+  * @param moved  if not NULL, set for every old index to the new index of that
+  * server, -1 if it left the list; RESOLV_MAX_SERVERS entries
+  * @returns the number of servers in use */
+int
+server_set(const ip_addr_t *servers, int count, int *moved);
+
+/** @brief keep a server list for server_unstage(), replacing one kept before
+  * @param servers  the server addresses
+  * @param count  number of servers, at least 1
+  * @returns 1 if no list was kept before, so the caller must arrange for
+  * server_unstage() to be called, 0 if that is already pending */
+int
+server_stage(const ip_addr_t *servers, int count);
+
+/** @brief take the list kept by server_stage()
+  * @param servers  receives the addresses, RESOLV_MAX_SERVERS entries
+  * @returns the number of servers, -1 if no list is kept */
+int
+server_unstage(ip_addr_t *servers);
+
+/** @brief number of servers in use */
+int
+server_count(void);
+
+/** @brief address of a server
+  * @param server  index of the server */
+const ip_addr_t *
+server_addr(int server);
+
+/** @brief find the server a datagram came from
+  * @returns index of the server, -1 if the address is not one of ours */
+int
+server_find(const ip_addr_t *addr);
+
+/** @brief the server that should get the rank-th attempt of a query
+  * rank 0 is the best server, rank 1 the next best and so on, wrapping around
+  * @returns index of the server */
+int
+server_pick(int rank);
+
+/** @brief the retransmission timeout of a server in milliseconds */
+u32_t
+server_rto(int server);
+
+/** @brief record a query sent to a server
+  * @param server  index of the server */
+void
+server_sent(int server);
+
+/** @brief record an answer from a server
+  * @param server  index of the server
+  * @param rtt  measured round trip time in ms, or -1 if it could not be timed */
+void
+server_answered(int server, s32_t rtt);
+
+/** @brief record a query the server did not answer within its timeout
+  * @param server  index of the server */
+void
+server_failed(int server);
+
+/** @brief copy the counters of every server
+  * @param stats  filled with one entry per server
+  * @returns the number of servers */
+int
+server_get_stats(RESOLV_SERVER_STATS *stats);
+
+/** @brief set the query counters of every server to 0 */
+void
+server_reset_stats(void);
+
+#endif /* STI_SERVER_H */
@@ -0,0 +1,278 @@
+/** @file sti_srv.c
+ *  @brief Resolve an SRV name to an ordered list of endpoints in one call
+ *
+ *  See sti_srv.h. Key references are
+ *  (1) rfc 2782 A DNS RR for specifying the location of services (DNS SRV)
+ *  (2) rfc 1035 4.1 the additional section carries records that help use the answer
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_resolv_priv.h"
+#include "sti_rr.h"
+#include "sti_srv.h"
+
+#define SRV_TARGET_ADDRS 8 // addresses of a target without glue that are used
+
+/** @brief One SRV record and the lookup of its target */
+typedef struct s_SRV_TARGET {
+  u16_t priority; /**< from the SRV record */
+  u16_t weight; /**< from the SRV record */
+  u16_t port; /**< from the SRV record */
+  u16_t target_off; /**< offset of the target name in the SRV responce */
+  u32_t ttl; /**< TTL of the SRV record */
+  u8_t glue; /**< set to 1 if the additional section has an address for the target */
+} SRV_TARGET;
+
+/** @brief put the SRV records in the order they should be tried (rfc 2782)
+  *
+  * Records are sorted by priority. Within a priority, records of weight 0 are
+  * placed first, then each position is filled by a weighted random choice among
+  * the records not yet placed, so a record is chosen with probability
+  * weight / (sum of the remaining weights). */
+static void
+srv_order(SRV_TARGET *t, int n){
+  SRV_TARGET tmp;
+  u32_t sum, pick, running;
+  int end, j;
+
+  // insertion sort on (priority, weight != 0), stable
+  for (int i = 1; i < n; i++){
+    tmp = t[i];
+    for (j = i; j > 0 && (t[j - 1].priority > tmp.priority ||
+         (t[j - 1].priority == tmp.priority && t[j - 1].weight != 0 && tmp.weight == 0)); j--){
+      t[j] = t[j - 1];
+    }
+    t[j] = tmp;
+  }
+
+  for (int start = 0; start < n; start = end){
+    for (end = start; end < n && t[end].priority == t[start].priority; end++){
+    }
+    for (int pos = start; pos < end - 1; pos++){
+      sum = 0;
+      for (j = pos; j < end; j++){
+        sum += t[j].weight;
+      }
+      pick = sti_random() % (sum + 1);
+      running = 0;
+      for (j = pos; j < end - 1; j++){
+        running += t[j].weight;
+        if (running >= pick){
+          break;
+        }
+      }
+      tmp = t[pos];
+      t[pos] = t[j];
+      t[j] = tmp;
+    }
+  }
+}
+
+/** @brief What srv_found() needs to know about the target being handed over */
+typedef struct s_SRV_FOUND_CTX {
+  resolv_found_fn fn; /**< the caller's function */
+  void *ctx; /**< the caller's context */
+  RESOLV_SRV srv; /**< the SRV record of the target */
+  u32_t ttl; /**< TTL of the SRV record */
+  int n; /**< addresses of the target handed over so far */
+} SRV_FOUND_CTX;
+
+/** @brief resolv_found_fn that adds the SRV record to an address of its target */
+static int
+srv_found(void *ctx, const RESOLV_FOUND *found){
+  SRV_FOUND_CTX *sctx = (SRV_FOUND_CTX *) ctx;
+  RESOLV_FOUND endpoint = *found;
+
+  if (sctx->n++ >= SRV_TARGET_ADDRS){
+    return 1; // enough of this target, go on with the next one
+  }
+  endpoint.srv = &sctx->srv;
+  endpoint.ttl = (sctx->ttl < found->ttl) ? sctx->ttl : found->ttl;
+  return sctx->fn(sctx->ctx, &endpoint);
+}
+
+/** @brief hand the addresses the additional section holds for a target to srv_found()
+  * @returns 0 if the caller asked to stop, 1 otherwise */
+static int
+srv_glue(const RESOLV_MSG *msg, SRV_FOUND_CTX *sctx){
+  RESOLV_MSG walk = *msg;
+  RESOLV_RR rr;
+  RESOLV_FOUND found;
+  const unsigned char *ip;
+
+  found.msg = msg;
+  found.srv = NULL;
+  while (resolv_rr_next(&walk, &rr) > 0){
+    if (rr.section != RESOLV_SECTION_ADDITIONAL ||
+        !resolv_name_equal(&walk, rr.name_off, &walk, sctx->srv.target_off)){
+      continue;
+    }
+    memset(&found.addr, 0, sizeof(ip_addr_t));
+    if ((ip = resolv_rr_a(&rr)) != NULL){
+      found.addr.type = IPADDR_TYPE_V4;
+      memcpy(&found.addr.u_addr.ip4.addr, ip, 4);
+    }
+    else if ((ip = resolv_rr_aaaa(&rr)) != NULL){
+      found.addr.type = IPADDR_TYPE_V6;
+      memcpy(found.addr.u_addr.ip6.addr, ip, 16);
+    }
+    else{
+      continue;
+    }
+    found.ttl = rr.ttl;
+    found.name_off = rr.name_off;
+    if (!srv_found(sctx, &found)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void
+srv_resolve(const char *name, resolv_found_fn fn, void *ctx){
+  static const char *TAG = "res_query_srv";
+  SRV_TARGET targets[RESOLV_SRV_MAX_RECORDS];
+  ADDR_LOOKUP lookups[RESOLV_SRV_MAX_RECORDS];
+  char target_name[RESOLV_NAME_MAX + 1];
+  SRV_FOUND_CTX sctx;
+  RESOLV_MSG msg, amsg;
+  RESOLV_RR rr;
+  RESOLV_SRV srv;
+  SRV_TARGET *t;
+  struct pbuf *p = NULL;
+  sti_event_t event;
+  int ntargets = 0;
+  int go = 1;
+
+  if (res_query_pbuf(name, RESOLV_CLASS_IN, RESOLV_TYPE_SRV, &p) <= 0){
+    return;
+  }
+  p = resolv_pbuf_contiguous(p);
+  if (p == NULL || resolv_msg_init_pbuf(&msg, p, NULL, 0) != 0 || RESOLV_RCODE(&msg) != 0){
+    if (p != NULL){
+      pbuf_free(p);
+    }
+    return;
+  }
+
+  // collect the SRV records, then note which targets have glue
+  amsg = msg;
+  while (resolv_rr_next(&amsg, &rr) > 0){
+    if (rr.section == RESOLV_SECTION_ANSWER && resolv_rr_srv(&amsg, &rr, &srv) == 0 &&
+        ntargets < RESOLV_SRV_MAX_RECORDS){
+      if (msg.buf[srv.target_off] == 0){
+        continue; // rfc 2782: a target of "." means the service is not available here
+      }
+      t = &targets[ntargets++];
+      memset(t, 0, sizeof(SRV_TARGET));
+      t->priority = srv.priority;
+      t->weight = srv.weight;
+      t->port = srv.port;
+      t->target_off = srv.target_off;
+      t->ttl = rr.ttl;
+    }
+    else if (rr.section == RESOLV_SECTION_ADDITIONAL &&
+             (rr.type == RESOLV_TYPE_A || rr.type == RESOLV_TYPE_AAAA)){
+      for (int i = 0; i < ntargets; i++){
+        if (!targets[i].glue && resolv_name_equal(&amsg, rr.name_off, &amsg, targets[i].target_off)){
+          targets[i].glue = 1;
+        }
+      }
+    }
+  }
+  srv_order(targets, ntargets);
+
+  // targets without glue are looked up together, not one after another,
+  // each with its A and AAAA queries at the same time
+  event = resolv_event_get();
+  for (int i = 0; i < ntargets; i++){
+    t = &targets[i];
+    if (!t->glue && event != NULL &&
+        resolv_name_text(&msg, t->target_off, target_name, sizeof(target_name)) > 0){
+      STI_LOGD(TAG, "...no glue for %s, looking it up", target_name);
+      addr_lookup_start(&lookups[i], target_name, event);
+    }
+    else{
+      addr_lookup_start(&lookups[i], NULL, event);
+    }
+  }
+  if (event != NULL){
+    addr_lookup_wait(lookups, ntargets, event);
+    resolv_event_put(event);
+  }
+
+  sctx.fn = fn;
+  sctx.ctx = ctx;
+  for (int i = 0; i < ntargets; i++){
+    t = &targets[i];
+    sctx.srv.priority = t->priority;
+    sctx.srv.weight = t->weight;
+    sctx.srv.port = t->port;
+    sctx.srv.target_off = t->target_off;
+    sctx.ttl = t->ttl;
+    sctx.n = 0;
+    if (t->glue){
+      go = go && srv_glue(&msg, &sctx);
+    }
+    else{
+      // the responces of every lookup are freed, also once the caller has enough
+      go = addr_lookup_each(&lookups[i], go ? srv_found : NULL, &sctx) && go;
+    }
+  }
+  pbuf_free(p);
+}
+
+/** @brief where srv_collect() puts the endpoints of res_query_srv() */
+typedef struct s_SRV_ARRAY {
+  RESOLV_ENDPOINT *endpoints; /**< the caller's array */
+  int max; /**< number of entries in endpoints */
+  int n; /**< number of entries written */
+} SRV_ARRAY;
+
+/** @brief resolv_found_fn of res_query_srv() */
+static int
+srv_collect(void *ctx, const RESOLV_FOUND *found){
+  SRV_ARRAY *array = (SRV_ARRAY *) ctx;
+  RESOLV_ENDPOINT *e = &array->endpoints[array->n];
+
+  e->priority = found->srv->priority;
+  e->weight = found->srv->weight;
+  e->port = found->srv->port;
+  ip_addr_copy(e->addr, found->addr);
+  return ++array->n < array->max;
+}
+
+int
+res_query_srv(const char *name, RESOLV_ENDPOINT *endpoints, int max_endpoints){
+  SRV_ARRAY array = {endpoints, max_endpoints, 0};
+
+  if (max_endpoints > 0){
+    srv_resolve(name, srv_collect, &array);
+  }
+  return array.n;
+}
@@ -0,0 +1,64 @@
+/** @file sti_srv.h
+ *  @brief Resolve an SRV name to an ordered list of endpoints in one call
+ *
+ *  res_query_srv() asks for the SRV records of a service, takes the addresses of
+ *  the targets from the additional section when the server sent them (glue),
+ *  looks up the remaining targets in parallel and returns the endpoints in the
+ *  order rfc 2782 says they should be tried. In the common case, where the
+ *  server includes glue, this costs one round trip.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_SRV_H
+#define STI_SRV_H
+
+#define RESOLV_SRV_MAX_RECORDS 8 /**< SRV records of one name that are considered */
+
+/** @brief An address and port a service can be reached at */
+typedef struct s_RESOLV_ENDPOINT {
+  u16_t priority; /**< priority of the SRV record, lower values are tried first */
+  u16_t weight; /**< weight of the SRV record */
+  u16_t port; /**< port of the service */
+  ip_addr_t addr; /**< an address of the SRV target */
+} RESOLV_ENDPOINT;
+
+/** @brief resolve an SRV name, e.g. "_xmpp-client._tcp.example.com", to endpoints
+  *
+  * The endpoints are sorted by priority; within a priority the SRV records are
+  * put in a weighted random order (rfc 2782), so repeated calls spread clients
+  * over the targets. A target with several addresses gives one endpoint per
+  * address. Glue addresses keep the order the server listed them in. Targets
+  * missing from the additional section are looked up together, each as
+  * res_query_addr() would, and their addresses alternate between the families.
+  * The calling task blocks until all lookups have completed.
+  * @param name  the SRV owner name
+  * @param endpoints  filled with the endpoints in the order they should be tried
+  * @param max_endpoints  number of entries in endpoints
+  * @returns the number of endpoints written, 0 if the name has no usable SRV records
+  * or the service is marked as not available (a single target of ".")
+  */
+int
+res_query_srv(const char *name, RESOLV_ENDPOINT *endpoints, int max_endpoints);
+
+#endif /* STI_SRV_H */
@@ -0,0 +1,423 @@
+/** @file sti_tcp.c
+ *  @brief DNS over TCP transport used when a UDP responce is truncated
+ *
+ *  See sti_tcp.h. Key references are
+ *  (1) rfc 1035 4.2.2 TCP usage, messages are prefixed with a two byte length
+ *  (2) rfc 7766 DNS Transport over TCP - Implementation Requirements
+ *
+ *  The connection is driven through the sti_tcp_* calls of the port layer, in
+ *  the network context. Calls that start in an application task get there with
+ *  sti_net_call().
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include "sti_port.h"
+#include "sti_resolv.h"
+#include "sti_resolv_priv.h"
+#include "sti_tcp.h"
+#include "sti_server.h"
+#include "sti_pool.h"
+
+#ifndef DNS_SERVER_PORT
+#define DNS_SERVER_PORT 53
+#endif
+
+/* Close the connection after this many milliseconds without an outstanding query */
+#ifdef CONFIG_STI_RESOLV_TCP_IDLE_MS
+#define RESOLV_TCP_IDLE_MS CONFIG_STI_RESOLV_TCP_IDLE_MS
+#else
+#define RESOLV_TCP_IDLE_MS 10000
+#endif
+
+/* The number of queries that may be queued or outstanding on the connection */
+#ifdef CONFIG_STI_RESOLV_MAX_PENDING
+#define TCP_MAX_QUERIES CONFIG_STI_RESOLV_MAX_PENDING
+#else
+#define TCP_MAX_QUERIES 16
+#endif
+
+#define TCP_LEN_PREFIX 2 // every message on the stream starts with its length
+#define TCP_QUERY_MAX (TCP_LEN_PREFIX + sizeof(RFC1035_HDR) + RESOLV_QUESTION_MAX)
+/* The longest responce taken from the stream. rx_chain never holds more than the
+ * prefix and one incomplete message, so its u16_t tot_len cannot overflow */
+#define TCP_MSG_MAX 16384
+
+/** @brief State of the connection to the DNS server */
+typedef enum e_TCP_CONN_STATE {
+  CONN_CLOSED = 0, /**< no connection */
+  CONN_CONNECTING, /**< SYN sent, waiting for the connected callback */
+  CONN_OPEN        /**< queries can be written */
+} TCP_CONN_STATE;
+
+/** @brief A query queued for, or outstanding on, the connection */
+typedef struct s_TCP_QUERY {
+  u8_t in_use; /**< set to 1 while the request waits for its responce */
+  u8_t sent; /**< set to 1 once written to the current connection */
+  u16_t id; /**< transaction ID in host byte order */
+  u16_t len; /**< bytes in msg, including the length prefix */
+  unsigned char msg[TCP_QUERY_MAX]; /**< length prefix, header and question */
+} TCP_QUERY;
+
+static TCP_QUERY tcp_queries[TCP_MAX_QUERIES]; /**< outbound query table */
+static sti_mutex_t tcp_mutex = NULL; /**< guards tcp_queries */
+static TCP_CONN_STATE conn_state = CONN_CLOSED; /**< network context only */
+static struct pbuf *rx_chain = NULL; /**< received bytes not yet forming a message */
+static u32_t last_activity; /**< sti_now_ms() of the last byte sent or received */
+static ip_addr_t conn_addr; /**< the DNS server the connection goes to */
+static int connect_failures; /**< servers that refused a connect since the last one opened */
+
+static void conn_drop(int was_open);
+static void conn_shutdown(void);
+static void conn_connect(void);
+static void conn_fail(err_t err);
+static void conn_next_server(void);
+
+/** @brief number of queries in the table. Called with tcp_mutex held */
+static int
+queries_in_use(void){
+  int n = 0;
+
+  for (int i = 0; i < TCP_MAX_QUERIES; i++){
+    n += tcp_queries[i].in_use;
+  }
+  return n;
+}
+
+/** @brief write every query not yet sent on the open connection */
+static void
+conn_send_queued(void){
+  int written = 0;
+
+  sti_mutex_lock(tcp_mutex);
+  for (int i = 0; i < TCP_MAX_QUERIES; i++){
+    TCP_QUERY *q = &tcp_queries[i];
+    if (q->in_use == 0 || q->sent){
+      continue;
+    }
+    if (sti_tcp_write(q->msg, q->len) != ERR_OK){
+      break; // send buffer full, the rest goes from conn_sent
+    }
+    q->sent = 1;
+    written++;
+  }
+  sti_mutex_unlock(tcp_mutex);
+  if (written){
+    sti_tcp_output();
+    last_activity = sti_now_ms();
+  }
+}
+
+/** @brief hand every complete message in rx_chain to the request table */
+static void
+conn_extract_messages(void){
+  unsigned char prefix[TCP_LEN_PREFIX];
+  struct pbuf *msg;
+  u16_t msg_len;
+  u16_t id;
+
+  while (rx_chain != NULL && rx_chain->tot_len >= TCP_LEN_PREFIX){
+    pbuf_copy_partial(rx_chain, prefix, TCP_LEN_PREFIX, 0);
+    msg_len = (prefix[0] << 8) | prefix[1];
+    if (msg_len > TCP_MSG_MAX){
+      conn_fail(ERR_VAL); // longer than any answer we ask for, the stream is broken
+      return;
+    }
+    if (rx_chain->tot_len < TCP_LEN_PREFIX + msg_len){
+      return; // wait for the rest of the message
+    }
+    msg = pool_pbuf_alloc(msg_len);
+    if (msg != NULL){
+      pbuf_copy_partial(rx_chain, msg->payload, msg_len, TCP_LEN_PREFIX);
+    }
+    rx_chain = pbuf_free_header(rx_chain, TCP_LEN_PREFIX + msg_len);
+    if (msg == NULL || msg_len < sizeof(RFC1035_HDR)){
+      if (msg != NULL){
+        pbuf_free(msg);
+      }
+      continue;
+    }
+    id = (((unsigned char *)msg->payload)[0] << 8) | ((unsigned char *)msg->payload)[1];
+    tcp_query_cancel(id); // answered, whether or not a request still wants it
+    resolv_deliver(msg, RESOLV_SERVER_TCP);
+  }
+}
+
+/** @brief recv callback: collect the stream and split it into messages */
+static void
+conn_recv(struct pbuf *p){
+  if (p == NULL){
+    conn_drop(1); // the server closed the connection
+    return;
+  }
+  last_activity = sti_now_ms();
+  if (rx_chain != NULL && (u32_t) rx_chain->tot_len + p->tot_len > 0xFFFF){
+    pbuf_free(p);
+    conn_fail(ERR_VAL); // tot_len would overflow
+    return;
+  }
+  if (rx_chain == NULL){
+    rx_chain = p;
+  }
+  else{
+    pbuf_cat(rx_chain, p);
+  }
+  conn_extract_messages();
+}
+
+/** @brief sent callback: there is room again for queries that did not fit */
+static void
+conn_sent(void){
+  conn_send_queued();
+}
+
+/** @brief connected callback */
+static void
+conn_connected(void){
+  conn_state = CONN_OPEN;
+  connect_failures = 0;
+  last_activity = sti_now_ms();
+  conn_send_queued();
+}
+
+/** @brief poll callback: close the connection once it has been idle long enough */
+static void
+conn_poll(void){
+  int busy;
+
+  sti_mutex_lock(tcp_mutex);
+  busy = queries_in_use();
+  sti_mutex_unlock(tcp_mutex);
+  if (busy == 0 && (u32_t)(sti_now_ms() - last_activity) >= RESOLV_TCP_IDLE_MS){
+    conn_shutdown();
+  }
+}
+
+/** @brief err callback: the port has already forgotten the connection
+  * A connect that failed is tried with the next server at once. */
+static void
+conn_err(void){
+  int was_open = conn_state == CONN_OPEN;
+
+  conn_state = CONN_CLOSED;
+  if (was_open){
+    conn_drop(1);
+    return;
+  }
+  conn_drop(0);
+  connect_failures++;
+  conn_next_server();
+  conn_connect();
+}
+
+static const STI_TCP_CALLBACKS conn_callbacks = {
+  .connected = conn_connected,
+  .recv = conn_recv,
+  .sent = conn_sent,
+  .err = conn_err,
+  .poll = conn_poll
+};
+
+/** @brief complete every query in the table with an error, e.g. when no server
+  * takes a connection, and abort the connection if there is one */
+static void
+conn_fail(err_t err){
+  u16_t ids[TCP_MAX_QUERIES];
+  int n = 0;
+
+  conn_drop(0);
+  sti_mutex_lock(tcp_mutex);
+  for (int i = 0; i < TCP_MAX_QUERIES; i++){
+    if (tcp_queries[i].in_use){
+      ids[n++] = tcp_queries[i].id;
+      tcp_queries[i].in_use = 0;
+    }
+  }
+  sti_mutex_unlock(tcp_mutex);
+  resolv_tcp_failed(ids, n, err);
+}
+
+/** @brief move conn_addr on to the server after it in the server list */
+static void
+conn_next_server(void){
+  if (server_count() > 0){
+    ip_addr_copy(conn_addr, *server_addr((server_find(&conn_addr) + 1) % server_count()));
+  }
+}
+
+/** @brief connect to conn_addr, or to the next server while connects fail
+  * at once. Once every server has failed, the waiting queries fail with ERR_CONN
+  * rather than wait for their timeout. */
+static void
+conn_connect(void){
+  int busy;
+
+  sti_mutex_lock(tcp_mutex);
+  busy = queries_in_use();
+  sti_mutex_unlock(tcp_mutex);
+  if (busy == 0){
+    connect_failures = 0;
+    return; // every query was answered or cancelled meanwhile
+  }
+  while (connect_failures < server_count()){
+    if (sti_tcp_connect(&conn_addr, DNS_SERVER_PORT, &conn_callbacks) == ERR_OK){
+      conn_state = CONN_CONNECTING;
+      return;
+    }
+    connect_failures++;
+    conn_next_server();
+  }
+  connect_failures = 0;
+  conn_fail(ERR_CONN);
+}
+
+/** @brief forget the connection and prepare outstanding queries for a new one
+  *
+  * rfc 7766 6.2.1: queries that were sent but not answered when the connection
+  * went away are sent again on a new connection. */
+static void
+conn_drop(int was_open){
+  int retry;
+
+  if (conn_state != CONN_CLOSED){
+    sti_tcp_abort();
+  }
+  conn_state = CONN_CLOSED;
+  if (rx_chain != NULL){
+    pbuf_free(rx_chain);
+    rx_chain = NULL;
+  }
+
+  sti_mutex_lock(tcp_mutex);
+  for (int i = 0; i < TCP_MAX_QUERIES; i++){
+    tcp_queries[i].sent = 0;
+  }
+  retry = was_open && queries_in_use() > 0;
+  sti_mutex_unlock(tcp_mutex);
+  if (retry){
+    tcp_query_kick(&conn_addr);
+  }
+}
+
+void
+tcp_query_kick(const ip_addr_t *server){
+  if (conn_state == CONN_OPEN){
+    conn_send_queued();
+    return;
+  }
+  if (conn_state == CONN_CONNECTING){
+    return; // conn_connected sends the queue
+  }
+  ip_addr_copy(conn_addr, *server);
+  connect_failures = 0;
+  conn_connect();
+}
+
+err_t
+tcp_query_init(void){
+  if (tcp_mutex == NULL){
+    tcp_mutex = sti_mutex_create();
+    if (tcp_mutex == NULL){
+      return ERR_MEM;
+    }
+  }
+  return ERR_OK;
+}
+
+err_t
+tcp_query_enqueue(u16_t id, const unsigned char *question, int question_len){
+  TCP_QUERY *q = NULL;
+  RFC1035_HDR *hdr;
+  u16_t msg_len = sizeof(RFC1035_HDR) + question_len;
+
+  sti_mutex_lock(tcp_mutex);
+  for (int i = 0; i < TCP_MAX_QUERIES; i++){
+    if (tcp_queries[i].in_use == 0){
+      q = &tcp_queries[i];
+      break;
+    }
+  }
+  if (q == NULL){
+    sti_mutex_unlock(tcp_mutex);
+    return ERR_MEM;
+  }
+  q->msg[0] = (unsigned char)(msg_len >> 8);
+  q->msg[1] = (unsigned char) msg_len;
+  hdr = (RFC1035_HDR *)(q->msg + TCP_LEN_PREFIX);
+  memset(hdr, 0, sizeof(RFC1035_HDR));
+  hdr->id = htons(id);
+  hdr->flags1 = DNS_FLAG1_RD;
+  hdr->qdcount = htons(1);
+  memcpy(q->msg + TCP_LEN_PREFIX + sizeof(RFC1035_HDR), question, question_len);
+  q->len = TCP_LEN_PREFIX + msg_len;
+  q->id = id;
+  q->sent = 0;
+  q->in_use = 1;
+  sti_mutex_unlock(tcp_mutex);
+  return ERR_OK;
+}
+
+void
+tcp_query_cancel(u16_t id){
+  if (tcp_mutex == NULL){
+    return;
+  }
+  sti_mutex_lock(tcp_mutex);
+  for (int i = 0; i < TCP_MAX_QUERIES; i++){
+    if (tcp_queries[i].in_use && tcp_queries[i].id == id){
+      tcp_queries[i].in_use = 0;
+    }
+  }
+  sti_mutex_unlock(tcp_mutex);
+}
+
+/** @brief close the connection gracefully, or abort it if it is still connecting
+  * Must be called in the network context. */
+static void
+conn_shutdown(void){
+  if (conn_state == CONN_OPEN){
+    sti_tcp_close();
+    conn_state = CONN_CLOSED;
+  }
+  conn_drop(0);
+}
+
+/** @brief sti_net_call target for tcp_query_close() */
+static void
+conn_close_cb(void *ctx){
+  if (tcp_mutex != NULL){
+    sti_mutex_lock(tcp_mutex);
+    for (int i = 0; i < TCP_MAX_QUERIES; i++){
+      tcp_queries[i].in_use = 0;
+    }
+    sti_mutex_unlock(tcp_mutex);
+  }
+  conn_shutdown();
+}
+
+void
+tcp_query_close(void){
+  sti_net_call(conn_close_cb, NULL);
+}
@@ -0,0 +1,77 @@
+/** @file sti_tcp.h
+ *  @brief DNS over TCP transport used when a UDP responce is truncated
+ *
+ *  Follows rfc 7766: one connection to the DNS server is kept open between
+ *  queries, several queries may be outstanding on it at once and responces are
+ *  matched to requests by transaction ID in whatever order they arrive. The
+ *  connection is closed after CONFIG_STI_RESOLV_TCP_IDLE_MS without traffic.
+ *  This header is internal to the resolver.
+ *
+ *  Copyright 2021 Jim Sutton <jamespsutton@cox.net>
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is furnished
+ *  to do so, subject to the following conditions:
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+
+ *
+ *  @author Jim Sutton <jamespsutton@cox.net>
+ *  @bug No known bugs.
+ */
+
+#ifndef STI_TCP_H
+#define STI_TCP_H
+
+/* Ask truncated questions again over TCP */
+#ifdef CONFIG_STI_RESOLV_TCP
+#define RESOLV_TCP 1
+#else
+#define RESOLV_TCP 0
+#endif
+
+/** @brief create the lock that guards the outbound query table
+  * @returns ERR_OK or ERR_MEM */
+err_t
+tcp_query_init(void);
+
+/** @brief queue a question to be asked over TCP
+  *
+  * The query is written as soon as the connection is up. Call tcp_query_kick()
+  * once the request table lock is released.
+  * @param id  transaction ID of the request, in host byte order
+  * @param question  the encoded question
+  * @param question_len  length of the encoded question
+  * @returns ERR_OK, or ERR_MEM if the outbound table is full */
+err_t
+tcp_query_enqueue(u16_t id, const unsigned char *question, int question_len);
+
+/** @brief forget a queued or outstanding query, e.g. after its request timed out
+  * @param id  transaction ID of the request */
+void
+tcp_query_cancel(u16_t id);
+
+/** @brief open the connection if needed and write every queued query
+  * Must be called in the network context, e.g. from the UDP receive callback.
+  * @param server  the DNS server to connect to if no connection is open; an open
+  * connection is kept even if it goes to another server. If the connect fails the
+  * next server is tried at once; if every server fails the queued queries complete
+  * with ERR_CONN */
+void
+tcp_query_kick(const ip_addr_t *server);
+
+/** @brief close the connection. Safe to call from any task */
+void
+tcp_query_close(void);
+
+#endif /* STI_TCP_H */